@@ -0,0 +1,562 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// An address prefix of an ACL rule.
+struct acl_prefix {
+	bool present; // false: rule does not restrict this field
+	int family; // AF_INET or AF_INET6
+	uint8_t addr[16];
+	unsigned int len;
+};
+
+// A port range of an ACL rule.
+struct acl_port_range {
+	bool present; // false: rule does not restrict this field
+	uint16_t lo;
+	uint16_t hi;
+};
+
+// An ACL rule as read from the rule file.
+struct acl_rule_spec {
+	uint32_t action; // enum acl_action
+	int family; // AF_UNSPEC if the rule applies to IPv4 and IPv6
+	struct acl_prefix src;
+	struct acl_prefix dst;
+	int proto; // -1: any protocol
+	struct acl_port_range sport;
+	struct acl_port_range dport;
+};
+
+// The ACL maps pinned by the running instance of the program.
+struct acl_maps {
+	int config_fd;
+	int src_v4_fd;
+	int dst_v4_fd;
+	int src_v6_fd;
+	int dst_v6_fd;
+	int l4_fd;
+	int rules_fd;
+	int stats_fd;
+};
+
+static void acl_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE acl load FILE\n"
+		"%s -d DEVICE acl stats\n"
+		"  FILE contains one rule per line, ordered by priority:\n"
+		"  pass|drop|count [proto tcp|udp|sctp|icmp|icmp6|NUM] [src PREFIX] [dst PREFIX]\n"
+		"                  [sport PORT[-PORT]] [dport PORT[-PORT]]\n"
+		"  Packets not matching any pass or drop rule pass. Lines starting with # are ignored.\n",
+		prog, prog);
+}
+
+static int parse_prefix(const char *str, struct acl_prefix *prefix)
+{
+	char buf[INET6_ADDRSTRLEN + 4];
+	unsigned int maxlen;
+
+	strncpy(buf, str, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	char *slash = strchr(buf, '/');
+	if (slash != NULL)
+		*slash = '\0';
+
+	memset(prefix, 0, sizeof(*prefix));
+	if (inet_pton(AF_INET, buf, prefix->addr) == 1) {
+		prefix->family = AF_INET;
+		maxlen = 32;
+	} else if (inet_pton(AF_INET6, buf, prefix->addr) == 1) {
+		prefix->family = AF_INET6;
+		maxlen = 128;
+	} else {
+		return -1;
+	}
+
+	prefix->len = maxlen;
+	if (slash != NULL) {
+		char *end;
+		prefix->len = strtoul(slash + 1, &end, 10);
+		if (*end != '\0' || prefix->len > maxlen)
+			return -1;
+	}
+
+	// Clear host bits, so prefixes can be compared bytewise.
+	for (unsigned int bit = prefix->len; bit < maxlen; bit++)
+		prefix->addr[bit/8] &= ~(0x80 >> (bit%8));
+	prefix->present = true;
+
+	return 0;
+}
+
+static int parse_port_range(const char *str, struct acl_port_range *range)
+{
+	char *end;
+	unsigned long lo = strtoul(str, &end, 10);
+	unsigned long hi = lo;
+
+	if (*end == '-')
+		hi = strtoul(end + 1, &end, 10);
+	if (*end != '\0' || lo > hi || hi > 65535)
+		return -1;
+
+	range->present = true;
+	range->lo = lo;
+	range->hi = hi;
+
+	return 0;
+}
+
+static int parse_proto(const char *str)
+{
+	if (strcmp(str, "tcp") == 0)
+		return IPPROTO_TCP;
+	if (strcmp(str, "udp") == 0)
+		return IPPROTO_UDP;
+	if (strcmp(str, "sctp") == 0)
+		return IPPROTO_SCTP;
+	if (strcmp(str, "icmp") == 0)
+		return IPPROTO_ICMP;
+	if (strcmp(str, "icmp6") == 0)
+		return IPPROTO_ICMPV6;
+
+	char *end;
+	unsigned long proto = strtoul(str, &end, 10);
+	if (*end != '\0' || proto > 255)
+		return -1;
+
+	return proto;
+}
+
+static int parse_rule(char *line, struct acl_rule_spec *rule)
+{
+	memset(rule, 0, sizeof(*rule));
+	rule->proto = -1;
+	rule->family = AF_UNSPEC;
+
+	char *tok = strtok(line, " \t\r\n");
+	if (strcmp(tok, "pass") == 0)
+		rule->action = ACL_ACTION_PASS;
+	else if (strcmp(tok, "drop") == 0)
+		rule->action = ACL_ACTION_DROP;
+	else if (strcmp(tok, "count") == 0)
+		rule->action = ACL_ACTION_COUNT;
+	else
+		return -1;
+
+	while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+		char *arg = strtok(NULL, " \t\r\n");
+		if (arg == NULL)
+			return -1;
+
+		int err;
+		if (strcmp(tok, "proto") == 0)
+			err = (rule->proto = parse_proto(arg)) < 0;
+		else if (strcmp(tok, "src") == 0)
+			err = parse_prefix(arg, &rule->src);
+		else if (strcmp(tok, "dst") == 0)
+			err = parse_prefix(arg, &rule->dst);
+		else if (strcmp(tok, "sport") == 0)
+			err = parse_port_range(arg, &rule->sport);
+		else if (strcmp(tok, "dport") == 0)
+			err = parse_port_range(arg, &rule->dport);
+		else
+			err = -1;
+		if (err)
+			return -1;
+	}
+
+	// A rule with an IPv4 or IPv6 prefix only applies to this address family.
+	if (rule->src.present)
+		rule->family = rule->src.family;
+	if (rule->dst.present) {
+		if (rule->family != AF_UNSPEC && rule->family != rule->dst.family)
+			return -1;
+		rule->family = rule->dst.family;
+	}
+
+	return 0;
+}
+
+static void set_rule_bit(struct acl_bitmap *bitmap, size_t rule)
+{
+	bitmap->bits[rule/64] |= 1ULL << (rule%64);
+}
+
+// Returns true if prefix outer contains prefix inner (both of the same family).
+static bool prefix_contains(const struct acl_prefix *outer, const struct acl_prefix *inner)
+{
+	if (outer->len > inner->len)
+		return false;
+
+	for (unsigned int bit = 0; bit < outer->len; bit++) {
+		uint8_t mask = 0x80 >> (bit%8);
+		if ((outer->addr[bit/8] & mask) != (inner->addr[bit/8] & mask))
+			return false;
+	}
+
+	return true;
+}
+
+// Bitmap of all rules matching the given prefix in the given field (source or destination).
+// Since an LPM trie only returns the longest matching prefix, the bitmap of a prefix
+// also contains all rules with shorter prefixes containing it, and all rules not
+// restricting this field.
+static void prefix_bitmap(const struct acl_rule_spec *rules, size_t nrules, bool src,
+			  const struct acl_prefix *prefix, struct acl_bitmap *bitmap)
+{
+	memset(bitmap, 0, sizeof(*bitmap));
+	for (size_t r = 0; r < nrules; r++) {
+		if (rules[r].family != AF_UNSPEC && rules[r].family != prefix->family)
+			continue;
+		const struct acl_prefix *p = src ? &rules[r].src : &rules[r].dst;
+		if (!p->present || prefix_contains(p, prefix))
+			set_rule_bit(bitmap, r);
+	}
+}
+
+// Write the LPM trie of one field and address family for the given set.
+static int write_lpm_map(int map_fd, uint32_t set, int family, bool src,
+			 const struct acl_rule_spec *rules, size_t nrules)
+{
+	size_t addr_len = (family == AF_INET) ? 4 : 16;
+	size_t key_size = (family == AF_INET) ?
+		sizeof(struct acl_lpm_v4_key) : sizeof(struct acl_lpm_v6_key);
+	// At most one prefix per rule plus the default prefix of length 0.
+	char *keys = calloc(nrules + 1, key_size);
+	struct acl_bitmap *bitmaps = calloc(nrules + 1, sizeof(*bitmaps));
+	size_t count = 0;
+	int ret = -1;
+
+	if (keys == NULL || bitmaps == NULL)
+		goto out;
+
+	for (size_t r = 0; r <= nrules; r++) {
+		struct acl_prefix prefix = {
+			.present = true,
+			.family = family,
+			.len = 0, // default prefix, i.e., wildcard
+		};
+		if (r < nrules) {
+			prefix = src ? rules[r].src : rules[r].dst;
+			if (!prefix.present || prefix.family != family)
+				continue;
+		}
+
+		// Both key structs start with prefixlen and set, followed by the address.
+		struct acl_lpm_v6_key *key = (struct acl_lpm_v6_key *) (keys + count*key_size);
+		key->prefixlen = 32 + prefix.len;
+		key->set = set;
+		memcpy(key->addr, prefix.addr, addr_len);
+		prefix_bitmap(rules, nrules, src, &prefix, &bitmaps[count]);
+		count++;
+	}
+
+	ret = map_update_entries(map_fd, keys, key_size, bitmaps, sizeof(*bitmaps), count);
+
+out:
+	free(keys);
+	free(bitmaps);
+	return ret;
+}
+
+static bool port_in_range(const struct acl_port_range *range, unsigned int port)
+{
+	return !range->present || (port >= range->lo && port <= range->hi);
+}
+
+// Write the protocol, source port, and destination port entries for the given set.
+static int write_l4_map(int map_fd, uint32_t set, const struct acl_rule_spec *rules,
+			size_t nrules)
+{
+	// Protocols: 256 values, ports: 65536 values per field, plus three wildcard entries.
+	size_t capacity = 256 + 2*65536 + 3;
+	struct acl_l4_key *keys = calloc(capacity, sizeof(*keys));
+	struct acl_bitmap *bitmaps = calloc(capacity, sizeof(*bitmaps));
+	size_t count = 0;
+	int ret = -1;
+
+	if (keys == NULL || bitmaps == NULL)
+		goto out;
+
+	for (uint8_t field = ACL_FIELD_PROTO; field <= ACL_FIELD_DPORT; field++) {
+		// Wildcard entry: all rules not restricting this field.
+		keys[count] = (struct acl_l4_key) {
+			.set = set,
+			.field = field | ACL_FIELD_WILDCARD,
+		};
+		for (size_t r = 0; r < nrules; r++) {
+			bool any = (field == ACL_FIELD_PROTO) ? rules[r].proto < 0 :
+				(field == ACL_FIELD_SPORT) ? !rules[r].sport.present :
+				!rules[r].dport.present;
+			if (any)
+				set_rule_bit(&bitmaps[count], r);
+		}
+		struct acl_bitmap wildcard = bitmaps[count];
+		count++;
+
+		// One entry for every value restricted by at least one rule.
+		unsigned int nvalues = (field == ACL_FIELD_PROTO) ? 256 : 65536;
+		for (unsigned int value = 0; value < nvalues; value++) {
+			bool restricted = false;
+			struct acl_bitmap bitmap = wildcard;
+			for (size_t r = 0; r < nrules; r++) {
+				bool match;
+				if (field == ACL_FIELD_PROTO)
+					match = rules[r].proto >= 0 && rules[r].proto == value;
+				else if (field == ACL_FIELD_SPORT)
+					match = rules[r].sport.present && port_in_range(&rules[r].sport, value);
+				else
+					match = rules[r].dport.present && port_in_range(&rules[r].dport, value);
+				if (match) {
+					set_rule_bit(&bitmap, r);
+					restricted = true;
+				}
+			}
+			if (!restricted)
+				continue;
+
+			keys[count] = (struct acl_l4_key) {
+				.set = set,
+				.field = field,
+				.value = value,
+			};
+			bitmaps[count] = bitmap;
+			count++;
+		}
+	}
+
+	ret = map_update_entries(map_fd, keys, sizeof(*keys), bitmaps, sizeof(*bitmaps), count);
+
+out:
+	free(keys);
+	free(bitmaps);
+	return ret;
+}
+
+// Delete all entries of the given set from a map. key_size is the size of the
+// key, and set_of returns the set of a key.
+static int clear_set(int map_fd, size_t key_size, uint32_t set,
+		     uint32_t (*set_of)(const void *key))
+{
+	char key[key_size], next_key[key_size];
+	bool more = (bpf_map_get_next_key(map_fd, NULL, key) == 0);
+
+	// Keys are deleted after getting the next key, so iteration is not restarted.
+	while (more) {
+		more = (bpf_map_get_next_key(map_fd, key, next_key) == 0);
+		if (set_of(key) == set && bpf_map_delete_elem(map_fd, key) != 0)
+			return -1;
+		memcpy(key, next_key, key_size);
+	}
+
+	return 0;
+}
+
+static uint32_t lpm_key_set(const void *key)
+{
+	// struct acl_lpm_v4_key and struct acl_lpm_v6_key share the first two members.
+	return ((const struct acl_lpm_v4_key *) key)->set;
+}
+
+static uint32_t l4_key_set(const void *key)
+{
+	return ((const struct acl_l4_key *) key)->set;
+}
+
+static int open_acl_maps(const char *ifname, struct acl_maps *maps)
+{
+	maps->config_fd = open_pinned_map(ifname, "xdp_config_map");
+	maps->src_v4_fd = open_pinned_map(ifname, "xdp_acl_src_v4_map");
+	maps->dst_v4_fd = open_pinned_map(ifname, "xdp_acl_dst_v4_map");
+	maps->src_v6_fd = open_pinned_map(ifname, "xdp_acl_src_v6_map");
+	maps->dst_v6_fd = open_pinned_map(ifname, "xdp_acl_dst_v6_map");
+	maps->l4_fd = open_pinned_map(ifname, "xdp_acl_l4_map");
+	maps->rules_fd = open_pinned_map(ifname, "xdp_acl_rules_map");
+	maps->stats_fd = open_pinned_map(ifname, "xdp_acl_stats_map");
+
+	if (maps->config_fd < 0 || maps->src_v4_fd < 0 || maps->dst_v4_fd < 0 ||
+	    maps->src_v6_fd < 0 || maps->dst_v6_fd < 0 || maps->l4_fd < 0 ||
+	    maps->rules_fd < 0 || maps->stats_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+// Write the rules to the inactive set and activate it.
+static int acl_write(struct acl_maps *maps, const struct acl_rule_spec *rules, size_t nrules)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0) {
+		perror("Could not read configuration");
+		return EXIT_FAIL_FINDELEM;
+	}
+	uint32_t set = !(cfg.acl_set & 1);
+
+	// Remove the rules of the inactive set written by the load before the last one.
+	if (clear_set(maps->src_v4_fd, sizeof(struct acl_lpm_v4_key), set, lpm_key_set) != 0 ||
+	    clear_set(maps->dst_v4_fd, sizeof(struct acl_lpm_v4_key), set, lpm_key_set) != 0 ||
+	    clear_set(maps->src_v6_fd, sizeof(struct acl_lpm_v6_key), set, lpm_key_set) != 0 ||
+	    clear_set(maps->dst_v6_fd, sizeof(struct acl_lpm_v6_key), set, lpm_key_set) != 0 ||
+	    clear_set(maps->l4_fd, sizeof(struct acl_l4_key), set, l4_key_set) != 0) {
+		perror("Could not clear inactive ACL rules");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	// Write actions and reset counters of the rules.
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_UPDATE;
+	struct acl_rule_stats zero_stats[ncpus];
+	memset(zero_stats, 0, sizeof(zero_stats));
+	for (uint32_t r = 0; r < ACL_MAX_RULES; r++) {
+		uint32_t index = set*ACL_MAX_RULES + r;
+		struct acl_rule rule = {
+			.action = r < nrules ? rules[r].action : ACL_ACTION_PASS,
+		};
+		if (bpf_map_update_elem(maps->rules_fd, &index, &rule, BPF_ANY) != 0 ||
+		    bpf_map_update_elem(maps->stats_fd, &index, zero_stats, BPF_ANY) != 0) {
+			perror("Could not write ACL rules");
+			return EXIT_FAIL_UPDATE;
+		}
+	}
+
+	// Write the bitmaps of the individual fields.
+	if (write_lpm_map(maps->src_v4_fd, set, AF_INET, true, rules, nrules) != 0 ||
+	    write_lpm_map(maps->dst_v4_fd, set, AF_INET, false, rules, nrules) != 0 ||
+	    write_lpm_map(maps->src_v6_fd, set, AF_INET6, true, rules, nrules) != 0 ||
+	    write_lpm_map(maps->dst_v6_fd, set, AF_INET6, false, rules, nrules) != 0 ||
+	    write_l4_map(maps->l4_fd, set, rules, nrules) != 0) {
+		perror("Could not write ACL maps");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	// Atomically switch to the new set. The BPF program reads the configuration
+	// once per packet, so a packet is either classified by the old or the new set.
+	cfg.acl_set = set;
+	cfg.acl_enabled = (nrules > 0);
+	cfg.acl_num_rules = nrules;
+	if (bpf_map_update_elem(maps->config_fd, &config_key, &cfg, BPF_ANY) != 0) {
+		perror("Could not write configuration");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return EXIT_OK;
+}
+
+static int acl_load(struct acl_maps *maps, const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		perror("Could not open ACL file");
+		return EXIT_FAIL_USAGE;
+	}
+
+	struct acl_rule_spec rules[ACL_MAX_RULES];
+	size_t nrules = 0;
+	char line[512];
+	unsigned int lineno = 0;
+	int exitcode = EXIT_OK;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+
+		char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#')
+			continue; // empty line or comment
+
+		if (nrules == ACL_MAX_RULES) {
+			fprintf(stderr, "Too many rules (maximum is %d)\n", ACL_MAX_RULES);
+			exitcode = EXIT_FAIL_USAGE;
+			goto out;
+		}
+		if (parse_rule(start, &rules[nrules]) != 0) {
+			fprintf(stderr, "%s:%u: invalid rule\n", filename, lineno);
+			exitcode = EXIT_FAIL_USAGE;
+			goto out;
+		}
+		nrules++;
+	}
+
+	exitcode = acl_write(maps, rules, nrules);
+	if (exitcode == EXIT_OK)
+		printf("Loaded %zu ACL rules\n", nrules);
+
+out:
+	fclose(f);
+	return exitcode;
+}
+
+static int acl_stats(struct acl_maps *maps)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0)
+		return EXIT_FAIL_FINDELEM;
+	if (!cfg.acl_enabled) {
+		printf("ACL disabled\n");
+		return EXIT_OK;
+	}
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_FINDELEM;
+	struct acl_rule_stats stats[ncpus];
+
+	for (uint32_t r = 0; r < cfg.acl_num_rules; r++) {
+		uint32_t index = (cfg.acl_set & 1)*ACL_MAX_RULES + r;
+		if (bpf_map_lookup_elem(maps->stats_fd, &index, stats) != 0)
+			return EXIT_FAIL_FINDELEM;
+
+		struct acl_rule_stats sum = {};
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			sum.packets += stats[cpu].packets;
+			sum.bytes += stats[cpu].bytes;
+		}
+		printf("Rule %u: %lu packets (%lu bytes)\n", r, sum.packets, sum.bytes);
+	}
+
+	return EXIT_OK;
+}
+
+int do_acl(const char *ifname, int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("acl").
+	if (argc < 2) {
+		acl_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Open maps pinned by the running instance of the program.
+	struct acl_maps maps;
+	if (open_acl_maps(ifname, &maps) != 0) {
+		fprintf(stderr, "Could not open pinned ACL maps (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	if (strcmp(argv[1], "load") == 0 && argc > 2) {
+		int exitcode = acl_load(&maps, argv[2]);
+		// Activate or deactivate the pipeline stage depending on the number of rules.
+		if (exitcode == EXIT_OK)
+			exitcode = pipeline_sync(ifname);
+		return exitcode;
+	} else if (strcmp(argv[1], "stats") == 0)
+		return acl_stats(&maps);
+
+	acl_usage("xdp-drop_and_count-user");
+	return EXIT_FAIL_USAGE;
+}
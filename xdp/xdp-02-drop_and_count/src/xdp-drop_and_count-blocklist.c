@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Initial capacity of the buffer for entries read from a file.
+#define BLOCKLIST_INITIAL_CAPACITY 4096
+
+// An entry read from a blocklist file.
+struct blocklist_entry {
+	struct hash_map_key key;
+	uint32_t flags;
+};
+
+static void blocklist_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE blocklist add MAC [dst|src|both]\n"
+		"%s -d DEVICE blocklist del MAC [dst|src|both]\n"
+		"%s -d DEVICE blocklist load FILE\n"
+		"  FILE contains one MAC address per line, optionally followed by dst, src, or both\n"
+		"  (default: dst). Lines starting with # are ignored.\n",
+		prog, prog, prog);
+}
+
+static int parse_direction(const char *str, uint32_t *direction)
+{
+	if (str == NULL || strcmp(str, "dst") == 0)
+		*direction = BLOCKLIST_DST;
+	else if (strcmp(str, "src") == 0)
+		*direction = BLOCKLIST_SRC;
+	else if (strcmp(str, "both") == 0)
+		*direction = BLOCKLIST_DST | BLOCKLIST_SRC;
+	else
+		return -1;
+
+	return 0;
+}
+
+static int blocklist_add(int map_fd, int bloom_fd, const struct hash_map_key *key,
+			 uint32_t direction)
+{
+	uint32_t flags = 0;
+
+	// Keep the directions that are already blocked for this MAC address.
+	bpf_map_lookup_elem(map_fd, key, &flags);
+	flags |= direction;
+
+	// Add to the bloom filter first. Otherwise, the BPF program might
+	// skip the hash map entry until the bloom filter has been updated.
+	// Bloom filters have no keys, so the key is NULL.
+	if (bpf_map_update_elem(bloom_fd, NULL, key, BPF_ANY) != 0) {
+		perror("Could not update bloom filter");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	if (bpf_map_update_elem(map_fd, key, &flags, BPF_ANY) != 0) {
+		perror("Could not update blocklist");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return EXIT_OK;
+}
+
+static int blocklist_del(int map_fd, const struct hash_map_key *key, uint32_t direction)
+{
+	uint32_t flags;
+
+	if (bpf_map_lookup_elem(map_fd, key, &flags) != 0) {
+		fprintf(stderr, "MAC address not in blocklist\n");
+		return EXIT_FAIL_FINDELEM;
+	}
+
+	// The bloom filter still contains the MAC address afterwards, which is
+	// just a false positive resolved by the hash map lookup.
+	flags &= ~direction;
+	if (flags == 0) {
+		if (bpf_map_delete_elem(map_fd, key) != 0) {
+			perror("Could not delete from blocklist");
+			return EXIT_FAIL_UPDATE;
+		}
+	} else if (bpf_map_update_elem(map_fd, key, &flags, BPF_EXIST) != 0) {
+		perror("Could not update blocklist");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return EXIT_OK;
+}
+
+// Order entries by MAC address, so duplicates are adjacent.
+static int compare_entries(const void *a, const void *b)
+{
+	return memcmp(&((const struct blocklist_entry *) a)->key,
+		      &((const struct blocklist_entry *) b)->key, sizeof(struct hash_map_key));
+}
+
+// Number of MAC addresses in the blocklist.
+static size_t blocklist_size(int map_fd)
+{
+	struct hash_map_key key, next_key;
+	struct hash_map_key *prev = NULL;
+	size_t n = 0;
+
+	while (bpf_map_get_next_key(map_fd, prev, &next_key) == 0) {
+		key = next_key;
+		prev = &key;
+		n++;
+	}
+
+	return n;
+}
+
+// Push count entries to the blocklist, using as few system calls as possible.
+// The batch update replaces the flags, so they must already include the
+// directions that are blocked in the map.
+static int blocklist_push(int map_fd, int bloom_fd, struct hash_map_key *keys,
+			  uint32_t *flags, size_t count)
+{
+	// The bloom filter does not support batch operations, so each MAC address
+	// requires one system call. Again, the bloom filter is updated first.
+	for (size_t i = 0; i < count; i++) {
+		if (bpf_map_update_elem(bloom_fd, NULL, &keys[i], BPF_ANY) != 0) {
+			perror("Could not update bloom filter");
+			return EXIT_FAIL_UPDATE;
+		}
+	}
+
+	if (map_update_entries(map_fd, keys, sizeof(*keys), flags, sizeof(*flags), count) != 0) {
+		perror("Could not update blocklist");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return EXIT_OK;
+}
+
+static int blocklist_load(int map_fd, int bloom_fd, const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		perror("Could not open blocklist file");
+		return EXIT_FAIL_USAGE;
+	}
+
+	struct blocklist_entry *entries = NULL;
+	struct hash_map_key *keys = NULL;
+	uint32_t *flags = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	int exitcode = EXIT_OK;
+
+	char line[128];
+	unsigned int lineno = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+
+		char *mac = strtok(line, " \t\r\n");
+		if (mac == NULL || mac[0] == '#')
+			continue; // empty line or comment
+		char *dir = strtok(NULL, " \t\r\n");
+
+		if (count == capacity) {
+			capacity = capacity ? 2*capacity : BLOCKLIST_INITIAL_CAPACITY;
+			struct blocklist_entry *e = realloc(entries, capacity*sizeof(*entries));
+			if (e == NULL) {
+				perror("Could not allocate memory");
+				exitcode = EXIT_FAIL_UPDATE;
+				goto out;
+			}
+			entries = e;
+		}
+
+		if (parse_mac(mac, entries[count].key.addr) != 0 ||
+		    parse_direction(dir, &entries[count].flags) != 0) {
+			fprintf(stderr, "%s:%u: invalid entry\n", filename, lineno);
+			exitcode = EXIT_FAIL_USAGE;
+			goto out;
+		}
+		count++;
+	}
+
+	if (count == 0)
+		goto out;
+
+	// Merge the directions of a MAC address listed more than once, since
+	// the batch update would keep only one of them.
+	qsort(entries, count, sizeof(*entries), compare_entries);
+	keys = malloc(count*sizeof(*keys));
+	flags = malloc(count*sizeof(*flags));
+	if (keys == NULL || flags == NULL) {
+		perror("Could not allocate memory");
+		exitcode = EXIT_FAIL_UPDATE;
+		goto out;
+	}
+
+	size_t nkeys = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (nkeys > 0 && memcmp(&keys[nkeys-1], &entries[i].key, sizeof(*keys)) == 0) {
+			flags[nkeys-1] |= entries[i].flags;
+			continue;
+		}
+		keys[nkeys] = entries[i].key;
+		flags[nkeys] = entries[i].flags;
+		nkeys++;
+	}
+
+	// As with blocklist add, keep the directions that are already blocked.
+	size_t nnew = 0;
+	for (size_t i = 0; i < nkeys; i++) {
+		uint32_t blocked;
+		if (bpf_map_lookup_elem(map_fd, &keys[i], &blocked) == 0)
+			flags[i] |= blocked;
+		else
+			nnew++;
+	}
+
+	if (blocklist_size(map_fd) + nnew > BLOCKLIST_MAX_ENTRIES) {
+		fprintf(stderr, "Too many entries (maximum is %d)\n", BLOCKLIST_MAX_ENTRIES);
+		exitcode = EXIT_FAIL_USAGE;
+		goto out;
+	}
+
+	exitcode = blocklist_push(map_fd, bloom_fd, keys, flags, nkeys);
+	if (exitcode == EXIT_OK)
+		printf("Loaded %zu blocklist entries\n", nkeys);
+
+out:
+	free(entries);
+	free(keys);
+	free(flags);
+	fclose(f);
+	return exitcode;
+}
+
+int do_blocklist(const char *ifname, int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("blocklist").
+	if (argc < 3) {
+		blocklist_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Open maps pinned by the running instance of the program.
+	int map_fd = open_pinned_map(ifname, "xdp_blocklist_map");
+	int bloom_fd = open_pinned_map(ifname, "xdp_blocklist_bloom");
+	if (map_fd < 0 || bloom_fd < 0) {
+		fprintf(stderr, "Could not open pinned blocklist maps (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	const char *cmd = argv[1];
+	if (strcmp(cmd, "load") == 0)
+		return blocklist_load(map_fd, bloom_fd, argv[2]);
+
+	struct hash_map_key key;
+	uint32_t direction;
+	if (parse_mac(argv[2], key.addr) != 0 ||
+	    parse_direction(argc > 3 ? argv[3] : NULL, &direction) != 0) {
+		blocklist_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	if (strcmp(cmd, "add") == 0)
+		return blocklist_add(map_fd, bloom_fd, &key, direction);
+	else if (strcmp(cmd, "del") == 0)
+		return blocklist_del(map_fd, &key, direction);
+
+	blocklist_usage("xdp-drop_and_count-user");
+	return EXIT_FAIL_USAGE;
+}
@@ -4,14 +4,15 @@
 #include <linux/bpf.h>
 #include <linux/if_ether.h>
 #include <linux/types.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
 
 #include "xdp-drop_and_count-commons.h"
 
-// Packets to this destination MAC address will be dropped; all others pass
-static const char eth_d_addr[] = {0x00,0x00,0x00,0x00,0x00,0x00};
-
 // Deprecated map definition (just for information)
 /*
 struct bpf_map_def SEC("maps") xdp_stats_map = {
@@ -23,47 +24,683 @@ struct bpf_map_def SEC("maps") xdp_stats_map = {
 */
 
 
-// A simple counter counting all drop packets.
+// Global counters of the interface, one entry per CPU (cf. struct cpu_counters).
+// The array is memory-mappable, so user space can read the counters without system calls.
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, COUNTERS_MAX_CPUS);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__type(key, uint32_t); // for arrays, the key is always a 32 bit uint
+	__type(value, struct cpu_counters);
+} xdp_counters_map SEC(".maps");
+
+// Per-MAC statistics. The LRU map inserts new MAC addresses on demand and evicts
+// the least recently used entries if the map is full.
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, STATS_PER_MAC_MAX_ENTRIES);
+	__type(key, struct hash_map_key); // keys can be arbitrary structs for hash maps
+	__type(value, struct hash_map_value); // values can be arbitrary structs for hash maps
+} xdp_stats_per_mac_map SEC(".maps");
+
+// Per-RX-queue statistics (cf. struct queue_stats).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, QUEUE_STATS_MAX_QUEUES);
+	__type(key, uint32_t);
+	__type(value, struct queue_stats);
+} xdp_queue_stats_map SEC(".maps");
+
+// Runtime configuration written by user space (cf. struct drop_config).
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
 	__uint(max_entries, 1);
-	__type(key, sizeof(uint32_t)); // for arrays, the key is always a 32 bit uint 
-	__type(value, sizeof(uint64_t));
-} xdp_drop_stats_map SEC(".maps");
+	__type(key, uint32_t);
+	__type(value, struct drop_config);
+} xdp_config_map SEC(".maps");
 
+// Ring buffer for sending drop events to user space. In contrast to a perf buffer,
+// the ring buffer is shared by all CPUs, and events are reserved and written in-place.
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, DROP_EVENTS_RINGBUF_SIZE);
+} xdp_drop_events SEC(".maps");
+
+// Blocklist of MAC addresses. The value defines whether packets to (BLOCKLIST_DST)
+// and/or from (BLOCKLIST_SRC) the MAC address are dropped; all others pass.
+// The map is updated by user space at runtime, so no reload is required to change the policy.
 struct {
 	__uint(type, BPF_MAP_TYPE_HASH);
-	__uint(max_entries, 1024);
-	__type(key, sizeof(struct hash_map_key)); // keys can be arbitrary structs for hash maps
-	__type(value, sizeof(struct hash_map_value)); // values can be arbitrary structs for hash maps 
-} xdp_stats_per_mac_map SEC(".maps");
+	__uint(max_entries, BLOCKLIST_MAX_ENTRIES);
+	__type(key, struct hash_map_key);
+	__type(value, uint32_t);
+} xdp_blocklist_map SEC(".maps");
 
-static __always_inline int make_drop_decision_eth(void *hdr,
-						  void *endptr)
+// Bloom filter containing all MAC addresses that were added to the blocklist.
+// A bloom filter has no false negatives, so if a MAC address is not in the
+// bloom filter, we can skip the more expensive hash map lookup. Bloom filters
+// do not support deletion; MAC addresses removed from the blocklist just cause
+// false positives, which are resolved by the hash map lookup.
+struct {
+	__uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+	__uint(max_entries, BLOCKLIST_MAX_ENTRIES);
+	__uint(map_extra, BLOCKLIST_BLOOM_HASHES); // number of hash functions
+	__type(value, struct hash_map_key); // bloom filters have no keys, only values
+} xdp_blocklist_bloom SEC(".maps");
+
+static __always_inline int is_blocked(const unsigned char *addr, uint32_t direction)
+{
+	struct hash_map_key key;
+	__builtin_memcpy(&key.addr, addr, sizeof(key.addr));
+
+	// Peeking into a bloom filter returns 0 if the value is possibly contained.
+	if (bpf_map_peek_elem(&xdp_blocklist_bloom, &key) != 0)
+		return 0;
+
+	uint32_t *flags = bpf_map_lookup_elem(&xdp_blocklist_map, &key);
+	if (flags == NULL)
+		return 0;
+
+	return (*flags & direction) != 0;
+}
+
+// Maximum number of stacked VLAN tags (802.1Q and 802.1ad) that are parsed.
+#define VLAN_MAX_DEPTH 2
+
+// The VLAN header is not part of the UAPI headers.
+struct vlan_hdr {
+	__be16 h_vlan_TCI;
+	__be16 h_vlan_encapsulated_proto;
+};
+
+// Header fields extracted by parse_headers().
+struct pkt_info {
+	uint16_t eth_proto; // EtherType of the L3 header after VLAN tags (host byte order)
+	uint16_t vlan_tci; // TCI of the outermost VLAN tag (host byte order)
+	uint8_t has_vlan; // 1 if the packet has a VLAN tag
+	uint8_t l4_proto; // L4 protocol number (IPv4 and IPv6 only)
+	uint8_t has_ports; // 1 if sport and dport are valid (TCP, UDP, SCTP; not for fragments)
+	uint16_t sport; // L4 source port (host byte order)
+	uint16_t dport; // L4 destination port (host byte order)
+	uint32_t l3_off; // offset of the L3 header from the start of the packet
+	uint32_t l4_off; // offset of the L4 header from the start of the packet
+	uint8_t saddr[16]; // IPv4 (first 4 bytes) or IPv6 source address
+	uint8_t daddr[16]; // IPv4 (first 4 bytes) or IPv6 destination address
+};
+
+// State of the packet passed between the stages of the pipeline.
+struct pipeline_scratch {
+	int reason; // drop reason decided so far (DROP_REASON_NONE: pass)
+	int parsed; // 1 if info is valid for the current packet
+	int l2_parsed; // 1 if at least the L2 fields of info (up to l3_off) are valid
+	struct pkt_info info;
+};
+
+// Per-CPU scratch space of the pipeline. All stages of a packet run on the same
+// CPU, and a CPU processes one packet at a time, so a single entry per CPU suffices.
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, uint32_t);
+	__type(value, struct pipeline_scratch);
+} xdp_scratch_map SEC(".maps");
+
+// Programs of the pipeline stages (index is enum pipeline_stage).
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, PIPELINE_MAX_STAGES);
+	__type(key, uint32_t);
+	__type(value, uint32_t);
+} xdp_pipeline_map SEC(".maps");
+
+// ACL: LPM tries for IPv4 and IPv6 source and destination prefixes.
+// LPM tries require BPF_F_NO_PREALLOC.
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, ACL_LPM_MAX_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct acl_lpm_v4_key);
+	__type(value, struct acl_bitmap);
+} xdp_acl_src_v4_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, ACL_LPM_MAX_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct acl_lpm_v4_key);
+	__type(value, struct acl_bitmap);
+} xdp_acl_dst_v4_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, ACL_LPM_MAX_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct acl_lpm_v6_key);
+	__type(value, struct acl_bitmap);
+} xdp_acl_src_v6_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, ACL_LPM_MAX_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct acl_lpm_v6_key);
+	__type(value, struct acl_bitmap);
+} xdp_acl_dst_v6_map SEC(".maps");
+
+// ACL: L4 protocol, source port, and destination port.
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, ACL_L4_MAX_ENTRIES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__type(key, struct acl_l4_key);
+	__type(value, struct acl_bitmap);
+} xdp_acl_l4_map SEC(".maps");
+
+// ACL: actions of the rules of both sets (index is set*ACL_MAX_RULES + rule).
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 2*ACL_MAX_RULES);
+	__type(key, uint32_t);
+	__type(value, struct acl_rule);
+} xdp_acl_rules_map SEC(".maps");
+
+// ACL: per-CPU counters of matching packets per rule (same index as xdp_acl_rules_map).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 2*ACL_MAX_RULES);
+	__type(key, uint32_t);
+	__type(value, struct acl_rule_stats);
+} xdp_acl_stats_map SEC(".maps");
+
+// Filters of both sets (index is set*FILTER_MAX_FILTERS + filter).
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 2*FILTER_MAX_FILTERS);
+	__type(key, uint32_t);
+	__type(value, struct filter);
+} xdp_filter_map SEC(".maps");
+
+// Per-CPU counters of matching packets per filter (same index as xdp_filter_map).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 2*FILTER_MAX_FILTERS);
+	__type(key, uint32_t);
+	__type(value, struct filter_stats);
+} xdp_filter_stats_map SEC(".maps");
+
+// Ring buffer for sending captured packets to user space (cf. struct capture_record).
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, CAPTURE_RINGBUF_SIZE);
+} xdp_capture_events SEC(".maps");
+
+// Capture filter compiled from a pcap-filter expression (its action is ignored).
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, uint32_t);
+	__type(value, struct filter);
+} xdp_capture_filter_map SEC(".maps");
+
+// Per-CPU buffer in which the capture stage assembles a record.
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, uint32_t);
+	__type(value, struct capture_buffer);
+} xdp_capture_buffer_map SEC(".maps");
+
+// PSFP: stream identification and stream filters.
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, PSFP_MAX_STREAMS);
+	__type(key, struct psfp_stream_key);
+	__type(value, struct psfp_stream);
+} xdp_psfp_stream_map SEC(".maps");
+
+// PSFP: stream gates.
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, PSFP_MAX_GATES);
+	__type(key, uint32_t);
+	__type(value, struct psfp_gate);
+} xdp_psfp_gate_map SEC(".maps");
+
+// PSFP: flow meter configuration.
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, PSFP_MAX_METERS);
+	__type(key, uint32_t);
+	__type(value, struct psfp_meter);
+} xdp_psfp_meter_map SEC(".maps");
+
+// PSFP: per-CPU token buckets of the flow meters (same index as xdp_psfp_meter_map).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, PSFP_MAX_METERS);
+	__type(key, uint32_t);
+	__type(value, struct psfp_meter_state);
+} xdp_psfp_meter_state_map SEC(".maps");
+
+// PSFP: per-CPU counters of the stream filters (index is the stream handle).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, PSFP_MAX_STREAMS);
+	__type(key, uint32_t);
+	__type(value, struct psfp_stream_stats);
+} xdp_psfp_stats_map SEC(".maps");
+
+// Count-min sketch of the IP flows (cf. struct cms_row).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, CMS_DEPTH);
+	__type(key, uint32_t);
+	__type(value, struct cms_row);
+} xdp_cms_map SEC(".maps");
+
+// Top-K candidates of the count-min sketch. The value is the per-CPU estimate
+// of the flow when it was last recorded.
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, CMS_MAX_CANDIDATES);
+	__type(key, struct flow_key);
+	__type(value, uint64_t);
+} xdp_cms_candidates_map SEC(".maps");
+
+// Return values of parse_headers().
+enum parse_result {
+	PARSE_OK = 0,
+	PARSE_TRUNCATED_L2 = -1, // Ethernet or VLAN header truncated, info is invalid
+	PARSE_TRUNCATED_L3 = -2, // IP or L4 header truncated or invalid, only the L2 fields are valid
+};
+
+// Parse Ethernet, VLAN, IPv4/IPv6, and TCP/UDP/SCTP headers (enum parse_result).
+// IPv6 extension headers are not parsed, i.e., l4_proto is the next header of the IPv6 header.
+static __always_inline int parse_headers(void *hdr, void *endptr, struct pkt_info *info)
 {
-	int do_drop = 0;
 	struct ethhdr *eth_hdr = hdr;
-	
+	void *pos = hdr + sizeof(struct ethhdr);
+
 	// Bounds check
-	if (hdr + sizeof(struct ethhdr) > endptr)
-		return 0;
-	
-	do_drop = 1; // assume MAC addresses match and we drop
-	for (size_t i = 0; i < ETH_ALEN; i++) { 
-		if (eth_hdr->h_dest[i] != eth_d_addr[i]) {
-			// MAC address does not match -> don't drop (pass)
-			do_drop = 0;
+	if (pos > endptr)
+		return PARSE_TRUNCATED_L2;
+
+	__be16 proto = eth_hdr->h_proto;
+	for (int i = 0; i < VLAN_MAX_DEPTH; i++) {
+		if (proto != bpf_htons(ETH_P_8021Q) && proto != bpf_htons(ETH_P_8021AD))
 			break;
+
+		struct vlan_hdr *vlan_hdr = pos;
+		if (pos + sizeof(struct vlan_hdr) > endptr)
+			return PARSE_TRUNCATED_L2;
+		if (i == 0) {
+			info->vlan_tci = bpf_ntohs(vlan_hdr->h_vlan_TCI);
+			info->has_vlan = 1;
 		}
+		proto = vlan_hdr->h_vlan_encapsulated_proto;
+		pos += sizeof(struct vlan_hdr);
 	}
-	
-	return do_drop;
+	info->eth_proto = bpf_ntohs(proto);
+	info->l3_off = pos - hdr;
+
+	int is_fragment = 0;
+	if (proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr *ip_hdr = pos;
+		if (pos + sizeof(struct iphdr) > endptr)
+			return PARSE_TRUNCATED_L3;
+		if (ip_hdr->ihl < 5)
+			return PARSE_TRUNCATED_L3;
+		__builtin_memcpy(info->saddr, &ip_hdr->saddr, 4);
+		__builtin_memcpy(info->daddr, &ip_hdr->daddr, 4);
+		info->l4_proto = ip_hdr->protocol;
+		// Only the first fragment contains the L4 header.
+		is_fragment = (ip_hdr->frag_off & bpf_htons(0x1fff)) != 0;
+		pos += ip_hdr->ihl*4;
+	} else if (proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6_hdr = pos;
+		if (pos + sizeof(struct ipv6hdr) > endptr)
+			return PARSE_TRUNCATED_L3;
+		__builtin_memcpy(info->saddr, &ip6_hdr->saddr, 16);
+		__builtin_memcpy(info->daddr, &ip6_hdr->daddr, 16);
+		info->l4_proto = ip6_hdr->nexthdr;
+		pos += sizeof(struct ipv6hdr);
+	} else {
+		return PARSE_OK; // no IP packet
+	}
+	info->l4_off = pos - hdr;
+
+	if (!is_fragment && (info->l4_proto == IPPROTO_TCP || info->l4_proto == IPPROTO_UDP ||
+			     info->l4_proto == IPPROTO_SCTP)) {
+		// Source and destination port are the first two fields of all these protocols.
+		__be16 *ports = pos;
+		if (pos + 2*sizeof(__be16) > endptr)
+			return PARSE_TRUNCATED_L3;
+		info->sport = bpf_ntohs(ports[0]);
+		info->dport = bpf_ntohs(ports[1]);
+		info->has_ports = 1;
+	}
+
+	return PARSE_OK;
+}
+
+// Parse the headers of the packet into the scratch space.
+static __always_inline void parse_into_scratch(void *hdr, void *endptr, struct pipeline_scratch *scratch)
+{
+	__builtin_memset(&scratch->info, 0, sizeof(scratch->info));
+	int result = parse_headers(hdr, endptr, &scratch->info);
+	scratch->parsed = (result == PARSE_OK);
+	scratch->l2_parsed = (result != PARSE_TRUNCATED_L2);
+}
+
+static __always_inline void acl_and(struct acl_bitmap *result, const struct acl_bitmap *bitmap)
+{
+	for (int w = 0; w < ACL_BITMAP_WORDS; w++)
+		result->bits[w] &= bitmap->bits[w];
+}
+
+// Look up the bitmap of an L4 field, falling back to the wildcard entry if the
+// value is not in the map or not present in the packet.
+static __always_inline struct acl_bitmap *acl_lookup_l4(uint32_t set, uint8_t field,
+							uint16_t value, int present)
+{
+	struct acl_l4_key key = {
+		.set = set,
+		.field = field,
+		.value = value,
+	};
+	struct acl_bitmap *bitmap = NULL;
+
+	if (present)
+		bitmap = bpf_map_lookup_elem(&xdp_acl_l4_map, &key);
+	if (bitmap == NULL) {
+		key.field |= ACL_FIELD_WILDCARD;
+		key.value = 0;
+		bitmap = bpf_map_lookup_elem(&xdp_acl_l4_map, &key);
+	}
+
+	return bitmap;
+}
+
+// Index of the lowest set bit of a non-zero value.
+// Implemented as binary search since BPF has no count-trailing-zeros instruction.
+static __always_inline uint32_t lowest_bit(uint64_t x)
+{
+	uint32_t n = 0;
+
+	if ((x & 0xffffffffULL) == 0) { n += 32; x >>= 32; }
+	if ((x & 0xffffULL) == 0) { n += 16; x >>= 16; }
+	if ((x & 0xffULL) == 0) { n += 8; x >>= 8; }
+	if ((x & 0xfULL) == 0) { n += 4; x >>= 4; }
+	if ((x & 0x3ULL) == 0) { n += 2; x >>= 2; }
+	if ((x & 0x1ULL) == 0) { n += 1; }
+
+	return n;
+}
+
+// State of the evaluation of the matching ACL rules, passed to the bpf_loop() callback.
+struct acl_eval {
+	struct acl_bitmap matches; // matching rules not evaluated yet
+	uint32_t set;
+	uint64_t bytes;
+	int reason;
+};
+
+// Evaluate the matching rule with the lowest index. Returns 1 to stop the loop.
+// Every matching rule takes one iteration, so the loop over all ACL_MAX_RULES
+// rules reaches the first PASS or DROP rule however many COUNT rules precede it.
+static long acl_eval_one(uint32_t index, void *data)
+{
+	struct acl_eval *eval = data;
+	int w;
+
+	for (w = 0; w < ACL_BITMAP_WORDS; w++) {
+		if (eval->matches.bits[w] != 0)
+			break;
+	}
+	if (w == ACL_BITMAP_WORDS)
+		return 1; // no more matching rules
+
+	uint32_t bit = lowest_bit(eval->matches.bits[w]);
+	eval->matches.bits[w] &= ~(1ULL << bit);
+	uint32_t rule = eval->set*ACL_MAX_RULES + w*64 + bit;
+
+	struct acl_rule_stats *stats = bpf_map_lookup_elem(&xdp_acl_stats_map, &rule);
+	if (stats != NULL) {
+		stats->packets++;
+		stats->bytes += eval->bytes;
+	}
+
+	struct acl_rule *acl_rule = bpf_map_lookup_elem(&xdp_acl_rules_map, &rule);
+	if (acl_rule == NULL)
+		return 1;
+
+	switch (acl_rule->action) {
+	case ACL_ACTION_DROP:
+		eval->reason = DROP_REASON_ACL;
+		return 1;
+	case ACL_ACTION_PASS:
+		return 1;
+	default:
+		return 0; // ACL_ACTION_COUNT: continue with the next matching rule
+	}
+}
+
+// Classify an IP packet with the active set of ACL rules.
+static __always_inline int make_drop_decision_acl(struct drop_config *cfg,
+						  struct pkt_info *info, uint64_t bytes)
+{
+	struct acl_eval eval = {
+		.set = cfg->acl_set & 1,
+		.bytes = bytes,
+		.reason = DROP_REASON_NONE,
+	};
+	uint32_t set = eval.set;
+	struct acl_bitmap *matches = &eval.matches;
+	struct acl_bitmap *bitmap;
+
+	// Look up source and destination prefix.
+	if (info->eth_proto == ETH_P_IP) {
+		struct acl_lpm_v4_key key = {
+			.prefixlen = 32 + 32,
+			.set = set,
+		};
+		__builtin_memcpy(key.addr, info->saddr, sizeof(key.addr));
+		bitmap = bpf_map_lookup_elem(&xdp_acl_src_v4_map, &key);
+		if (bitmap == NULL)
+			return DROP_REASON_NONE;
+		*matches = *bitmap;
+
+		__builtin_memcpy(key.addr, info->daddr, sizeof(key.addr));
+		bitmap = bpf_map_lookup_elem(&xdp_acl_dst_v4_map, &key);
+	} else {
+		struct acl_lpm_v6_key key = {
+			.prefixlen = 32 + 128,
+			.set = set,
+		};
+		__builtin_memcpy(key.addr, info->saddr, sizeof(key.addr));
+		bitmap = bpf_map_lookup_elem(&xdp_acl_src_v6_map, &key);
+		if (bitmap == NULL)
+			return DROP_REASON_NONE;
+		*matches = *bitmap;
+
+		__builtin_memcpy(key.addr, info->daddr, sizeof(key.addr));
+		bitmap = bpf_map_lookup_elem(&xdp_acl_dst_v6_map, &key);
+	}
+	if (bitmap == NULL)
+		return DROP_REASON_NONE;
+	acl_and(matches, bitmap);
+
+	// Look up protocol and ports.
+	bitmap = acl_lookup_l4(set, ACL_FIELD_PROTO, info->l4_proto, 1);
+	if (bitmap == NULL)
+		return DROP_REASON_NONE;
+	acl_and(matches, bitmap);
+
+	bitmap = acl_lookup_l4(set, ACL_FIELD_SPORT, info->sport, info->has_ports);
+	if (bitmap == NULL)
+		return DROP_REASON_NONE;
+	acl_and(matches, bitmap);
+
+	bitmap = acl_lookup_l4(set, ACL_FIELD_DPORT, info->dport, info->has_ports);
+	if (bitmap == NULL)
+		return DROP_REASON_NONE;
+	acl_and(matches, bitmap);
+
+	// Evaluate matching rules in the order of their index. COUNT rules just
+	// count the packet; the first PASS or DROP rule terminates the evaluation.
+	// No matching rule (or PASS rule) -> pass
+	bpf_loop(ACL_MAX_RULES, acl_eval_one, &eval, 0);
+
+	return eval.reason;
+}
+
+// Returns 1 if the gate is open at time now (TAI clock).
+static __always_inline int psfp_gate_open(const struct psfp_gate *gate, uint64_t now)
+{
+	if (gate->cycle_time == 0)
+		return 1;
+
+	// Offset into the current cycle. Cycles also extend backwards before base_time.
+	uint64_t offset;
+	if (now >= gate->base_time)
+		offset = (now - gate->base_time) % gate->cycle_time;
+	else
+		offset = gate->cycle_time - 1 - (gate->base_time - now - 1) % gate->cycle_time;
+
+	for (int i = 0; i < PSFP_MAX_GATE_ENTRIES; i++) {
+		if (i >= gate->num_entries)
+			break;
+		if (offset < gate->entries[i].interval)
+			return gate->entries[i].open;
+		offset -= gate->entries[i].interval;
+	}
+
+	// After the last entry until the end of the cycle, the gate is closed.
+	return 0;
+}
+
+// Maximum time in nano-seconds for which tokens are added at once.
+// Longer idle periods fill the token buckets as if this time had elapsed,
+// which also avoids overflows when multiplying with the rate.
+#define PSFP_MAX_REFILL_NS 1000000000ULL
+
+// Meter a frame with a two-rate three-color token bucket meter.
+// Returns 1 if the frame passes (green, or yellow if yellow frames are not dropped).
+static __always_inline int psfp_meter_pass(uint32_t meter_id, uint64_t bytes, uint64_t now)
+{
+	struct psfp_meter *meter = bpf_map_lookup_elem(&xdp_psfp_meter_map, &meter_id);
+	// Token buckets of this CPU, updated without locks.
+	struct psfp_meter_state *state = bpf_map_lookup_elem(&xdp_psfp_meter_state_map, &meter_id);
+	if (meter == NULL || state == NULL)
+		return 1;
+
+	if (state->t_last == 0 || now - state->t_last >= PSFP_MAX_REFILL_NS) {
+		state->committed_tokens = meter->cbs;
+		state->excess_tokens = meter->ebs;
+		state->committed_frac = 0;
+		state->excess_frac = 0;
+	} else if (now > state->t_last) {
+		uint64_t elapsed = now - state->t_last;
+		uint64_t overflow = 0;
+
+		// Frames arrive within nano-seconds, which often adds less than
+		// one token. The remainder is kept for the next frame, so no
+		// credit is lost by rounding.
+		uint64_t credit = meter->cir*elapsed + state->committed_frac;
+		state->committed_tokens += credit/1000000000ULL;
+		state->committed_frac = credit % 1000000000ULL;
+		if (state->committed_tokens >= meter->cbs) {
+			overflow = state->committed_tokens - meter->cbs;
+			state->committed_tokens = meter->cbs;
+			state->committed_frac = 0;
+		}
+		credit = meter->eir*elapsed + state->excess_frac;
+		state->excess_tokens += credit/1000000000ULL;
+		state->excess_frac = credit % 1000000000ULL;
+		if (meter->coupling)
+			state->excess_tokens += overflow;
+		if (state->excess_tokens >= meter->ebs) {
+			state->excess_tokens = meter->ebs;
+			state->excess_frac = 0;
+		}
+	}
+	state->t_last = now;
+
+	if (state->committed_tokens >= bytes) {
+		// green
+		state->committed_tokens -= bytes;
+		return 1;
+	}
+	if (state->excess_tokens >= bytes) {
+		// yellow
+		state->excess_tokens -= bytes;
+		return !meter->drop_yellow;
+	}
+
+	// red
+	return 0;
+}
+
+// Per-stream filtering and policing (IEEE 802.1Qci).
+static __always_inline int make_drop_decision_psfp(struct ethhdr *eth_hdr,
+						   struct pkt_info *info, uint64_t bytes)
+{
+	// Identify stream by destination MAC address, VLAN ID, and PCP.
+	struct psfp_stream_key key = {};
+	__builtin_memcpy(key.dst, eth_hdr->h_dest, ETH_ALEN);
+	if (info->has_vlan) {
+		key.vlan_id = info->vlan_tci & 0x0fff;
+		key.pcp = info->vlan_tci >> 13;
+	}
+
+	struct psfp_stream *stream = bpf_map_lookup_elem(&xdp_psfp_stream_map, &key);
+	if (stream == NULL) {
+		key.pcp = PSFP_PCP_ANY;
+		stream = bpf_map_lookup_elem(&xdp_psfp_stream_map, &key);
+		if (stream == NULL)
+			return DROP_REASON_NONE; // not a PSFP stream
+	}
+
+	uint32_t handle = stream->handle;
+	struct psfp_stream_stats *stats = bpf_map_lookup_elem(&xdp_psfp_stats_map, &handle);
+	if (stats == NULL)
+		return DROP_REASON_NONE;
+	stats->matching_frames++;
+
+	// Maximum SDU size filter
+	if (stream->max_sdu != 0 && bytes > stream->max_sdu) {
+		stats->not_passing_sdu++;
+		return DROP_REASON_PSFP_SDU;
+	}
+	stats->passing_sdu++;
+
+	uint64_t now = bpf_ktime_get_tai_ns();
+
+	// Stream gate
+	uint32_t gate_id = stream->gate_id;
+	if (gate_id != PSFP_NONE) {
+		struct psfp_gate *gate = bpf_map_lookup_elem(&xdp_psfp_gate_map, &gate_id);
+		if (gate != NULL && !psfp_gate_open(gate, now)) {
+			stats->not_passing_frames++;
+			return DROP_REASON_PSFP_GATE;
+		}
+	}
+	stats->passing_frames++;
+
+	// Flow meter
+	if (stream->meter_id != PSFP_NONE && !psfp_meter_pass(stream->meter_id, bytes, now)) {
+		stats->red_frames++;
+		return DROP_REASON_PSFP_METER;
+	}
+
+	return DROP_REASON_NONE;
 }
 
 static __always_inline void update_mac_stats(void *hdr, void *endptr, int do_drop)
 {
 	struct ethhdr *eth_hdr = hdr;
-	
+	uint64_t bytes = endptr - hdr;
+
 	// Bounds check
 	if (hdr + sizeof(struct ethhdr) > endptr)
 		return;
@@ -71,45 +708,531 @@ static __always_inline void update_mac_stats(void *hdr, void *endptr, int do_dro
 	struct hash_map_key key;
 	// Need to use built-in memcpy function of LLVM.
 	__builtin_memcpy(&key.addr, eth_hdr->h_dest, sizeof(key.addr));
-	
+
+	// Note that we get a pointer to the value of the current CPU, which is edited in-place.
+	// Since no other CPU writes to this value, no spin lock or atomic operation is required.
 	struct hash_map_value *value = bpf_map_lookup_elem(&xdp_stats_per_mac_map, &key);
+	if (value == NULL) {
+		// MAC address seen for the first time (or evicted meanwhile) -> insert it.
+		// BPF_NOEXIST fails if another CPU inserted the same key concurrently,
+		// so we look up the element again afterwards in any case.
+		struct hash_map_value init = {};
+		bpf_map_update_elem(&xdp_stats_per_mac_map, &key, &init, BPF_NOEXIST);
+		value = bpf_map_lookup_elem(&xdp_stats_per_mac_map, &key);
+		if (value == NULL)
+			return;
+	}
 
-	// Note that we get a pointer to the actual element in memory, which is edited in-place.
-	// To avoid race conditions on this struct, we must use a spin lock to ensure
-	// atomic updates.
-	bpf_spin_lock(&value->lock);
 	if (do_drop) {
-		(value->dropped)++;
+		value->dropped_packets++;
+		value->dropped_bytes += bytes;
 		value->t_lastdrop = bpf_ktime_get_ns();
+	} else {
+		value->passed_packets++;
+		value->passed_bytes += bytes;
 	}
-	bpf_spin_unlock(&value->lock);
 }
-	
+
+static __always_inline void emit_drop_event(struct xdp_md *ctx, struct drop_config *cfg,
+					    struct cpu_counters *counters,
+					    void *hdr, void *endptr, int reason)
+{
+	struct ethhdr *eth_hdr = hdr;
+
+	if (cfg->event_sample_rate == 0)
+		return; // drop events disabled
+
+	// Sample one out of event_sample_rate drops.
+	if (cfg->event_sample_rate > 1 &&
+	    bpf_get_prandom_u32() % cfg->event_sample_rate != 0)
+		return;
+
+	// Bounds check
+	if (hdr + sizeof(struct ethhdr) > endptr)
+		return;
+
+	// Reserve space for the event directly in the ring buffer, so no extra copy is needed.
+	struct drop_event *event = bpf_ringbuf_reserve(&xdp_drop_events, sizeof(*event), 0);
+	if (event == NULL) {
+		// Ring buffer is full since user space does not consume events fast enough.
+		if (counters != NULL)
+			counters->value[COUNTER_EVENTS_LOST]++;
+		return;
+	}
+
+	event->timestamp = bpf_ktime_get_tai_ns();
+	event->pkt_len = endptr - hdr;
+	event->rx_queue = ctx->rx_queue_index;
+	__builtin_memcpy(event->dst, eth_hdr->h_dest, ETH_ALEN);
+	__builtin_memcpy(event->src, eth_hdr->h_source, ETH_ALEN);
+	event->eth_proto = eth_hdr->h_proto;
+	event->reason = reason;
+
+	bpf_ringbuf_submit(event, 0);
+}
+
+// Continue with the first enabled stage starting at stage first.
+// A tail call does not return if it succeeds. If the slot of a stage is empty
+// (stage disabled), bpf_tail_call() returns and we try the next one.
+static __always_inline int pipeline_continue(struct xdp_md *ctx, uint32_t first)
+{
+	for (uint32_t stage = first; stage < PIPELINE_MAX_STAGES; stage++)
+		bpf_tail_call(ctx, &xdp_pipeline_map, stage);
+
+	// Not even the action stage is present (e.g., during loading). Since
+	// nothing has been decided yet, let the packet pass.
+	return XDP_PASS;
+}
+
+// Leave the current stage, which decided reason for the packet.
+static __always_inline int pipeline_done(struct xdp_md *ctx, struct pipeline_scratch *scratch,
+					 uint32_t stage, int reason)
+{
+	if (reason != DROP_REASON_NONE) {
+		// Skip the remaining classification stages. Dropped packets can still be captured.
+		scratch->reason = reason;
+		return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE);
+	}
+
+	return pipeline_continue(ctx, stage + 1);
+}
+
+// State of the filter evaluation, passed to the bpf_loop() callback.
+struct filter_eval {
+	uint32_t words[FILTER_WORDS]; // enum filter_word
+	uint32_t set;
+	uint64_t bytes;
+	int reason;
+};
+
+// Extract the words compared by the filter terms from the parsed headers.
+static __always_inline void filter_extract(struct filter_eval *eval, struct ethhdr *eth_hdr,
+					   const struct pkt_info *info)
+{
+	uint32_t *words = eval->words;
+
+	words[FILTER_WORD_LEN] = eval->bytes;
+	words[FILTER_WORD_ETH_PROTO] = info->eth_proto;
+	words[FILTER_WORD_VLAN] = info->has_vlan ? FILTER_VLAN_PRESENT | (info->vlan_tci & 0xfff) : 0;
+	words[FILTER_WORD_SPORT] = info->has_ports ? FILTER_PORT_PRESENT | info->sport : 0;
+	words[FILTER_WORD_DPORT] = info->has_ports ? FILTER_PORT_PRESENT | info->dport : 0;
+
+	const unsigned char *dst = eth_hdr->h_dest;
+	const unsigned char *src = eth_hdr->h_source;
+	words[FILTER_WORD_DST_MAC] = (dst[0] << 24) | (dst[1] << 16) | (dst[2] << 8) | dst[3];
+	words[FILTER_WORD_DST_MAC + 1] = (dst[4] << 8) | dst[5];
+	words[FILTER_WORD_SRC_MAC] = (src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+	words[FILTER_WORD_SRC_MAC + 1] = (src[4] << 8) | src[5];
+
+	uint32_t family = (info->eth_proto == ETH_P_IP) ? 4 : (info->eth_proto == ETH_P_IPV6) ? 6 : 0;
+	words[FILTER_WORD_L4_PROTO] = family ? FILTER_L4_PROTO_PRESENT | info->l4_proto : 0;
+	words[FILTER_WORD_SRC_FAMILY] = family;
+	words[FILTER_WORD_DST_FAMILY] = family;
+	for (int i = 0; i < 4; i++) {
+		uint32_t saddr, daddr;
+		__builtin_memcpy(&saddr, &info->saddr[4*i], sizeof(saddr));
+		__builtin_memcpy(&daddr, &info->daddr[4*i], sizeof(daddr));
+		words[FILTER_WORD_SRC_FAMILY + 1 + i] = bpf_ntohl(saddr);
+		words[FILTER_WORD_DST_FAMILY + 1 + i] = bpf_ntohl(daddr);
+	}
+}
+
+static __always_inline int filter_term_match(const struct filter_term *term, const uint32_t *words)
+{
+	int match = 1;
+
+	for (int i = 0; i < FILTER_TERM_WORDS; i++) {
+		if (i >= term->nwords)
+			break;
+		uint32_t index = term->word + i;
+		if (index >= FILTER_WORDS)
+			return 0; // invalid term
+		uint32_t value = words[index] & term->mask[i];
+		if (value < term->lo[i] || value > term->hi[i]) {
+			match = 0;
+			break;
+		}
+	}
+
+	return match != term->negate;
+}
+
+static __always_inline int filter_match(const struct filter *filter, const uint32_t *words)
+{
+	for (int c = 0; c < FILTER_MAX_CLAUSES; c++) {
+		if (c >= filter->nclauses)
+			break;
+		const struct filter_clause *clause = &filter->clauses[c];
+		int match = 1;
+		for (int t = 0; t < FILTER_MAX_TERMS; t++) {
+			if (t >= clause->nterms)
+				break;
+			if (!filter_term_match(&clause->terms[t], words)) {
+				match = 0;
+				break;
+			}
+		}
+		if (match)
+			return 1;
+	}
+
+	return 0;
+}
+
+// Evaluate filter number index of the active set. Returns 1 to stop the loop.
+// As a bpf_loop() callback, the matcher is verified once instead of once per filter.
+static long filter_eval_one(uint32_t index, void *data)
+{
+	struct filter_eval *eval = data;
+	uint32_t key = eval->set*FILTER_MAX_FILTERS + index;
+
+	struct filter *filter = bpf_map_lookup_elem(&xdp_filter_map, &key);
+	if (filter == NULL)
+		return 1;
+	if (!filter_match(filter, eval->words))
+		return 0;
+
+	struct filter_stats *stats = bpf_map_lookup_elem(&xdp_filter_stats_map, &key);
+	if (stats != NULL) {
+		stats->packets++;
+		stats->bytes += eval->bytes;
+	}
+
+	switch (filter->action) {
+	case ACL_ACTION_DROP:
+		eval->reason = DROP_REASON_FILTER;
+		return 1;
+	case ACL_ACTION_PASS:
+		return 1;
+	default:
+		return 0; // ACL_ACTION_COUNT: continue with the next filter
+	}
+}
+
+// Match a packet against the active set of filters.
+static __always_inline int make_drop_decision_filter(struct drop_config *cfg, struct ethhdr *eth_hdr,
+						     struct pkt_info *info, uint64_t bytes)
+{
+	struct filter_eval eval = {
+		.set = cfg->filter_set & 1,
+		.bytes = bytes,
+		.reason = DROP_REASON_NONE,
+	};
+	uint32_t nfilters = cfg->filter_num_rules;
+	if (nfilters > FILTER_MAX_FILTERS)
+		nfilters = FILTER_MAX_FILTERS;
+
+	filter_extract(&eval, eth_hdr, info);
+	bpf_loop(nfilters, filter_eval_one, &eval, 0);
+
+	return eval.reason;
+}
+
+// Returns the global counters of the current CPU, or NULL if its id exceeds
+// COUNTERS_MAX_CPUS. The packet is processed anyway, just not counted.
+static __always_inline struct cpu_counters *get_counters(void)
+{
+	uint32_t key = bpf_get_smp_processor_id();
+	return bpf_map_lookup_elem(&xdp_counters_map, &key);
+}
+
+static __always_inline struct pipeline_scratch *get_scratch(void)
+{
+	uint32_t key = 0;
+	return bpf_map_lookup_elem(&xdp_scratch_map, &key);
+}
+
+static __always_inline struct drop_config *get_config(void)
+{
+	uint32_t key = 0;
+	return bpf_map_lookup_elem(&xdp_config_map, &key);
+}
+
+// Returns the statistics of the RX queue of the packet, or NULL if the queue
+// index exceeds QUEUE_STATS_MAX_QUEUES.
+static __always_inline struct queue_stats *get_queue_stats(struct xdp_md *ctx)
+{
+	uint32_t key = ctx->rx_queue_index;
+	return bpf_map_lookup_elem(&xdp_queue_stats_map, &key);
+}
+
 SEC("xdp-drop")
 int xdp_prog_main(struct xdp_md *ctx)
 {
 	void *pkt_end = (void *)(long)ctx->data_end;
 	void *pkt = (void *)(long)ctx->data;
+	uint64_t bytes = pkt_end - pkt;
 	
-	uint32_t key = 0; // drop counter is the first and only entry in the array
-	// Note that we get a pointer to the actual element in memory, which is edited in-place.
-	// To avoid race conditions, atomic operations or spin locks must be used.
-	// For incrementing a single 64-bit integer, a single atomic operation is available.
-	uint64_t *drop_cnt = bpf_map_lookup_elem(&xdp_drop_stats_map, &key);
-	if (drop_cnt == NULL)
+	struct pipeline_scratch *scratch = get_scratch();
+	if (scratch == NULL)
 		return XDP_PASS;
 
-	int do_drop = make_drop_decision_eth(pkt, pkt_end);
-	
+	// Note that we get a pointer to the counters of the current CPU, which are edited in-place.
+	// Since every CPU has its own counters, no atomic operations or spin locks are required.
+	struct cpu_counters *counters = get_counters();
+	if (counters != NULL) {
+		counters->value[COUNTER_RX_PACKETS]++;
+		counters->value[COUNTER_RX_BYTES] += bytes;
+	}
+
+	struct queue_stats *qstats = get_queue_stats(ctx);
+	if (qstats != NULL) {
+		qstats->rx_packets++;
+		qstats->rx_bytes += bytes;
+	}
+
+	scratch->reason = DROP_REASON_NONE;
+	scratch->parsed = 0;
+	scratch->l2_parsed = 0;
+
+	return pipeline_continue(ctx, 0);
+}
+
+SEC("xdp-drop/blocklist")
+int xdp_stage_blocklist(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+	struct ethhdr *eth_hdr = pkt;
+	int reason = DROP_REASON_NONE;
+
+	struct pipeline_scratch *scratch = get_scratch();
+	if (scratch == NULL)
+		return XDP_PASS;
+
+	// Drop packets to or from blocked MAC addresses.
+	if (pkt + sizeof(struct ethhdr) <= pkt_end &&
+	    (is_blocked(eth_hdr->h_dest, BLOCKLIST_DST) ||
+	     is_blocked(eth_hdr->h_source, BLOCKLIST_SRC)))
+		reason = DROP_REASON_BLOCKLIST;
+
+	return pipeline_done(ctx, scratch, PIPELINE_STAGE_BLOCKLIST, reason);
+}
+
+SEC("xdp-drop/parse")
+int xdp_stage_parse(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+
+	struct pipeline_scratch *scratch = get_scratch();
+	if (scratch == NULL)
+		return XDP_PASS;
+
+	// Truncated packets are not classified by the following stages, except
+	// for PSFP, which only needs the L2 headers.
+	parse_into_scratch(pkt, pkt_end, scratch);
+
+	return pipeline_continue(ctx, PIPELINE_STAGE_PARSE + 1);
+}
+
+SEC("xdp-drop/sketch")
+int xdp_stage_sketch(struct xdp_md *ctx)
+{
+	struct pipeline_scratch *scratch = get_scratch();
+	struct drop_config *cfg = get_config();
+	if (scratch == NULL || cfg == NULL)
+		return XDP_PASS;
+
+	struct pkt_info *info = &scratch->info;
+	if (!cfg->sketch_enabled || !scratch->parsed ||
+	    (info->eth_proto != ETH_P_IP && info->eth_proto != ETH_P_IPV6))
+		return pipeline_continue(ctx, PIPELINE_STAGE_SKETCH + 1);
+
+	struct flow_key key = {};
+	__builtin_memcpy(key.saddr, info->saddr, sizeof(key.saddr));
+	__builtin_memcpy(key.daddr, info->daddr, sizeof(key.daddr));
+	if (info->has_ports) {
+		key.sport = info->sport;
+		key.dport = info->dport;
+	}
+	key.proto = info->l4_proto;
+	key.family = (info->eth_proto == ETH_P_IP) ? 4 : 6;
+
+	uint32_t h1 = cms_hash(&key, CMS_SEED1);
+	uint32_t h2 = cms_hash(&key, CMS_SEED2) | 1;
+	uint64_t estimate = ~0ULL;
+	for (uint32_t row = 0; row < CMS_DEPTH; row++) {
+		struct cms_row *counters = bpf_map_lookup_elem(&xdp_cms_map, &row);
+		if (counters == NULL)
+			return pipeline_continue(ctx, PIPELINE_STAGE_SKETCH + 1);
+		uint64_t count = ++counters->count[cms_column(h1, h2, row)];
+		if (count < estimate)
+			estimate = count;
+	}
+
+	// Record heavy flows as candidates. Updating the candidate only when the
+	// estimate reaches a power of two limits the updates of the shared table
+	// to a logarithmic number per flow.
+	if (estimate >= cfg->sketch_threshold && (estimate & (estimate - 1)) == 0)
+		bpf_map_update_elem(&xdp_cms_candidates_map, &key, &estimate, BPF_ANY);
+
+	return pipeline_continue(ctx, PIPELINE_STAGE_SKETCH + 1);
+}
+
+SEC("xdp-drop/psfp")
+int xdp_stage_psfp(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+	int reason = DROP_REASON_NONE;
+
+	struct pipeline_scratch *scratch = get_scratch();
+	struct drop_config *cfg = get_config();
+	if (scratch == NULL || cfg == NULL)
+		return XDP_PASS;
+
+	// Filter and police TSN streams. Streams are identified by L2 fields only,
+	// so frames with malformed IP headers cannot bypass the stream filters.
+	if (cfg->psfp_enabled && scratch->l2_parsed && pkt + sizeof(struct ethhdr) <= pkt_end)
+		reason = make_drop_decision_psfp(pkt, &scratch->info, pkt_end - pkt);
+
+	return pipeline_done(ctx, scratch, PIPELINE_STAGE_PSFP, reason);
+}
+
+SEC("xdp-drop/acl")
+int xdp_stage_acl(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+	int reason = DROP_REASON_NONE;
+
+	struct pipeline_scratch *scratch = get_scratch();
+	struct drop_config *cfg = get_config();
+	if (scratch == NULL || cfg == NULL)
+		return XDP_PASS;
+
+	// Classify IP packets by L3 and L4 header fields.
+	if (cfg->acl_enabled && scratch->parsed &&
+	    (scratch->info.eth_proto == ETH_P_IP || scratch->info.eth_proto == ETH_P_IPV6))
+		reason = make_drop_decision_acl(cfg, &scratch->info, pkt_end - pkt);
+
+	return pipeline_done(ctx, scratch, PIPELINE_STAGE_ACL, reason);
+}
+
+SEC("xdp-drop/filter")
+int xdp_stage_filter(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+	int reason = DROP_REASON_NONE;
+
+	struct pipeline_scratch *scratch = get_scratch();
+	struct drop_config *cfg = get_config();
+	if (scratch == NULL || cfg == NULL)
+		return XDP_PASS;
+
+	// Match packets against the compiled pcap-filter expressions.
+	if (cfg->filter_enabled && scratch->parsed && pkt + sizeof(struct ethhdr) <= pkt_end)
+		reason = make_drop_decision_filter(cfg, pkt, &scratch->info, pkt_end - pkt);
+
+	return pipeline_done(ctx, scratch, PIPELINE_STAGE_FILTER, reason);
+}
+
+SEC("xdp-drop/capture")
+int xdp_stage_capture(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+	uint32_t key = 0;
+
+	struct pipeline_scratch *scratch = get_scratch();
+	struct drop_config *cfg = get_config();
+	if (scratch == NULL || cfg == NULL)
+		return XDP_PASS;
+
+	if (!cfg->capture_enabled || pkt + sizeof(struct ethhdr) > pkt_end ||
+	    (cfg->capture_drops_only && scratch->reason == DROP_REASON_NONE))
+		return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE + 1);
+
+	struct filter *filter = bpf_map_lookup_elem(&xdp_capture_filter_map, &key);
+	struct capture_buffer *buf = bpf_map_lookup_elem(&xdp_capture_buffer_map, &key);
+	if (filter == NULL || buf == NULL)
+		return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE + 1);
+
+	// Packets dropped before the parse stage (e.g., by the blocklist), or
+	// received while the parse stage is inactive, are parsed here.
+	if (!scratch->parsed)
+		parse_into_scratch(pkt, pkt_end, scratch);
+
+	struct filter_eval eval = { .bytes = pkt_end - pkt };
+	filter_extract(&eval, pkt, &scratch->info);
+	if (!filter_match(filter, eval.words))
+		return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE + 1);
+
+	uint32_t pkt_len = bpf_xdp_get_buff_len(ctx);
+	uint32_t cap_len = cfg->capture_snaplen;
+	if (cap_len > pkt_len)
+		cap_len = pkt_len;
+	if (cap_len == 0 || cap_len > CAPTURE_MAX_SNAPLEN)
+		return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE + 1);
+
+	// In contrast to direct packet access, bpf_xdp_load_bytes() also copies
+	// from the fragments of multi-buffer packets.
+	if (bpf_xdp_load_bytes(ctx, 0, buf->data, cap_len) != 0)
+		return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE + 1);
+
+	buf->hdr.timestamp = bpf_ktime_get_tai_ns();
+	buf->hdr.pkt_len = pkt_len;
+	buf->hdr.cap_len = cap_len;
+	buf->hdr.rx_queue = ctx->rx_queue_index;
+	buf->hdr.reason = scratch->reason;
+	buf->hdr.pad = 0;
+
+	// Wake up user space only once enough data is available, so it writes
+	// large batches instead of being woken up for every packet.
+	uint64_t flags = bpf_ringbuf_query(&xdp_capture_events, BPF_RB_AVAIL_DATA) >= CAPTURE_WAKEUP_BYTES ?
+		BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP;
+	if (bpf_ringbuf_output(&xdp_capture_events, buf, sizeof(buf->hdr) + cap_len, flags) != 0) {
+		// Ring buffer is full since user space does not write packets fast enough.
+		struct cpu_counters *counters = get_counters();
+		if (counters != NULL)
+			counters->value[COUNTER_CAPTURE_LOST]++;
+	}
+
+	return pipeline_continue(ctx, PIPELINE_STAGE_CAPTURE + 1);
+}
+
+SEC("xdp-drop/action")
+int xdp_stage_action(struct xdp_md *ctx)
+{
+	void *pkt_end = (void *)(long)ctx->data_end;
+	void *pkt = (void *)(long)ctx->data;
+	uint64_t bytes = pkt_end - pkt;
+
+	struct cpu_counters *counters = get_counters();
+	struct pipeline_scratch *scratch = get_scratch();
+	struct drop_config *cfg = get_config();
+	if (scratch == NULL || cfg == NULL)
+		return XDP_PASS;
+
+	int do_drop = scratch->reason;
+
         // Update statistics for destination MAC.
 	update_mac_stats(pkt, pkt_end, do_drop);
 
+	struct queue_stats *qstats = get_queue_stats(ctx);
+	if (qstats != NULL) {
+		if (do_drop)
+			qstats->dropped_packets++;
+		else
+			qstats->passed_packets++;
+	}
+
 	if (do_drop) {
-		// Increase global drop counter atomically.
-		// LLVM will map this to the atomic add operation in BPF.
-		__sync_fetch_and_add(drop_cnt, 1);
+		if (counters != NULL) {
+			counters->value[COUNTER_DROPPED_PACKETS]++;
+			counters->value[COUNTER_DROPPED_BYTES] += bytes;
+			if (do_drop > DROP_REASON_NONE && do_drop < DROP_REASON_MAX)
+				counters->value[COUNTER_DROPPED_BY_REASON + do_drop - 1]++;
+		}
+		emit_drop_event(ctx, cfg, counters, pkt, pkt_end, do_drop);
 		return XDP_DROP;
 	} else {
+		if (counters != NULL) {
+			counters->value[COUNTER_PASSED_PACKETS]++;
+			counters->value[COUNTER_PASSED_BYTES] += bytes;
+		}
 		return XDP_PASS;
 	}
 }
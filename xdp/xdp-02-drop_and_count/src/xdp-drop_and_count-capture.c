@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Timeout of polling the ring buffer in milli-seconds. The BPF program wakes up
+// user space only once CAPTURE_WAKEUP_BYTES are available, so at low packet
+// rates, the packets are consumed after this timeout.
+#define CAPTURE_POLL_MS 100
+
+// Interval in seconds in which the buffered packets are written at the latest,
+// e.g., to show them live when writing to a pipe.
+#define CAPTURE_FLUSH_INTERVAL 1
+
+// The capture maps pinned by the running instance of the program.
+struct capture_maps {
+	int config_fd;
+	int filter_fd;
+	int events_fd;
+	int counters_fd;
+};
+
+struct capture_state {
+	struct pcapng_writer *writer;
+	uint64_t captured; // number of packets written
+	uint64_t limit; // stop after this number of packets (0: no limit)
+	bool discard; // discard records of a previous capture
+	bool error;
+};
+
+static volatile sig_atomic_t capture_exit = 0;
+
+static void capture_sigint_handler(int signal)
+{
+	capture_exit = 1;
+}
+
+static void capture_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE capture FILE [snaplen N] [count N] [drops] [EXPRESSION]\n"
+		"  Write packets matching the pcap-filter EXPRESSION (default: all packets) to the\n"
+		"  pcapng FILE (-: standard output) with nano-second timestamps until Ctrl-C, or\n"
+		"  until count packets are captured. The first snaplen bytes of every packet are\n"
+		"  captured (default %d, 0: up to %d). With drops, only packets dropped by the\n"
+		"  pipeline are captured; their drop reason is stored as packet comment.\n",
+		prog, CAPTURE_DEFAULT_SNAPLEN, CAPTURE_MAX_SNAPLEN);
+}
+
+static int open_capture_maps(const char *ifname, struct capture_maps *maps)
+{
+	maps->config_fd = open_pinned_map(ifname, "xdp_config_map");
+	maps->filter_fd = open_pinned_map(ifname, "xdp_capture_filter_map");
+	maps->events_fd = open_pinned_map(ifname, "xdp_capture_events");
+	maps->counters_fd = open_pinned_map(ifname, "xdp_counters_map");
+
+	if (maps->config_fd < 0 || maps->filter_fd < 0 || maps->events_fd < 0 || maps->counters_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+// Switch the capture stage on or off.
+static int capture_set_enabled(struct capture_maps *maps, const char *ifname, bool enable,
+			       uint32_t snaplen, bool drops_only)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0) {
+		perror("Could not read configuration");
+		return EXIT_FAIL_FINDELEM;
+	}
+
+	if (enable) {
+		// A previous capture was not stopped properly (e.g., killed).
+		if (cfg.capture_enabled)
+			fprintf(stderr, "Capture already running, taking over\n");
+		cfg.capture_snaplen = snaplen;
+		cfg.capture_drops_only = drops_only;
+	}
+	cfg.capture_enabled = enable;
+	if (bpf_map_update_elem(maps->config_fd, &config_key, &cfg, BPF_ANY) != 0) {
+		perror("Could not write configuration");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return pipeline_sync(ifname);
+}
+
+static uint64_t capture_lost(const struct cpu_counters *counters, int ncpus)
+{
+	uint64_t sum[COUNTER_MAX];
+
+	sum_counters(counters, ncpus, sum);
+	return sum[COUNTER_CAPTURE_LOST];
+}
+
+// Called by libbpf for every captured packet in the ring buffer.
+static int handle_capture_record(void *ctx, void *data, size_t size)
+{
+	struct capture_state *state = ctx;
+	const struct capture_record *record = data;
+
+	if (state->discard || state->error || size < sizeof(*record) ||
+	    record->cap_len > size - sizeof(*record))
+		return 0;
+	if (state->limit > 0 && state->captured >= state->limit)
+		return 0;
+
+	if (pcapng_write_packet(state->writer, record->timestamp, record + 1, record->cap_len,
+				record->pkt_len, record->rx_queue, record->reason) != 0) {
+		state->error = true;
+		return 0;
+	}
+
+	state->captured++;
+	if (state->limit > 0 && state->captured >= state->limit)
+		capture_exit = 1;
+	return 0;
+}
+
+static int capture_run(struct capture_maps *maps, const char *ifname, const char *filename,
+		       uint32_t snaplen, bool drops_only, uint64_t limit)
+{
+	struct capture_state state = { .limit = limit };
+	int exitcode = EXIT_OK;
+
+	int ncpus = num_counter_cpus();
+	const struct cpu_counters *counters = mmap_counters(maps->counters_fd);
+	if (counters == NULL) {
+		fprintf(stderr, "Could not map counters\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	struct ring_buffer *rb = ring_buffer__new(maps->events_fd, handle_capture_record, &state, NULL);
+	if (libbpf_get_error(rb)) {
+		munmap_counters(counters);
+		fprintf(stderr, "Could not create ring buffer\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	state.writer = pcapng_open(filename, ifname, snaplen);
+	if (state.writer == NULL) {
+		ring_buffer__free(rb);
+		munmap_counters(counters);
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Skip packets left in the ring buffer by a previous capture.
+	state.discard = true;
+	ring_buffer__consume(rb);
+	state.discard = false;
+
+	uint64_t lost = capture_lost(counters, ncpus);
+	exitcode = capture_set_enabled(maps, ifname, true, snaplen, drops_only);
+	if (exitcode == EXIT_OK)
+		fprintf(stderr, "Capturing on %s (snaplen %u)\n", ifname, snaplen);
+
+	struct timespec last_flush;
+	clock_gettime(CLOCK_MONOTONIC, &last_flush);
+	while (exitcode == EXIT_OK && !capture_exit && !state.error) {
+		// Returns -EINTR if interrupted by Ctrl-C. Since the BPF program does
+		// not wake us up for every packet, the ring buffer is consumed after
+		// the timeout, too.
+		int err = ring_buffer__poll(rb, CAPTURE_POLL_MS);
+		if (err >= 0)
+			err = ring_buffer__consume(rb);
+		if (err < 0 && !capture_exit) {
+			fprintf(stderr, "Could not read ring buffer: %s\n", strerror(-err));
+			exitcode = EXIT_FAIL_FINDELEM;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - last_flush.tv_sec >= CAPTURE_FLUSH_INTERVAL) {
+			if (pcapng_flush(state.writer) != 0)
+				state.error = true;
+			last_flush = now;
+		}
+	}
+
+	// Stop the capture stage, and write the packets still in the ring buffer.
+	if (capture_set_enabled(maps, ifname, false, 0, false) != EXIT_OK)
+		exitcode = EXIT_FAIL_UPDATE;
+	ring_buffer__consume(rb);
+	lost = capture_lost(counters, ncpus) - lost;
+
+	if (pcapng_close(state.writer, state.captured + lost, lost) != 0)
+		state.error = true;
+	if (state.error && exitcode == EXIT_OK)
+		exitcode = EXIT_FAIL_UPDATE;
+	fprintf(stderr, "%lu packets captured, %lu packets lost\n", state.captured, lost);
+
+	ring_buffer__free(rb);
+	munmap_counters(counters);
+	return exitcode;
+}
+
+int do_capture(const char *ifname, int argc, char *argv[])
+{
+	uint32_t snaplen = CAPTURE_DEFAULT_SNAPLEN;
+	uint64_t limit = 0;
+	bool drops_only = false;
+	int i;
+
+	// argv[0] is the name of the subcommand ("capture").
+	if (argc < 2) {
+		capture_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+	const char *filename = argv[1];
+
+	// Options precede the expression, which consists of all remaining arguments.
+	for (i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "snaplen") == 0 && i + 1 < argc)
+			snaplen = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "count") == 0 && i + 1 < argc)
+			limit = strtoull(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "drops") == 0)
+			drops_only = true;
+		else
+			break;
+	}
+	if (snaplen == 0 || snaplen > CAPTURE_MAX_SNAPLEN)
+		snaplen = CAPTURE_MAX_SNAPLEN;
+
+	struct filter *filter = calloc(1, sizeof(*filter));
+	if (filter == NULL)
+		return EXIT_FAIL_USAGE;
+	int exitcode = filter_compile_args(argc - i, &argv[i], filter);
+	if (exitcode != EXIT_OK) {
+		free(filter);
+		return exitcode;
+	}
+
+	// Open maps pinned by the running instance of the program.
+	struct capture_maps maps;
+	if (open_capture_maps(ifname, &maps) != 0) {
+		free(filter);
+		fprintf(stderr, "Could not open pinned capture maps (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	__u32 key = 0;
+	int err = bpf_map_update_elem(maps.filter_fd, &key, filter, BPF_ANY);
+	free(filter);
+	if (err != 0) {
+		perror("Could not write capture filter");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	if (signal(SIGINT, capture_sigint_handler) == SIG_ERR ||
+	    signal(SIGTERM, capture_sigint_handler) == SIG_ERR) {
+		fprintf(stderr, "Could not register signal handler\n");
+		return EXIT_FAILSIGNAL;
+	}
+
+	return capture_run(&maps, ifname, filename, snaplen, drops_only, limit);
+}
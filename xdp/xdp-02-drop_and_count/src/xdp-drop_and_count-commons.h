@@ -3,15 +3,479 @@
 
 #include <linux/if_ether.h>
 
+// Reasons for dropping a packet, reported in drop events. Zero means the packet passes.
+enum drop_reason {
+	DROP_REASON_NONE = 0,
+	DROP_REASON_BLOCKLIST,
+	DROP_REASON_ACL,
+	DROP_REASON_PSFP_SDU, // PSFP: frame exceeds maximum SDU size of stream filter
+	DROP_REASON_PSFP_GATE, // PSFP: stream gate closed
+	DROP_REASON_PSFP_METER, // PSFP: flow meter marked frame red (or yellow)
+	DROP_REASON_FILTER, // filter compiled from a pcap-filter expression
+	DROP_REASON_MAX,
+};
+
+// Indices of the global counters of the interface in struct cpu_counters.
+enum global_counter {
+	COUNTER_RX_PACKETS = 0, // number of packets processed by the BPF program
+	COUNTER_RX_BYTES, // number of bytes processed by the BPF program
+	COUNTER_PASSED_PACKETS, // number of passed packets
+	COUNTER_PASSED_BYTES, // number of passed bytes
+	COUNTER_DROPPED_PACKETS, // number of dropped packets
+	COUNTER_DROPPED_BYTES, // number of dropped bytes
+	COUNTER_EVENTS_LOST, // number of drop events lost because the ring buffer was full
+	COUNTER_CAPTURE_LOST, // number of captured packets lost because the capture ring buffer was full
+	// Number of dropped packets per drop reason (one counter for each reason except DROP_REASON_NONE).
+	COUNTER_DROPPED_BY_REASON,
+	COUNTER_MAX = COUNTER_DROPPED_BY_REASON + DROP_REASON_MAX - 1,
+};
+
+// Number of counter slots per CPU. Two cache lines, so CPUs never share a cache line.
+#define COUNTERS_PER_CPU 16
+
+_Static_assert(COUNTER_MAX <= COUNTERS_PER_CPU, "too many global counters");
+
+// Maximum number of CPUs with their own counters in xdp_counters_map. Packets
+// processed by CPUs with higher ids are filtered, but not counted.
+#define COUNTERS_MAX_CPUS 1024
+
+// The global counters are stored in a memory-mappable array, which user space
+// maps into its address space, so reading the counters requires no system call.
+// Since memory-mappable arrays cannot be per-CPU arrays, every CPU has its own
+// entry (index is the CPU id), which it updates without locks or atomic operations.
+// User space sums up the counters of all CPUs.
+struct cpu_counters {
+	uint64_t value[COUNTERS_PER_CPU]; // indices cf. enum global_counter
+};
+
+// Runtime configuration of the BPF program, stored as the only entry of xdp_config_map.
+struct drop_config {
+	uint32_t event_sample_rate; // emit a drop event for one out of this number of drops (0: no events)
+	uint32_t acl_enabled; // classify IP packets with the ACL rules (0: ACL disabled)
+	uint32_t acl_set; // active set of ACL rules (0 or 1), cf. ACL maps below
+	uint32_t acl_num_rules; // number of rules in the active set (only used by user space)
+	uint32_t psfp_enabled; // apply per-stream filtering and policing (0: PSFP disabled)
+	uint32_t disabled_stages; // bitmask of pipeline stages disabled by the user (1 << enum pipeline_stage)
+	uint32_t sketch_enabled; // count IP flows in the count-min sketch (0: sketch disabled)
+	uint32_t sketch_threshold; // per-CPU packet count from which a flow becomes a top-K candidate
+	uint32_t filter_enabled; // match packets against the compiled filters (0: filters disabled)
+	uint32_t filter_set; // active set of filters (0 or 1), cf. filter maps below
+	uint32_t filter_num_rules; // number of filters in the active set
+	uint32_t capture_enabled; // copy matching packets to xdp_capture_events (0: capture disabled)
+	uint32_t capture_snaplen; // number of bytes captured per packet (1 to CAPTURE_MAX_SNAPLEN)
+	uint32_t capture_drops_only; // 1: capture dropped packets only
+};
+
+// Stages of the packet processing pipeline, i.e., indices of the stage programs
+// in the program array xdp_pipeline_map. The entry program xdp_prog_main counts
+// the packet and tail-calls the first enabled stage; every stage tail-calls the
+// next enabled one, or the action stage as soon as the packet is to be dropped.
+// Disabled stages have no entry in the program array, so packets do not pay for
+// them. The entries are managed by user space (cf. pipeline_sync()).
+enum pipeline_stage {
+	PIPELINE_STAGE_BLOCKLIST = 0, // drop packets to or from blocked MAC addresses
+	PIPELINE_STAGE_PARSE, // parse L2 to L4 headers into the per-CPU scratch space
+	PIPELINE_STAGE_SKETCH, // count IP flows in the count-min sketch (requires parse)
+	PIPELINE_STAGE_PSFP, // per-stream filtering and policing (requires parse)
+	PIPELINE_STAGE_ACL, // ACL classification (requires parse)
+	PIPELINE_STAGE_FILTER, // filters compiled from pcap-filter expressions (requires parse)
+	PIPELINE_STAGE_CAPTURE, // copy packets to user space; dropped packets continue here, too
+	PIPELINE_STAGE_ACTION, // update statistics, emit drop events, return verdict
+	PIPELINE_MAX_STAGES
+};
+
+// Compact event describing a dropped packet, sent to user space through the
+// ring buffer xdp_drop_events.
+struct drop_event {
+	uint64_t timestamp; // time of the drop in nano-seconds (TAI clock)
+	uint32_t pkt_len; // length of the packet in bytes
+	uint32_t rx_queue; // RX queue the packet was received from
+	unsigned char dst[ETH_ALEN]; // destination MAC address
+	unsigned char src[ETH_ALEN]; // source MAC address
+	uint16_t eth_proto; // EtherType in network byte order
+	uint16_t reason; // enum drop_reason
+};
+
+// Size of the ring buffer for drop events in bytes (power of 2 and multiple of the page size).
+#define DROP_EVENTS_RINGBUF_SIZE (1 << 20)
+
+// Packet capture: the capture stage copies the first capture_snaplen bytes of
+// every packet matching the capture filter (a single struct filter, cf. below)
+// into the ring buffer xdp_capture_events, from which user space writes a
+// pcapng file. The record is assembled in a per-CPU buffer, since ring buffer
+// reservations must have a constant size, whereas the output does not.
+#define CAPTURE_MAX_SNAPLEN 9216 // jumbo frames
+#define CAPTURE_DEFAULT_SNAPLEN 128 // headers only
+
+// Size of the ring buffer for captured packets in bytes (power of 2 and multiple of the page size).
+#define CAPTURE_RINGBUF_SIZE (1 << 24)
+
+// User space is only woken up once this number of bytes is in the ring buffer
+// (and polls with a timeout otherwise), so it consumes the packets in batches.
+#define CAPTURE_WAKEUP_BYTES (CAPTURE_RINGBUF_SIZE/16)
+
+// Header of a captured packet in xdp_capture_events, followed by cap_len bytes of the packet.
+struct capture_record {
+	uint64_t timestamp; // time of reception in nano-seconds (TAI clock)
+	uint32_t pkt_len; // length of the packet in bytes (including all fragments of multi-buffer packets)
+	uint32_t cap_len; // number of captured bytes following the header
+	uint32_t rx_queue; // RX queue the packet was received from
+	uint16_t reason; // enum drop_reason (DROP_REASON_NONE: passed)
+	uint16_t pad;
+};
+
+// Per-CPU buffer in which the capture stage assembles a record.
+struct capture_buffer {
+	struct capture_record hdr;
+	uint8_t data[CAPTURE_MAX_SNAPLEN];
+};
+
+// Maximum number of MAC addresses tracked in xdp_stats_per_mac_map.
+// The map is an LRU map, so if more MAC addresses are seen, the least recently
+// used entries are evicted.
+#define STATS_PER_MAC_MAX_ENTRIES 16384
+
+// Maximum number of MAC addresses in the blocklist (hash map and bloom filter).
+#define BLOCKLIST_MAX_ENTRIES 65536
+
+// Number of hash functions of the bloom filter in front of the blocklist.
+#define BLOCKLIST_BLOOM_HASHES 3
+
+// Flags stored as value in the blocklist, defining whether packets to (destination)
+// and/or from (source) a MAC address are dropped.
+#define BLOCKLIST_DST (1U << 0)
+#define BLOCKLIST_SRC (1U << 1)
+
 // A hash map, storing for each destination MAC address the number of dropped and passed packets.
+// The key is also used for the blocklist and its bloom filter.
 struct hash_map_key {
-	char addr[ETH_ALEN]; // MAC address with 6 bytes
+	unsigned char addr[ETH_ALEN]; // MAC address with 6 bytes
 };
 
+// The hash map is a per-CPU map, i.e., each CPU updates its own copy of the value
+// without locks. User space has to aggregate the values of all CPUs.
 struct hash_map_value {
-	struct bpf_spin_lock lock; // spin lock for atomic reads and updates
-	uint64_t dropped; // number of dropped packets for this mac.
-	uint64_t t_lastdrop; // time when last packet was dropped in nano-sconds since UNIX epoche.
+	uint64_t dropped_packets; // number of dropped packets for this mac.
+	uint64_t dropped_bytes; // number of dropped bytes for this mac.
+	uint64_t passed_packets; // number of passed packets for this mac.
+	uint64_t passed_bytes; // number of passed bytes for this mac.
+	uint64_t t_lastdrop; // time when last packet was dropped in nano-seconds since system boot.
+};
+
+// Maximum number of RX queues with their own entry in xdp_queue_stats_map.
+// Packets of queues with a higher index are only counted by the global counters.
+#define QUEUE_STATS_MAX_QUEUES 64
+
+// Per-RX-queue counters (index is ctx->rx_queue_index). The map is a per-CPU
+// array, since several CPUs might serve the same queue (e.g., after changing the
+// IRQ affinity). User space sums up the values of all CPUs, and compares the
+// queues to see how evenly RSS spreads the load.
+struct queue_stats {
+	uint64_t rx_packets; // packets received from this queue
+	uint64_t rx_bytes; // bytes received from this queue
+	uint64_t dropped_packets; // packets of this queue dropped by the pipeline
+	uint64_t passed_packets; // packets of this queue passed to the network stack
 };
 
+// ACL (access control list) rules classify IP packets by source and destination
+// prefix, L4 protocol, and source and destination port.
+//
+// Each field is looked up in its own map, returning a bitmap of all rules matching
+// this field. The bitmaps of all fields are ANDed, and the matching rule with the
+// lowest index (highest priority) determines the verdict. Prefixes are looked up
+// in LPM tries, protocol and ports in a hash map. If a protocol or port is not
+// in the hash map, the bitmap of the wildcard entry is used, containing all rules
+// that do not restrict this field.
+//
+// There are two sets of rules. User space writes the inactive set, and then
+// switches the active set in struct drop_config atomically, so packets are never
+// classified by a partially written rule set. The set is part of every key.
+
+// Maximum number of ACL rules per set.
+#define ACL_MAX_RULES 256
+#define ACL_BITMAP_WORDS (ACL_MAX_RULES/64)
+
+// Maximum number of entries of the ACL maps (for both sets).
+#define ACL_LPM_MAX_ENTRIES 16384
+#define ACL_L4_MAX_ENTRIES (2*(2*65536 + 256 + 4))
+
+struct acl_bitmap {
+	uint64_t bits[ACL_BITMAP_WORDS]; // bit i of word w is set if rule 64*w+i matches
+};
+
+// Keys of the LPM tries. The first 32 bits of data after prefixlen are the
+// rule set, so prefixlen is 32 plus the length of the address prefix.
+struct acl_lpm_v4_key {
+	uint32_t prefixlen;
+	uint32_t set;
+	uint8_t addr[4];
+};
+
+struct acl_lpm_v6_key {
+	uint32_t prefixlen;
+	uint32_t set;
+	uint8_t addr[16];
+};
+
+// Fields looked up in the L4 hash map.
+enum acl_l4_field {
+	ACL_FIELD_PROTO = 0,
+	ACL_FIELD_SPORT,
+	ACL_FIELD_DPORT,
+};
+
+// Flag of field in struct acl_l4_key denoting the wildcard entry of a field.
+#define ACL_FIELD_WILDCARD 0x80
+
+struct acl_l4_key {
+	uint8_t set;
+	uint8_t field; // enum acl_l4_field, optionally ORed with ACL_FIELD_WILDCARD
+	uint16_t value; // protocol number or port in host byte order (0 for wildcard entries)
+};
+
+enum acl_action {
+	ACL_ACTION_PASS = 0,
+	ACL_ACTION_DROP,
+	ACL_ACTION_COUNT, // count packet and continue with the next matching rule
+};
+
+struct acl_rule {
+	uint32_t action; // enum acl_action
+};
+
+// Per-CPU counters of packets matching an ACL rule.
+struct acl_rule_stats {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+// Filters compiled from pcap-filter expressions (e.g., "tcp dst port 1234 and
+// not src net 10.3.0.0/16") by the user-space program.
+//
+// The filter stage extracts FILTER_WORDS 32 bit words from the parsed headers
+// (enum filter_word). A term compares nwords consecutive words: it matches if
+// lo[i] <= (word[first + i] & mask[i]) <= hi[i] for all i < nwords, inverted if
+// negate is set. An expression is compiled to disjunctive normal form: a filter
+// matches if all terms of at least one of its clauses match. Since every loop is
+// bounded by the constants below, the matcher is generic, i.e., filters are
+// changed by updating the maps without reloading the program.
+//
+// Like the ACL rules, filters are evaluated in order, COUNT filters count the
+// packet, and the first matching PASS or DROP filter decides (enum acl_action).
+// There are two sets of filters, which are switched atomically in struct drop_config.
+
+// Words extracted from a packet. Multi-byte fields are in host byte order.
+// Presence flags are part of the words, so a single term tests presence and value.
+enum filter_word {
+	FILTER_WORD_LEN = 0, // frame length in bytes
+	FILTER_WORD_ETH_PROTO, // EtherType after VLAN tags
+	FILTER_WORD_VLAN, // 0x1000 | VLAN ID of the outermost tag, 0 if untagged
+	FILTER_WORD_L4_PROTO, // 0x100 | L4 protocol of IP packets, 0 otherwise
+	FILTER_WORD_SPORT, // 0x10000 | source port (TCP, UDP, SCTP), 0 otherwise
+	FILTER_WORD_DPORT, // 0x10000 | destination port (TCP, UDP, SCTP), 0 otherwise
+	FILTER_WORD_DST_MAC, // bytes 0-3 of the destination MAC address, followed by bytes 4-5
+	FILTER_WORD_SRC_MAC = FILTER_WORD_DST_MAC + 2, // same for the source MAC address
+	// 4 for IPv4, 6 for IPv6, 0 otherwise, followed by the four words of the
+	// source address (IPv4 addresses only use the first word).
+	FILTER_WORD_SRC_FAMILY = FILTER_WORD_SRC_MAC + 2,
+	FILTER_WORD_DST_FAMILY = FILTER_WORD_SRC_FAMILY + 5, // same for the destination address
+	FILTER_WORDS = FILTER_WORD_DST_FAMILY + 5,
+};
+
+// Bits of FILTER_WORD_VLAN, FILTER_WORD_L4_PROTO, and FILTER_WORD_SPORT/DPORT
+// flagging that the field is present.
+#define FILTER_VLAN_PRESENT 0x1000
+#define FILTER_L4_PROTO_PRESENT 0x100
+#define FILTER_PORT_PRESENT 0x10000
+
+#define FILTER_MAX_FILTERS 16 // per set
+#define FILTER_MAX_CLAUSES 8 // per filter
+#define FILTER_MAX_TERMS 8 // per clause
+#define FILTER_TERM_WORDS 5 // per term: address family and IPv6 address
+
+struct filter_term {
+	uint8_t word; // first compared word (enum filter_word)
+	uint8_t nwords; // number of compared words (1 to FILTER_TERM_WORDS)
+	uint8_t negate; // 1: the term matches if the words are not in range
+	uint8_t pad;
+	uint32_t mask[FILTER_TERM_WORDS];
+	uint32_t lo[FILTER_TERM_WORDS];
+	uint32_t hi[FILTER_TERM_WORDS];
+};
+
+// Conjunction of terms. A clause without terms matches every packet.
+struct filter_clause {
+	uint32_t nterms;
+	struct filter_term terms[FILTER_MAX_TERMS];
+};
+
+// Disjunction of clauses. A filter without clauses matches no packet.
+struct filter {
+	uint32_t action; // enum acl_action
+	uint32_t nclauses;
+	struct filter_clause clauses[FILTER_MAX_CLAUSES];
+};
+
+// Per-CPU counters of packets matching a filter.
+struct filter_stats {
+	uint64_t packets;
+	uint64_t bytes;
+};
+
+// IEEE 802.1Qci per-stream filtering and policing (PSFP).
+//
+// Streams are identified by destination MAC address, VLAN ID, and PCP
+// (untagged frames have VLAN ID 0 and PCP 0). Each stream filter refers to an
+// optional stream gate and an optional flow meter. A frame passes if it does
+// not exceed the maximum SDU size of the stream filter, the gate is open at the
+// time of reception (TAI clock), and the flow meter does not mark it red.
+// Frames not belonging to any stream are not filtered.
+
+#define PSFP_MAX_STREAMS 1024
+#define PSFP_MAX_GATES 64
+#define PSFP_MAX_METERS 256
+#define PSFP_MAX_GATE_ENTRIES 16
+
+// Value of gate_id and meter_id of a stream filter without gate or meter.
+#define PSFP_NONE 0xffffffff
+
+// Value of pcp in struct psfp_stream_key matching any PCP. Streams with a
+// matching PCP take precedence over streams with wildcard PCP.
+#define PSFP_PCP_ANY 0xff
+
+struct psfp_stream_key {
+	unsigned char dst[ETH_ALEN]; // destination MAC address
+	uint16_t vlan_id; // VLAN ID (0 for untagged frames)
+	uint8_t pcp; // priority code point or PSFP_PCP_ANY
+	uint8_t pad; // always 0
+};
+
+// Stream filter
+struct psfp_stream {
+	uint32_t handle; // index of the stream in xdp_psfp_stats_map
+	uint32_t gate_id; // index in xdp_psfp_gate_map or PSFP_NONE
+	uint32_t meter_id; // index in xdp_psfp_meter_map or PSFP_NONE
+	uint32_t max_sdu; // maximum frame size in bytes (0: no limit)
+};
+
+struct psfp_gate_entry {
+	uint32_t open; // 1: gate open, 0: gate closed
+	uint32_t pad;
+	uint64_t interval; // duration of this entry in nano-seconds
+};
+
+// Stream gate with a cyclic schedule. The cycles start at base_time + n*cycle_time.
+// After the last entry until the end of the cycle, the gate is closed.
+struct psfp_gate {
+	uint64_t base_time; // start of the schedule in nano-seconds (TAI clock)
+	uint64_t cycle_time; // cycle time in nano-seconds (0: gate always open)
+	uint32_t num_entries;
+	uint32_t pad;
+	struct psfp_gate_entry entries[PSFP_MAX_GATE_ENTRIES];
+};
+
+// Flow meter configuration: two-rate three-color meter (bandwidth profile of
+// IEEE 802.1Qci / MEF 10.3) with committed and excess token buckets.
+struct psfp_meter {
+	uint64_t cir; // committed information rate in bytes per second
+	uint64_t cbs; // committed burst size in bytes
+	uint64_t eir; // excess information rate in bytes per second
+	uint64_t ebs; // excess burst size in bytes
+	uint32_t coupling; // 1: tokens overflowing the committed bucket go to the excess bucket
+	uint32_t drop_yellow; // 1: drop yellow frames, too (not only red frames)
+};
+
+// Flow meter state. The state is held in a per-CPU array, so the token buckets
+// are updated without locks. Note that every CPU meters the frames it receives
+// with the full rates, so a stream must be steered to a single RX queue (which
+// is the case for RSS, since all frames of a stream have the same hash).
+struct psfp_meter_state {
+	uint64_t committed_tokens; // in bytes
+	uint64_t excess_tokens; // in bytes
+	uint64_t committed_frac; // fraction of a token not yet added, in bytes per 10^9
+	uint64_t excess_frac; // fraction of a token not yet added, in bytes per 10^9
+	uint64_t t_last; // time of last update in nano-seconds (0: buckets are full)
+};
+
+// Per-CPU counters of a stream filter (IEEE 802.1Qci).
+struct psfp_stream_stats {
+	uint64_t matching_frames; // frames matching the stream filter
+	uint64_t passing_frames; // frames passing the stream gate
+	uint64_t not_passing_frames; // frames dropped since the gate was closed
+	uint64_t passing_sdu; // frames passing the maximum SDU size filter
+	uint64_t not_passing_sdu; // frames dropped since they exceed the maximum SDU size
+	uint64_t red_frames; // frames dropped by the flow meter
+};
+
+// Count-min sketch of the IP flows (heavy-hitter detection).
+//
+// Every row of the sketch has CMS_WIDTH counters. A flow increments one counter
+// per row, selected by hash functions derived from two base hashes
+// (h1 + row*h2). The estimate of a flow is the minimum of its counters, which
+// over-estimates the true count by at most e/CMS_WIDTH * (total count) with
+// probability 1 - e^(-CMS_DEPTH). The rows are per-CPU arrays, merged by user space.
+//
+// Flows whose per-CPU estimate reaches the configured threshold are recorded in
+// a small candidate table, from which user space reports the top-K flows. Since
+// RSS steers all packets of a flow to the same RX queue, the per-CPU estimate
+// is close to the estimate of the merged sketch.
+
+#define CMS_DEPTH 4
+#define CMS_WIDTH 2048 // power of two; one row must fit into a per-CPU map value (32 KiB)
+#define CMS_SEED1 0x9747b28c
+#define CMS_SEED2 0x5bd1e995
+
+// Maximum number of top-K candidates. The least recently updated candidates are evicted.
+#define CMS_MAX_CANDIDATES 1024
+
+// Default value of drop_config.sketch_threshold.
+#define CMS_DEFAULT_THRESHOLD 1024
+
+// One row of the count-min sketch (packets per counter).
+struct cms_row {
+	uint64_t count[CMS_WIDTH];
+};
+
+// 5-tuple of an IP flow. IPv4 addresses occupy the first 4 bytes of the address fields.
+struct flow_key {
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+	uint16_t sport; // host byte order (0 if the protocol has no ports)
+	uint16_t dport; // host byte order (0 if the protocol has no ports)
+	uint8_t proto; // L4 protocol
+	uint8_t family; // 4 or 6
+	uint16_t pad;
+};
+
+// Hash of a flow key (32 bit words mixed as in MurmurHash3). Shared by the BPF
+// program and user space, which must compute the same counters of a flow.
+static inline __attribute__((always_inline))
+uint32_t cms_hash(const struct flow_key *key, uint32_t seed)
+{
+	const uint32_t *words = (const uint32_t *) key;
+	uint32_t h = seed;
+
+	for (unsigned int i = 0; i < sizeof(*key)/sizeof(uint32_t); i++) {
+		uint32_t k = words[i]*0xcc9e2d51;
+		k = (k << 15) | (k >> 17);
+		h ^= k*0x1b873593;
+		h = (h << 13) | (h >> 19);
+		h = h*5 + 0xe6546b64;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+// Column of a flow in the given row. h2 must be odd.
+static inline __attribute__((always_inline))
+uint32_t cms_column(uint32_t h1, uint32_t h2, uint32_t row)
+{
+	return (h1 + row*h2) & (CMS_WIDTH - 1);
+}
+
 #endif
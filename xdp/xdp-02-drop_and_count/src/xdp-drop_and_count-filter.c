@@ -0,0 +1,982 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Compiler of a subset of the pcap-filter language (cf. man pcap-filter):
+//
+//   expr      := and_expr { (or | ||) and_expr }
+//   and_expr  := unary { (and | &&) unary }
+//   unary     := (not | !) unary | ( expr ) | primitive
+//   primitive := [src | dst | src or dst | src and dst] (host ADDR | net PREFIX)
+//              | ether [src | dst | src or dst | src and dst] [host] MAC | ether proto PROTO
+//              | [tcp | udp | sctp] [DIR] (port PORT | portrange PORT-PORT)
+//              | ip | ip6 | arp | tcp | udp | sctp | icmp | icmp6
+//              | [ip | ip6] proto PROTO | vlan [ID] | less LEN | greater LEN
+//
+// As in tcpdump, a bare value after and/or reuses the qualifiers of the previous
+// primitive, e.g., "host 10.0.0.1 or 10.0.0.2". In contrast to tcpdump, VLAN tags
+// are always skipped, i.e., "ip" also matches IPv4 packets with VLAN tags.
+//
+// Every primitive becomes one or two terms (e.g., "port 80" is "src port 80 or
+// dst port 80"), and the expression is converted to disjunctive normal form
+// (cf. struct filter).
+
+// Maximum number of clauses of intermediate results of the compiler. The
+// compiled filter must not have more than FILTER_MAX_CLAUSES clauses.
+#define DNF_MAX_CLAUSES 64
+
+#define FILTER_MAX_TOKENS 256
+#define FILTER_MAX_TOKEN_LEN 64
+
+// Expression in disjunctive normal form: disjunction of clauses.
+struct dnf {
+	uint32_t nclauses;
+	struct filter_clause clauses[DNF_MAX_CLAUSES];
+};
+
+enum filter_dir {
+	DIR_ANY = 0, // src or dst (default)
+	DIR_SRC,
+	DIR_DST,
+	DIR_BOTH, // src and dst
+};
+
+enum filter_type {
+	TYPE_HOST = 0,
+	TYPE_NET,
+	TYPE_PORT,
+	TYPE_PORTRANGE,
+	TYPE_ETHER_HOST,
+};
+
+// Qualifiers of a primitive with a value.
+struct qualifiers {
+	enum filter_dir dir;
+	enum filter_type type;
+	int proto; // L4 protocol qualifier of port and portrange, -1 if none
+};
+
+struct parser {
+	char tokens[FILTER_MAX_TOKENS][FILTER_MAX_TOKEN_LEN];
+	int ntokens;
+	int pos;
+	const char *error;
+	bool has_last; // last holds the qualifiers of the previous primitive
+	struct qualifiers last;
+};
+
+// The filter maps pinned by the running instance of the program.
+struct filter_maps {
+	int config_fd;
+	int filter_fd;
+	int stats_fd;
+};
+
+// Names of the words of enum filter_word, printed by "filter compile".
+static const char *const word_names[FILTER_WORDS] = {
+	[FILTER_WORD_LEN] = "len",
+	[FILTER_WORD_ETH_PROTO] = "eth-proto",
+	[FILTER_WORD_VLAN] = "vlan",
+	[FILTER_WORD_L4_PROTO] = "l4-proto",
+	[FILTER_WORD_SPORT] = "sport",
+	[FILTER_WORD_DPORT] = "dport",
+	[FILTER_WORD_DST_MAC] = "dst-mac[0:4]",
+	[FILTER_WORD_DST_MAC + 1] = "dst-mac[4:6]",
+	[FILTER_WORD_SRC_MAC] = "src-mac[0:4]",
+	[FILTER_WORD_SRC_MAC + 1] = "src-mac[4:6]",
+	[FILTER_WORD_SRC_FAMILY] = "src-family",
+	[FILTER_WORD_SRC_FAMILY + 1] = "src-addr[0:4]",
+	[FILTER_WORD_SRC_FAMILY + 2] = "src-addr[4:8]",
+	[FILTER_WORD_SRC_FAMILY + 3] = "src-addr[8:12]",
+	[FILTER_WORD_SRC_FAMILY + 4] = "src-addr[12:16]",
+	[FILTER_WORD_DST_FAMILY] = "dst-family",
+	[FILTER_WORD_DST_FAMILY + 1] = "dst-addr[0:4]",
+	[FILTER_WORD_DST_FAMILY + 2] = "dst-addr[4:8]",
+	[FILTER_WORD_DST_FAMILY + 3] = "dst-addr[8:12]",
+	[FILTER_WORD_DST_FAMILY + 4] = "dst-addr[12:16]",
+};
+
+static void filter_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE filter load FILE\n"
+		"%s -d DEVICE filter compile EXPRESSION...\n"
+		"%s -d DEVICE filter stats\n"
+		"  FILE contains one filter per line, ordered by priority:\n"
+		"  pass|drop|count EXPRESSION\n"
+		"  EXPRESSION is a pcap-filter expression (as for tcpdump) using host, net,\n"
+		"  port, portrange, ether host, ether proto, ip, ip6, arp, tcp, udp, sctp, icmp,\n"
+		"  icmp6, proto, vlan, less, greater, and, or, not, and parentheses.\n"
+		"  Packets not matching any pass or drop filter pass. Lines starting with # are\n"
+		"  ignored. At most %d filters are loaded. An empty file removes all filters.\n",
+		prog, prog, prog, FILTER_MAX_FILTERS);
+}
+
+static struct dnf *dnf_new(struct parser *p)
+{
+	struct dnf *d = calloc(1, sizeof(*d));
+	if (d == NULL)
+		p->error = "out of memory";
+	return d;
+}
+
+// Expression matching every packet: a single clause without terms.
+static struct dnf *dnf_true(struct parser *p)
+{
+	struct dnf *d = dnf_new(p);
+	if (d != NULL)
+		d->nclauses = 1;
+	return d;
+}
+
+static struct dnf *dnf_term(struct parser *p, const struct filter_term *term)
+{
+	struct dnf *d = dnf_true(p);
+	if (d != NULL) {
+		d->clauses[0].nterms = 1;
+		d->clauses[0].terms[0] = *term;
+	}
+	return d;
+}
+
+// The following functions free their operands, which may be NULL after an error.
+
+static struct dnf *dnf_or(struct parser *p, struct dnf *a, struct dnf *b)
+{
+	if (a == NULL || b == NULL) {
+		free(a);
+		free(b);
+		return NULL;
+	}
+
+	if (a->nclauses + b->nclauses > DNF_MAX_CLAUSES) {
+		p->error = "expression too complex (too many alternatives)";
+		free(a);
+		free(b);
+		return NULL;
+	}
+	memcpy(&a->clauses[a->nclauses], b->clauses, b->nclauses*sizeof(b->clauses[0]));
+	a->nclauses += b->nclauses;
+	free(b);
+
+	return a;
+}
+
+// (a1 or a2) and (b1 or b2) = (a1 and b1) or (a1 and b2) or (a2 and b1) or (a2 and b2)
+static struct dnf *dnf_and(struct parser *p, struct dnf *a, struct dnf *b)
+{
+	struct dnf *d = NULL;
+
+	if (a == NULL || b == NULL)
+		goto out;
+	if (a->nclauses*b->nclauses > DNF_MAX_CLAUSES) {
+		p->error = "expression too complex (too many alternatives)";
+		goto out;
+	}
+	d = dnf_new(p);
+	if (d == NULL)
+		goto out;
+
+	for (uint32_t i = 0; i < a->nclauses; i++) {
+		for (uint32_t j = 0; j < b->nclauses; j++) {
+			const struct filter_clause *ca = &a->clauses[i];
+			const struct filter_clause *cb = &b->clauses[j];
+			struct filter_clause *c = &d->clauses[d->nclauses++];
+			if (ca->nterms + cb->nterms > FILTER_MAX_TERMS) {
+				p->error = "expression too complex (too many terms per alternative)";
+				free(d);
+				d = NULL;
+				goto out;
+			}
+			memcpy(c->terms, ca->terms, ca->nterms*sizeof(ca->terms[0]));
+			memcpy(&c->terms[ca->nterms], cb->terms, cb->nterms*sizeof(cb->terms[0]));
+			c->nterms = ca->nterms + cb->nterms;
+		}
+	}
+
+out:
+	free(a);
+	free(b);
+	return d;
+}
+
+// not (c1 or c2) = (not c1) and (not c2), where not (t1 and t2) = (not t1) or (not t2).
+static struct dnf *dnf_not(struct parser *p, struct dnf *a)
+{
+	if (a == NULL)
+		return NULL;
+
+	struct dnf *d = dnf_true(p);
+	for (uint32_t i = 0; i < a->nclauses && d != NULL; i++) {
+		// Negation of a clause without terms (true) is a DNF without clauses (false).
+		struct dnf *negated = dnf_new(p);
+		if (negated != NULL) {
+			const struct filter_clause *c = &a->clauses[i];
+			for (uint32_t t = 0; t < c->nterms; t++) {
+				negated->clauses[t].nterms = 1;
+				negated->clauses[t].terms[0] = c->terms[t];
+				negated->clauses[t].terms[0].negate ^= 1;
+			}
+			negated->nclauses = c->nterms;
+		}
+		d = dnf_and(p, d, negated);
+	}
+
+	free(a);
+	return d;
+}
+
+static struct filter_term term_range(enum filter_word word, uint32_t mask, uint32_t lo, uint32_t hi)
+{
+	struct filter_term term = {
+		.word = word,
+		.nwords = 1,
+	};
+	term.mask[0] = mask;
+	term.lo[0] = lo;
+	term.hi[0] = hi;
+	return term;
+}
+
+static struct filter_term term_eq(enum filter_word word, uint32_t mask, uint32_t value)
+{
+	return term_range(word, mask, value & mask, value & mask);
+}
+
+// Term matching the address prefix of the given family (4 or 6) at word (the
+// family word preceding the address).
+static struct filter_term term_prefix(enum filter_word word, int family, const uint8_t *addr,
+				      unsigned int len)
+{
+	struct filter_term term = {
+		.word = word,
+		.nwords = 1 + (family == 4 ? 1 : 4),
+	};
+	term.mask[0] = 0xffffffff;
+	term.lo[0] = term.hi[0] = family;
+
+	for (int i = 1; i < term.nwords; i++) {
+		unsigned int bits = len > 32*(i - 1) ? len - 32*(i - 1) : 0;
+		uint32_t mask = bits >= 32 ? 0xffffffff : bits == 0 ? 0 : ~(0xffffffffU >> bits);
+		uint32_t value;
+		memcpy(&value, &addr[4*(i - 1)], sizeof(value));
+		term.mask[i] = mask;
+		term.lo[i] = term.hi[i] = ntohl(value) & mask;
+	}
+	// Words beyond the prefix match every address.
+	while (term.nwords > 2 && term.mask[term.nwords - 1] == 0)
+		term.nwords--;
+
+	return term;
+}
+
+static struct filter_term term_mac(enum filter_word word, const unsigned char *mac)
+{
+	struct filter_term term = {
+		.word = word,
+		.nwords = 2,
+	};
+	term.mask[0] = 0xffffffff;
+	term.lo[0] = term.hi[0] = (mac[0] << 24) | (mac[1] << 16) | (mac[2] << 8) | mac[3];
+	term.mask[1] = 0xffff;
+	term.lo[1] = term.hi[1] = (mac[4] << 8) | mac[5];
+	return term;
+}
+
+// Combine the source and destination variants of a primitive according to dir.
+static struct dnf *dnf_dir(struct parser *p, enum filter_dir dir,
+			   const struct filter_term *src, const struct filter_term *dst)
+{
+	switch (dir) {
+	case DIR_SRC:
+		return dnf_term(p, src);
+	case DIR_DST:
+		return dnf_term(p, dst);
+	case DIR_BOTH:
+		return dnf_and(p, dnf_term(p, src), dnf_term(p, dst));
+	default:
+		return dnf_or(p, dnf_term(p, src), dnf_term(p, dst));
+	}
+}
+
+static void tokenize(struct parser *p, const char *expr)
+{
+	p->ntokens = 0;
+	while (*expr != '\0' && p->error == NULL) {
+		if (isspace((unsigned char) *expr)) {
+			expr++;
+			continue;
+		}
+
+		size_t len;
+		if (*expr == '(' || *expr == ')' || *expr == '!')
+			len = 1;
+		else if (strncmp(expr, "&&", 2) == 0 || strncmp(expr, "||", 2) == 0)
+			len = 2;
+		else
+			len = strcspn(expr, " \t\r\n()!&|");
+
+		if (len == 0 || len >= FILTER_MAX_TOKEN_LEN) {
+			p->error = "invalid token";
+		} else if (p->ntokens == FILTER_MAX_TOKENS) {
+			p->error = "expression too long";
+		} else {
+			memcpy(p->tokens[p->ntokens], expr, len);
+			p->tokens[p->ntokens][len] = '\0';
+			p->ntokens++;
+		}
+		expr += len;
+	}
+}
+
+// Returns the current token without consuming it, or "" at the end.
+static const char *peek_token(struct parser *p, int ahead)
+{
+	return p->pos + ahead < p->ntokens ? p->tokens[p->pos + ahead] : "";
+}
+
+static const char *next_token(struct parser *p)
+{
+	const char *tok = peek_token(p, 0);
+	if (p->pos < p->ntokens)
+		p->pos++;
+	return tok;
+}
+
+static bool accept_token(struct parser *p, const char *tok)
+{
+	if (strcmp(peek_token(p, 0), tok) != 0)
+		return false;
+	p->pos++;
+	return true;
+}
+
+static bool parse_number(const char *tok, unsigned long max, unsigned long *value)
+{
+	char *end;
+	if (!isdigit((unsigned char) *tok))
+		return false;
+	*value = strtoul(tok, &end, 0);
+	return *end == '\0' && *value <= max;
+}
+
+// Protocol names as accepted by ip proto and ether proto.
+static int parse_l4_proto(const char *tok)
+{
+	static const struct { const char *name; int proto; } names[] = {
+		{ "tcp", IPPROTO_TCP }, { "udp", IPPROTO_UDP }, { "sctp", IPPROTO_SCTP },
+		{ "icmp", IPPROTO_ICMP }, { "icmp6", IPPROTO_ICMPV6 },
+	};
+	for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); i++) {
+		if (strcmp(tok, names[i].name) == 0)
+			return names[i].proto;
+	}
+
+	unsigned long proto;
+	return parse_number(tok, 255, &proto) ? (int) proto : -1;
+}
+
+static int parse_eth_proto(const char *tok)
+{
+	if (strcmp(tok, "ip") == 0)
+		return ETH_P_IP;
+	if (strcmp(tok, "ip6") == 0)
+		return ETH_P_IPV6;
+	if (strcmp(tok, "arp") == 0)
+		return ETH_P_ARP;
+
+	unsigned long proto;
+	return parse_number(tok, 0xffff, &proto) ? (int) proto : -1;
+}
+
+static int parse_port(const char *tok, int proto)
+{
+	unsigned long port;
+	if (parse_number(tok, 65535, &port))
+		return port;
+
+	// Service name, e.g., http
+	const char *proto_name = proto == IPPROTO_UDP ? "udp" : proto == IPPROTO_TCP ? "tcp" : NULL;
+	struct servent *service = getservbyname(tok, proto_name);
+	return service != NULL ? ntohs(service->s_port) : -1;
+}
+
+// Parse an IPv4 or IPv6 address with an optional prefix length.
+// Returns the address family (4 or 6), or -1 on error.
+static int parse_prefix(const char *tok, bool allow_len, uint8_t *addr, unsigned int *len)
+{
+	char buf[FILTER_MAX_TOKEN_LEN];
+	int family;
+
+	strcpy(buf, tok);
+	char *slash = strchr(buf, '/');
+	if (slash != NULL)
+		*slash = '\0';
+
+	memset(addr, 0, 16);
+	if (inet_pton(AF_INET, buf, addr) == 1)
+		family = 4;
+	else if (inet_pton(AF_INET6, buf, addr) == 1)
+		family = 6;
+	else
+		return -1;
+
+	unsigned long maxlen = family == 4 ? 32 : 128;
+	*len = maxlen;
+	if (slash != NULL) {
+		unsigned long value;
+		if (!allow_len || !parse_number(slash + 1, maxlen, &value))
+			return -1;
+		*len = value;
+	}
+
+	return family;
+}
+
+// Parse the value of a primitive with the given qualifiers.
+static struct dnf *parse_value(struct parser *p, const struct qualifiers *q)
+{
+	const char *tok = next_token(p);
+	struct filter_term src, dst;
+
+	p->has_last = true;
+	p->last = *q;
+
+	switch (q->type) {
+	case TYPE_HOST:
+	case TYPE_NET: {
+		uint8_t addr[16];
+		unsigned int len;
+		int family = parse_prefix(tok, q->type == TYPE_NET, addr, &len);
+		if (family < 0) {
+			p->error = q->type == TYPE_HOST ? "invalid IP address" : "invalid network prefix";
+			return NULL;
+		}
+		src = term_prefix(FILTER_WORD_SRC_FAMILY, family, addr, len);
+		dst = term_prefix(FILTER_WORD_DST_FAMILY, family, addr, len);
+		return dnf_dir(p, q->dir, &src, &dst);
+	}
+	case TYPE_PORT:
+	case TYPE_PORTRANGE: {
+		char buf[FILTER_MAX_TOKEN_LEN];
+		strcpy(buf, tok);
+		char *dash = q->type == TYPE_PORTRANGE ? strchr(buf, '-') : NULL;
+		if (dash != NULL)
+			*dash = '\0';
+		int lo = parse_port(buf, q->proto);
+		int hi = dash != NULL ? parse_port(dash + 1, q->proto) : lo;
+		if (lo < 0 || hi < lo || (q->type == TYPE_PORTRANGE && dash == NULL)) {
+			p->error = q->type == TYPE_PORT ? "invalid port" : "invalid port range";
+			return NULL;
+		}
+		src = term_range(FILTER_WORD_SPORT, 0x1ffff, FILTER_PORT_PRESENT | lo,
+				 FILTER_PORT_PRESENT | hi);
+		dst = term_range(FILTER_WORD_DPORT, 0x1ffff, FILTER_PORT_PRESENT | lo,
+				 FILTER_PORT_PRESENT | hi);
+		struct dnf *d = dnf_dir(p, q->dir, &src, &dst);
+		if (q->proto >= 0) {
+			struct filter_term proto = term_eq(FILTER_WORD_L4_PROTO, 0x1ff,
+							   FILTER_L4_PROTO_PRESENT | q->proto);
+			d = dnf_and(p, dnf_term(p, &proto), d);
+		}
+		return d;
+	}
+	case TYPE_ETHER_HOST: {
+		unsigned char mac[ETH_ALEN];
+		if (parse_mac(tok, mac) != 0) {
+			p->error = "invalid MAC address";
+			return NULL;
+		}
+		src = term_mac(FILTER_WORD_SRC_MAC, mac);
+		dst = term_mac(FILTER_WORD_DST_MAC, mac);
+		return dnf_dir(p, q->dir, &src, &dst);
+	}
+	}
+
+	p->error = "invalid primitive";
+	return NULL;
+}
+
+// Parse the direction qualifier src, dst, src or dst, or src and dst (if present).
+static enum filter_dir parse_dir(struct parser *p)
+{
+	if (accept_token(p, "src")) {
+		if (strcmp(peek_token(p, 1), "dst") == 0) {
+			if (accept_token(p, "or") && accept_token(p, "dst"))
+				return DIR_ANY;
+			if (accept_token(p, "and") && accept_token(p, "dst"))
+				return DIR_BOTH;
+		}
+		return DIR_SRC;
+	}
+	if (accept_token(p, "dst"))
+		return DIR_DST;
+	return DIR_ANY;
+}
+
+// Parse the type of a primitive with a value after the direction. A direction
+// without type refers to a host (as in tcpdump, "src 10.0.0.1").
+static struct dnf *parse_typed(struct parser *p, int proto, bool ether)
+{
+	struct qualifiers q = {
+		.dir = parse_dir(p),
+		.type = ether ? TYPE_ETHER_HOST : TYPE_HOST,
+		.proto = proto,
+	};
+
+	if (ether)
+		accept_token(p, "host");
+	else if (accept_token(p, "net"))
+		q.type = TYPE_NET;
+	else if (accept_token(p, "port"))
+		q.type = TYPE_PORT;
+	else if (accept_token(p, "portrange"))
+		q.type = TYPE_PORTRANGE;
+	else
+		accept_token(p, "host");
+
+	if (proto >= 0 && q.type != TYPE_PORT && q.type != TYPE_PORTRANGE) {
+		p->error = "protocol qualifier requires port or portrange";
+		return NULL;
+	}
+
+	return parse_value(p, &q);
+}
+
+static bool is_dir_or_type(const char *tok)
+{
+	return strcmp(tok, "src") == 0 || strcmp(tok, "dst") == 0 || strcmp(tok, "host") == 0 ||
+		strcmp(tok, "net") == 0 || strcmp(tok, "port") == 0 || strcmp(tok, "portrange") == 0;
+}
+
+static struct dnf *parse_primitive(struct parser *p)
+{
+	const char *tok = peek_token(p, 0);
+	struct filter_term term;
+	unsigned long value;
+
+	if (is_dir_or_type(tok))
+		return parse_typed(p, -1, false);
+
+	if (accept_token(p, "ether")) {
+		if (accept_token(p, "proto")) {
+			int proto = parse_eth_proto(next_token(p));
+			if (proto < 0) {
+				p->error = "invalid EtherType";
+				return NULL;
+			}
+			term = term_eq(FILTER_WORD_ETH_PROTO, 0xffff, proto);
+			return dnf_term(p, &term);
+		}
+		return parse_typed(p, -1, true);
+	}
+
+	if (strcmp(tok, "tcp") == 0 || strcmp(tok, "udp") == 0 || strcmp(tok, "sctp") == 0 ||
+	    strcmp(tok, "icmp") == 0 || strcmp(tok, "icmp6") == 0) {
+		int proto = parse_l4_proto(next_token(p));
+		// "tcp dst port 80" qualifies the port with the protocol.
+		if (proto != IPPROTO_ICMP && proto != IPPROTO_ICMPV6 && is_dir_or_type(peek_token(p, 0)))
+			return parse_typed(p, proto, false);
+		term = term_eq(FILTER_WORD_L4_PROTO, 0x1ff, FILTER_L4_PROTO_PRESENT | proto);
+		return dnf_term(p, &term);
+	}
+
+	if (strcmp(tok, "ip") == 0 || strcmp(tok, "ip6") == 0 || strcmp(tok, "arp") == 0) {
+		int eth_proto = parse_eth_proto(next_token(p));
+		term = term_eq(FILTER_WORD_ETH_PROTO, 0xffff, eth_proto);
+		struct dnf *d = dnf_term(p, &term);
+		if (eth_proto != ETH_P_ARP && accept_token(p, "proto")) {
+			int proto = parse_l4_proto(next_token(p));
+			if (proto < 0) {
+				p->error = "invalid protocol";
+				free(d);
+				return NULL;
+			}
+			term = term_eq(FILTER_WORD_L4_PROTO, 0x1ff, FILTER_L4_PROTO_PRESENT | proto);
+			d = dnf_and(p, d, dnf_term(p, &term));
+		} else if (eth_proto != ETH_P_ARP && is_dir_or_type(peek_token(p, 0))) {
+			// "ip host 10.0.0.1": the address implies the family.
+			d = dnf_and(p, d, parse_typed(p, -1, false));
+		}
+		return d;
+	}
+
+	if (accept_token(p, "proto")) {
+		int proto = parse_l4_proto(next_token(p));
+		if (proto < 0) {
+			p->error = "invalid protocol";
+			return NULL;
+		}
+		term = term_eq(FILTER_WORD_L4_PROTO, 0x1ff, FILTER_L4_PROTO_PRESENT | proto);
+		return dnf_term(p, &term);
+	}
+
+	if (accept_token(p, "vlan")) {
+		if (parse_number(peek_token(p, 0), 4095, &value)) {
+			next_token(p);
+			term = term_eq(FILTER_WORD_VLAN, 0x1fff, FILTER_VLAN_PRESENT | value);
+		} else {
+			term = term_eq(FILTER_WORD_VLAN, FILTER_VLAN_PRESENT, FILTER_VLAN_PRESENT);
+		}
+		return dnf_term(p, &term);
+	}
+
+	if (strcmp(tok, "less") == 0 || strcmp(tok, "greater") == 0) {
+		bool less = (strcmp(next_token(p), "less") == 0);
+		if (!parse_number(next_token(p), 0xffffffff, &value)) {
+			p->error = "invalid length";
+			return NULL;
+		}
+		term = less ? term_range(FILTER_WORD_LEN, 0xffffffff, 0, value) :
+			term_range(FILTER_WORD_LEN, 0xffffffff, value, 0xffffffff);
+		return dnf_term(p, &term);
+	}
+
+	// A bare value reuses the qualifiers of the previous primitive.
+	if (p->has_last && *tok != '\0' && strcmp(tok, ")") != 0)
+		return parse_value(p, &p->last);
+
+	p->error = *tok == '\0' ? "unexpected end of expression" : "unknown primitive";
+	return NULL;
+}
+
+static struct dnf *parse_or(struct parser *p);
+
+static struct dnf *parse_unary(struct parser *p)
+{
+	if (accept_token(p, "not") || accept_token(p, "!"))
+		return dnf_not(p, parse_unary(p));
+
+	if (accept_token(p, "(")) {
+		struct dnf *d = parse_or(p);
+		if (d != NULL && !accept_token(p, ")")) {
+			p->error = "missing )";
+			free(d);
+			return NULL;
+		}
+		return d;
+	}
+
+	return parse_primitive(p);
+}
+
+static struct dnf *parse_and(struct parser *p)
+{
+	struct dnf *d = parse_unary(p);
+	while (d != NULL && (accept_token(p, "and") || accept_token(p, "&&")))
+		d = dnf_and(p, d, parse_unary(p));
+	return d;
+}
+
+static struct dnf *parse_or(struct parser *p)
+{
+	struct dnf *d = parse_and(p);
+	while (d != NULL && (accept_token(p, "or") || accept_token(p, "||")))
+		d = dnf_or(p, d, parse_and(p));
+	return d;
+}
+
+// Compile a pcap-filter expression. Returns 0 on success, or -1 and sets *error.
+static int filter_compile(const char *expr, struct filter *filter, const char **error)
+{
+	struct parser *p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		*error = "out of memory";
+		return -1;
+	}
+
+	struct dnf *d = NULL;
+	tokenize(p, expr);
+	if (p->error == NULL) {
+		// An empty expression matches every packet, as for tcpdump.
+		d = p->ntokens == 0 ? dnf_true(p) : parse_or(p);
+		if (d != NULL && p->pos < p->ntokens)
+			p->error = "unexpected token";
+		else if (d != NULL && d->nclauses > FILTER_MAX_CLAUSES)
+			p->error = "expression too complex (too many alternatives)";
+	}
+
+	int ret = -1;
+	if (d != NULL && p->error == NULL) {
+		memset(filter, 0, sizeof(*filter));
+		filter->nclauses = d->nclauses;
+		memcpy(filter->clauses, d->clauses, d->nclauses*sizeof(d->clauses[0]));
+		ret = 0;
+	}
+	*error = p->error;
+
+	free(d);
+	free(p);
+	return ret;
+}
+
+static void print_filter(const struct filter *filter)
+{
+	if (filter->nclauses == 0)
+		printf("  never matches\n");
+
+	for (uint32_t c = 0; c < filter->nclauses; c++) {
+		const struct filter_clause *clause = &filter->clauses[c];
+		printf("  %s", c == 0 ? "" : "or ");
+		if (clause->nterms == 0)
+			printf("always matches");
+		for (uint32_t t = 0; t < clause->nterms; t++) {
+			const struct filter_term *term = &clause->terms[t];
+			printf("%s%s(", t == 0 ? "" : " and ", term->negate ? "not " : "");
+			for (int i = 0; i < term->nwords; i++) {
+				printf("%s%s & 0x%x ", i == 0 ? "" : " and ", word_names[term->word + i],
+				       term->mask[i]);
+				if (term->lo[i] == term->hi[i])
+					printf("== 0x%x", term->lo[i]);
+				else
+					printf("in [0x%x, 0x%x]", term->lo[i], term->hi[i]);
+			}
+			printf(")");
+		}
+		printf("\n");
+	}
+}
+
+static int open_filter_maps(const char *ifname, struct filter_maps *maps)
+{
+	maps->config_fd = open_pinned_map(ifname, "xdp_config_map");
+	maps->filter_fd = open_pinned_map(ifname, "xdp_filter_map");
+	maps->stats_fd = open_pinned_map(ifname, "xdp_filter_stats_map");
+
+	if (maps->config_fd < 0 || maps->filter_fd < 0 || maps->stats_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+// Write the filters to the inactive set and activate it.
+static int filter_write(struct filter_maps *maps, const struct filter *filters, size_t nfilters)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0) {
+		perror("Could not read configuration");
+		return EXIT_FAIL_FINDELEM;
+	}
+	uint32_t set = !(cfg.filter_set & 1);
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_UPDATE;
+	struct filter_stats zero_stats[ncpus];
+	memset(zero_stats, 0, sizeof(zero_stats));
+
+	// Unused entries of the set never match.
+	struct filter *unused = calloc(1, sizeof(*unused));
+	if (unused == NULL)
+		return EXIT_FAIL_UPDATE;
+	int exitcode = EXIT_OK;
+	for (uint32_t f = 0; f < FILTER_MAX_FILTERS; f++) {
+		uint32_t index = set*FILTER_MAX_FILTERS + f;
+		const struct filter *filter = f < nfilters ? &filters[f] : unused;
+		if (bpf_map_update_elem(maps->filter_fd, &index, filter, BPF_ANY) != 0 ||
+		    bpf_map_update_elem(maps->stats_fd, &index, zero_stats, BPF_ANY) != 0) {
+			perror("Could not write filters");
+			exitcode = EXIT_FAIL_UPDATE;
+			break;
+		}
+	}
+	free(unused);
+	if (exitcode != EXIT_OK)
+		return exitcode;
+
+	// Atomically switch to the new set. The BPF program reads the configuration
+	// once per packet, so a packet is either matched by the old or the new set.
+	cfg.filter_set = set;
+	cfg.filter_enabled = (nfilters > 0);
+	cfg.filter_num_rules = nfilters;
+	if (bpf_map_update_elem(maps->config_fd, &config_key, &cfg, BPF_ANY) != 0) {
+		perror("Could not write configuration");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return EXIT_OK;
+}
+
+static int filter_load(struct filter_maps *maps, const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		perror("Could not open filter file");
+		return EXIT_FAIL_USAGE;
+	}
+
+	struct filter *filters = calloc(FILTER_MAX_FILTERS, sizeof(*filters));
+	size_t nfilters = 0;
+	char line[512];
+	unsigned int lineno = 0;
+	int exitcode = EXIT_OK;
+
+	if (filters == NULL) {
+		perror("Could not allocate memory");
+		exitcode = EXIT_FAIL_UPDATE;
+		goto out;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+
+		char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#')
+			continue; // empty line or comment
+
+		if (nfilters == FILTER_MAX_FILTERS) {
+			fprintf(stderr, "Too many filters (maximum is %d)\n", FILTER_MAX_FILTERS);
+			exitcode = EXIT_FAIL_USAGE;
+			goto out;
+		}
+
+		size_t len = strcspn(start, " \t\r\n");
+		char *expr = start + len + strspn(start + len, " \t\r\n");
+		start[len] = '\0';
+
+		const char *error = NULL;
+		uint32_t action = ACL_ACTION_PASS;
+		if (strcmp(start, "pass") == 0)
+			action = ACL_ACTION_PASS;
+		else if (strcmp(start, "drop") == 0)
+			action = ACL_ACTION_DROP;
+		else if (strcmp(start, "count") == 0)
+			action = ACL_ACTION_COUNT;
+		else
+			error = "invalid action";
+
+		if (error == NULL && filter_compile(expr, &filters[nfilters], &error) == 0) {
+			filters[nfilters].action = action;
+			nfilters++;
+			continue;
+		}
+		fprintf(stderr, "%s:%u: %s\n", filename, lineno, error);
+		exitcode = EXIT_FAIL_USAGE;
+		goto out;
+	}
+
+	exitcode = filter_write(maps, filters, nfilters);
+	if (exitcode == EXIT_OK)
+		printf("Loaded %zu filters\n", nfilters);
+
+out:
+	free(filters);
+	fclose(f);
+	return exitcode;
+}
+
+static int filter_stats(struct filter_maps *maps)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0)
+		return EXIT_FAIL_FINDELEM;
+	if (!cfg.filter_enabled) {
+		printf("Filters disabled\n");
+		return EXIT_OK;
+	}
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_FINDELEM;
+	struct filter_stats stats[ncpus];
+
+	for (uint32_t f = 0; f < cfg.filter_num_rules; f++) {
+		uint32_t index = (cfg.filter_set & 1)*FILTER_MAX_FILTERS + f;
+		if (bpf_map_lookup_elem(maps->stats_fd, &index, stats) != 0)
+			return EXIT_FAIL_FINDELEM;
+
+		struct filter_stats sum = {};
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			sum.packets += stats[cpu].packets;
+			sum.bytes += stats[cpu].bytes;
+		}
+		printf("Filter %u: %lu packets (%lu bytes)\n", f, sum.packets, sum.bytes);
+	}
+
+	return EXIT_OK;
+}
+
+int filter_compile_args(int argc, char *argv[], struct filter *filter)
+{
+	char expr[1024] = "";
+	size_t len = 0;
+
+	for (int i = 0; i < argc; i++) {
+		int n = snprintf(expr + len, sizeof(expr) - len, "%s%s", i == 0 ? "" : " ", argv[i]);
+		if (n < 0 || (size_t) n >= sizeof(expr) - len) {
+			fprintf(stderr, "Expression too long\n");
+			return EXIT_FAIL_USAGE;
+		}
+		len += n;
+	}
+
+	const char *error = NULL;
+	if (filter_compile(expr, filter, &error) != 0) {
+		fprintf(stderr, "Invalid expression: %s\n", error);
+		return EXIT_FAIL_USAGE;
+	}
+
+	return EXIT_OK;
+}
+
+// Print the compiled form of an expression given as one or more arguments.
+static int filter_print(int argc, char *argv[])
+{
+	struct filter *filter = calloc(1, sizeof(*filter));
+	if (filter == NULL)
+		return EXIT_FAIL_USAGE;
+
+	int exitcode = filter_compile_args(argc, argv, filter);
+	if (exitcode == EXIT_OK)
+		print_filter(filter);
+
+	free(filter);
+	return exitcode;
+}
+
+int do_filter(const char *ifname, int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("filter").
+	if (argc < 2) {
+		filter_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Compiling does not require a running instance.
+	if (strcmp(argv[1], "compile") == 0)
+		return filter_print(argc - 2, &argv[2]);
+
+	// Open maps pinned by the running instance of the program.
+	struct filter_maps maps;
+	if (open_filter_maps(ifname, &maps) != 0) {
+		fprintf(stderr, "Could not open pinned filter maps (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	if (strcmp(argv[1], "load") == 0 && argc > 2) {
+		int exitcode = filter_load(&maps, argv[2]);
+		// Activate or deactivate the pipeline stage depending on the number of filters.
+		if (exitcode == EXIT_OK)
+			exitcode = pipeline_sync(ifname);
+		return exitcode;
+	} else if (strcmp(argv[1], "stats") == 0)
+		return filter_stats(&maps);
+
+	filter_usage("xdp-drop_and_count-user");
+	return EXIT_FAIL_USAGE;
+}
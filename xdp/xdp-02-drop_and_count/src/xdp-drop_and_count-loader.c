@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <net/if.h>
+#include <linux/if_link.h>
+
+#include <common_defines.h>
+#include <common_user_bpf_xdp.h>
+
+#include "xdp-drop_and_count-user.h"
+
+// Name of the XDP program in the BPF object file.
+#define XDP_PROG_NAME "xdp_prog_main"
+
+// Open the BPF object file and load it. If pin_dir is not NULL, the maps pinned
+// in pin_dir are reused, and maps not pinned yet are created and pinned by libbpf.
+static struct bpf_object *load_with_pinned_maps(const char *filename, const char *pin_dir)
+{
+	struct bpf_object *obj = bpf_object__open_file(filename, NULL);
+	if (libbpf_get_error(obj)) {
+		fprintf(stderr, "Could not open BPF object file %s\n", filename);
+		return NULL;
+	}
+
+	// The section names of the programs (xdp-drop/...) do not tell libbpf the type.
+	struct bpf_program *prog;
+	bpf_object__for_each_program(prog, obj)
+		bpf_program__set_type(prog, BPF_PROG_TYPE_XDP);
+
+	struct bpf_map *map;
+	bpf_object__for_each_map(map, obj) {
+		if (pin_dir == NULL)
+			break;
+
+		const char *name = bpf_map__name(map);
+		// Internal maps (.rodata, .bss, ...) belong to one version of the program.
+		if (strchr(name, '.') != NULL)
+			continue;
+
+		char path[PATH_MAX];
+		int n = snprintf(path, sizeof(path), "%s%s", pin_dir, name);
+		if (n < 0 || (size_t) n >= sizeof(path) || bpf_map__set_pin_path(map, path) != 0) {
+			fprintf(stderr, "Could not set pin path of map %s\n", name);
+			bpf_object__close(obj);
+			return NULL;
+		}
+	}
+
+	// Loading fails if the definition of a pinned map differs from the one in the
+	// object file. Such maps have to be removed with -U first (resetting their contents).
+	if (bpf_object__load(obj) != 0) {
+		fprintf(stderr, "Could not load BPF object file %s (pinned maps incompatible?)\n",
+			filename);
+		bpf_object__close(obj);
+		return NULL;
+	}
+
+	return obj;
+}
+
+// Attach prog_fd to the interface, atomically replacing the program of a running instance.
+static int attach_or_replace(int prog_fd, const struct config *cfg, const char *link_path)
+{
+	__u32 mode = cfg->xdp_flags & XDP_FLAGS_MODES;
+
+	int link_fd = bpf_obj_get(link_path);
+	if (link_fd >= 0) {
+		// The link keeps the program attached, so the interface never runs without
+		// a program while the new one replaces the old one.
+		int err = bpf_link_update(link_fd, prog_fd, NULL);
+		int saved_errno = errno;
+		close(link_fd);
+		if (err == 0)
+			return 0;
+		if (saved_errno != ENOLINK) {
+			errno = saved_errno;
+			return -1;
+		}
+
+		// The interface of the link has been removed, so the link is defunct.
+		unlink(link_path);
+	}
+
+	// A program attached without a link (e.g., by an instance started without -p)
+	// can be replaced atomically with XDP_FLAGS_REPLACE. The replacement fails if
+	// another program has been attached in the meantime.
+	__u32 old_prog_id = 0;
+	if (bpf_xdp_query_id(cfg->ifindex, mode, &old_prog_id) == 0 && old_prog_id != 0) {
+		int old_prog_fd = bpf_prog_get_fd_by_id(old_prog_id);
+		if (old_prog_fd < 0)
+			return -1;
+		LIBBPF_OPTS(bpf_xdp_attach_opts, opts, .old_prog_fd = old_prog_fd);
+		int err = bpf_xdp_attach(cfg->ifindex, prog_fd, mode | XDP_FLAGS_REPLACE, &opts);
+		close(old_prog_fd);
+		return err;
+	}
+
+	// First instance: attach through a new link and pin it, so the program stays
+	// attached after this process exits.
+	LIBBPF_OPTS(bpf_link_create_opts, opts, .flags = mode);
+	link_fd = bpf_link_create(prog_fd, cfg->ifindex, BPF_XDP, &opts);
+	if (link_fd < 0)
+		return -1;
+	// Closing the only file descriptor of an unpinned link detaches the program.
+	int err = bpf_obj_pin(link_fd, link_path);
+	close(link_fd);
+	return err;
+}
+
+// Pin the stage programs and fill the program array of the pipeline, so the
+// entry program finds all enabled stages as soon as it is attached.
+static struct bpf_program *prepare_pipeline(struct bpf_object *obj, const struct config *cfg)
+{
+	struct bpf_program *prog = bpf_object__find_program_by_name(obj, XDP_PROG_NAME);
+	if (prog == NULL) {
+		fprintf(stderr, "Could not find program %s\n", XDP_PROG_NAME);
+		return NULL;
+	}
+
+	if (pipeline_pin_programs(obj, cfg->ifname) != 0 || pipeline_sync(cfg->ifname) != EXIT_OK)
+		return NULL;
+
+	return prog;
+}
+
+struct bpf_object *load_bpf_and_xdp_attach_pinned(const struct config *cfg, const char *pin_dir)
+{
+	// The pins of a running instance must not be touched, so check before
+	// pinning rather than relying on the attach to fail.
+	__u32 prog_id = 0;
+	if (bpf_xdp_query_id(cfg->ifindex, cfg->xdp_flags & XDP_FLAGS_MODES, &prog_id) == 0 &&
+	    prog_id != 0) {
+		fprintf(stderr, "A program is already attached to %s\n", cfg->ifname);
+		return NULL;
+	}
+
+	struct bpf_object *obj = load_with_pinned_maps(cfg->filename, NULL);
+	if (obj == NULL)
+		return NULL;
+
+	// Remove stale pins of a previous instance first. The stage programs
+	// must be in the prog array before the entry program is attached.
+	bpf_object__unpin_maps(obj, pin_dir);
+	if (bpf_object__pin_maps(obj, pin_dir) != 0) {
+		fprintf(stderr, "Could not pin maps to %s\n", pin_dir);
+		goto err;
+	}
+
+	struct bpf_program *prog = prepare_pipeline(obj, cfg);
+	if (prog == NULL)
+		goto err_unpin;
+
+	if (bpf_xdp_attach(cfg->ifindex, bpf_program__fd(prog), cfg->xdp_flags, NULL) != 0) {
+		perror("Could not attach BPF program");
+		goto err_unpin;
+	}
+
+	return obj;
+
+err_unpin:
+	pipeline_unpin_programs(cfg->ifname);
+	bpf_object__unpin_maps(obj, pin_dir);
+err:
+	bpf_object__close(obj);
+	return NULL;
+}
+
+struct bpf_object *load_bpf_and_xdp_replace(const struct config *cfg, const char *pin_dir)
+{
+	struct bpf_object *obj = load_with_pinned_maps(cfg->filename, pin_dir);
+	if (obj == NULL)
+		return NULL;
+
+	// A running instance already tail-calls the new stage programs, so the new
+	// version must keep the layout of struct pipeline_scratch.
+	struct bpf_program *prog = prepare_pipeline(obj, cfg);
+	if (prog == NULL)
+		goto err;
+
+	char link_path[PATH_MAX];
+	int n = snprintf(link_path, sizeof(link_path), "%s%s", pin_dir, XDP_LINK_PIN_NAME);
+	if (n < 0 || (size_t) n >= sizeof(link_path))
+		goto err;
+
+	if (attach_or_replace(bpf_program__fd(prog), cfg, link_path) != 0) {
+		perror("Could not attach BPF program");
+		goto err;
+	}
+
+	return obj;
+
+err:
+	bpf_object__close(obj);
+	return NULL;
+}
+
+void xdp_detach_instance(const struct config *cfg, struct bpf_object *obj, const char *pin_dir)
+{
+	struct bpf_program *prog = bpf_object__find_program_by_name(obj, XDP_PROG_NAME);
+	struct bpf_prog_info info = {};
+	__u32 info_len = sizeof(info);
+	if (prog == NULL || bpf_obj_get_info_by_fd(bpf_program__fd(prog), &info, &info_len) != 0)
+		return;
+
+	// A persistent instance (-p) might have replaced our program. It reuses
+	// the pinned maps and stage programs, so they are only removed if our
+	// program was still attached. Detaching with the expected id fails if
+	// the program is replaced just now.
+	if (xdp_link_detach(cfg->ifindex, cfg->xdp_flags, info.id) != 0) {
+		fprintf(stderr, "The program on %s has been replaced, leaving it attached\n",
+			cfg->ifname);
+		return;
+	}
+	bpf_object__unpin_maps(obj, pin_dir);
+	pipeline_unpin_programs(cfg->ifname);
+}
+
+int xdp_unload_persistent(const struct config *cfg, const char *pin_dir)
+{
+	char path[PATH_MAX];
+	int n = snprintf(path, sizeof(path), "%s%s", pin_dir, XDP_LINK_PIN_NAME);
+	if (n < 0 || (size_t) n >= sizeof(path))
+		return EXIT_FAIL_PIN;
+
+	// Removing the pin of the link detaches the program, unless it was attached
+	// without a link.
+	if (unlink(path) != 0) {
+		__u32 prog_id = 0;
+		if (bpf_xdp_query_id(cfg->ifindex, cfg->xdp_flags & XDP_FLAGS_MODES, &prog_id) == 0 &&
+		    prog_id != 0)
+			xdp_link_detach(cfg->ifindex, cfg->xdp_flags, prog_id);
+	}
+
+	// Remove the pinned maps and stage programs, which deletes the maps together
+	// with their contents.
+	DIR *dir = opendir(pin_dir);
+	if (dir == NULL) {
+		perror("Could not open pin directory");
+		return EXIT_FAIL_PIN;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		n = snprintf(path, sizeof(path), "%s%s", pin_dir, entry->d_name);
+		if (n > 0 && (size_t) n < sizeof(path))
+			unlink(path);
+	}
+	closedir(dir);
+	rmdir(pin_dir);
+
+	return EXIT_OK;
+}
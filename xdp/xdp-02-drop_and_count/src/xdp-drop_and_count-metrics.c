@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Maximum size of an HTTP request we read. Everything after the request line is ignored.
+#define METRICS_REQUEST_SIZE 1024
+
+// Number of pending connections.
+#define METRICS_BACKLOG 16
+
+// Memory-mapped counters of one interface.
+struct metrics_source {
+	const char *ifname;
+	const struct cpu_counters *counters; // NULL if the counters are not pinned
+	uint32_t map_id; // id of the mapped counters map
+};
+
+// Prometheus metric name and help text for each global counter.
+static const struct {
+	const char *name;
+	const char *help;
+} counter_metrics[COUNTER_DROPPED_BY_REASON] = {
+	[COUNTER_RX_PACKETS] = { "xdp_rx_packets_total", "Packets processed by the XDP program." },
+	[COUNTER_RX_BYTES] = { "xdp_rx_bytes_total", "Bytes processed by the XDP program." },
+	[COUNTER_PASSED_PACKETS] = { "xdp_passed_packets_total", "Packets passed to the network stack." },
+	[COUNTER_PASSED_BYTES] = { "xdp_passed_bytes_total", "Bytes passed to the network stack." },
+	[COUNTER_DROPPED_PACKETS] = { "xdp_dropped_packets_total", "Packets dropped." },
+	[COUNTER_DROPPED_BYTES] = { "xdp_dropped_bytes_total", "Bytes dropped." },
+	[COUNTER_EVENTS_LOST] = { "xdp_drop_events_lost_total", "Drop events lost due to a full ring buffer." },
+	[COUNTER_CAPTURE_LOST] = { "xdp_capture_lost_total", "Captured packets lost due to a full ring buffer." },
+};
+
+static volatile sig_atomic_t metrics_exit = 0;
+
+static void metrics_sigint_handler(int signal)
+{
+	metrics_exit = 1;
+}
+
+static void metrics_usage(const char *prog)
+{
+	fprintf(stderr, "%s metrics [ADDR:]PORT|SOCKET_PATH DEVICE...\n"
+		"  Serve the counters of the given devices in Prometheus text format via HTTP\n"
+		"  on a TCP port (default address 127.0.0.1) or a Unix socket (path containing '/').\n",
+		prog);
+}
+
+// Map the counters currently pinned for the interface of source. A program
+// loaded without persistent mode creates a new counters map whenever it is
+// restarted, so the map is compared by id, and mapped again if it changed.
+// If no counters are pinned, the source has no counters.
+// Returns 0 on success.
+static int refresh_source(struct metrics_source *source)
+{
+	struct bpf_map_info info = {};
+	uint32_t info_len = sizeof(info);
+
+	int map_fd = open_pinned_map(source->ifname, "xdp_counters_map");
+	if (map_fd < 0 || bpf_obj_get_info_by_fd(map_fd, &info, &info_len) != 0) {
+		if (map_fd >= 0)
+			close(map_fd);
+		if (source->counters != NULL)
+			munmap_counters(source->counters);
+		source->counters = NULL;
+		return -1;
+	}
+
+	if (source->counters == NULL || info.id != source->map_id) {
+		if (source->counters != NULL)
+			munmap_counters(source->counters);
+		source->counters = mmap_counters(map_fd);
+		source->map_id = info.id;
+	}
+	// The mapping keeps the map alive, so the file descriptor is not needed anymore.
+	close(map_fd);
+
+	return source->counters != NULL ? 0 : -1;
+}
+
+// Render the counters of all sources in Prometheus text exposition format.
+// Sources without counters are left out.
+static void render_metrics(FILE *out, const struct metrics_source *sources, int nsources,
+			   int ncpus)
+{
+	uint64_t sums[nsources][COUNTER_MAX];
+
+	// Take a snapshot of all counters first, so all metrics of a scrape are
+	// read at almost the same time.
+	for (int s = 0; s < nsources; s++) {
+		if (sources[s].counters != NULL)
+			sum_counters(sources[s].counters, ncpus, sums[s]);
+	}
+
+	for (int c = 0; c < COUNTER_DROPPED_BY_REASON; c++) {
+		fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", counter_metrics[c].name,
+			counter_metrics[c].help, counter_metrics[c].name);
+		for (int s = 0; s < nsources; s++) {
+			if (sources[s].counters != NULL)
+				fprintf(out, "%s{interface=\"%s\"} %lu\n", counter_metrics[c].name,
+					sources[s].ifname, sums[s][c]);
+		}
+	}
+
+	fprintf(out, "# HELP xdp_dropped_packets_by_reason_total Packets dropped per drop reason.\n"
+		"# TYPE xdp_dropped_packets_by_reason_total counter\n");
+	for (int s = 0; s < nsources; s++) {
+		if (sources[s].counters == NULL)
+			continue;
+		for (int reason = DROP_REASON_NONE + 1; reason < DROP_REASON_MAX; reason++)
+			fprintf(out, "xdp_dropped_packets_by_reason_total{interface=\"%s\",reason=\"%s\"} %lu\n",
+				sources[s].ifname, drop_reason_str(reason),
+				sums[s][COUNTER_DROPPED_BY_REASON + reason - 1]);
+	}
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		// MSG_NOSIGNAL: no SIGPIPE if the client closed the connection.
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void serve_client(int client_fd, struct metrics_source *sources, int nsources,
+			 int ncpus)
+{
+	char request[METRICS_REQUEST_SIZE];
+
+	// Do not let a slow client block the server for long.
+	struct timeval timeout = { .tv_sec = 1 };
+	setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	ssize_t n = recv(client_fd, request, sizeof(request) - 1, 0);
+	if (n <= 0)
+		return;
+	request[n] = '\0';
+
+	const char *status = "200 OK";
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *out = open_memstream(&body, &body_len);
+	if (out == NULL)
+		return;
+
+	if (strncmp(request, "GET / ", 6) == 0 || strncmp(request, "GET /metrics ", 13) == 0) {
+		for (int s = 0; s < nsources; s++)
+			refresh_source(&sources[s]);
+		render_metrics(out, sources, nsources, ncpus);
+	} else {
+		status = "404 Not Found";
+		fprintf(out, "Not found\n");
+	}
+	fclose(out);
+
+	char header[256];
+	int header_len = snprintf(header, sizeof(header),
+				  "HTTP/1.0 %s\r\n"
+				  "Content-Type: text/plain; version=0.0.4\r\n"
+				  "Content-Length: %zu\r\n"
+				  "Connection: close\r\n"
+				  "\r\n", status, body_len);
+
+	if (send_all(client_fd, header, header_len) == 0)
+		send_all(client_fd, body, body_len);
+
+	free(body);
+}
+
+static int open_listen_socket(const char *listen_addr)
+{
+	int fd;
+
+	if (strchr(listen_addr, '/') != NULL) {
+		// Unix socket
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if (strlen(listen_addr) >= sizeof(addr.sun_path))
+			return -1;
+		strcpy(addr.sun_path, listen_addr);
+		unlink(listen_addr); // remove stale socket of a previous instance
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+			goto err;
+	} else {
+		// TCP socket
+		struct sockaddr_in addr = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		char host[INET_ADDRSTRLEN];
+		const char *port = strrchr(listen_addr, ':');
+		if (port != NULL) {
+			size_t len = port - listen_addr;
+			if (len >= sizeof(host))
+				return -1;
+			memcpy(host, listen_addr, len);
+			host[len] = '\0';
+			if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+				return -1;
+			port++;
+		} else {
+			port = listen_addr;
+		}
+		addr.sin_port = htons(atoi(port));
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -1;
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+			goto err;
+	}
+
+	if (listen(fd, METRICS_BACKLOG) != 0)
+		goto err;
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+int do_metrics(int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("metrics").
+	if (argc < 3) {
+		metrics_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	const char *listen_addr = argv[1];
+	int nsources = argc - 2;
+	struct metrics_source sources[nsources];
+	int ncpus = num_counter_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_FINDELEM;
+
+	// Map the counters of all interfaces. Scrapes read the counters from
+	// memory, and only check by the map id whether the pinned map changed.
+	for (int s = 0; s < nsources; s++) {
+		sources[s].ifname = argv[2 + s];
+		sources[s].counters = NULL;
+		if (refresh_source(&sources[s]) != 0) {
+			fprintf(stderr, "Could not map pinned counters of %s (is the BPF program loaded?)\n",
+				sources[s].ifname);
+			return EXIT_FAIL_FINDMAP;
+		}
+	}
+
+	int listen_fd = open_listen_socket(listen_addr);
+	if (listen_fd < 0) {
+		perror("Could not open listen socket");
+		return EXIT_FAIL_USAGE;
+	}
+
+	if (signal(SIGINT, metrics_sigint_handler) == SIG_ERR ||
+	    signal(SIGTERM, metrics_sigint_handler) == SIG_ERR) {
+		perror("Could not attach signal handler");
+		close(listen_fd);
+		return EXIT_FAILSIGNAL;
+	}
+
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	while (!metrics_exit) {
+		// Poll is interrupted by signals, so we can check metrics_exit.
+		if (poll(&pfd, 1, -1) <= 0)
+			continue;
+
+		int client_fd = accept(listen_fd, NULL, NULL);
+		if (client_fd < 0)
+			continue;
+		serve_client(client_fd, sources, nsources, ncpus);
+		close(client_fd);
+	}
+
+	close(listen_fd);
+	if (strchr(listen_addr, '/') != NULL)
+		unlink(listen_addr);
+	for (int s = 0; s < nsources; s++) {
+		if (sources[s].counters != NULL)
+			munmap_counters(sources[s].counters);
+	}
+
+	return EXIT_OK;
+}
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <linux/bpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Blocks are collected in a buffer of this size and written with a single
+// system call, so writing does not slow down the consumer of the ring buffer.
+#define PCAPNG_BUFFER_SIZE (4 << 20)
+
+// Block types and options of the pcapng format (draft-ietf-opsawg-pcapng).
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a // section header block
+#define PCAPNG_BLOCK_IDB 0x00000001 // interface description block
+#define PCAPNG_BLOCK_ISB 0x00000005 // interface statistics block
+#define PCAPNG_BLOCK_EPB 0x00000006 // enhanced packet block
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_LINKTYPE_ETHERNET 1
+
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_SHB_USERAPPL 4
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_EPB_QUEUE 6
+#define PCAPNG_EPB_VERDICT 7
+#define PCAPNG_ISB_STARTTIME 2
+#define PCAPNG_ISB_ENDTIME 3
+#define PCAPNG_ISB_FILTERACCEPT 6
+#define PCAPNG_ISB_OSDROP 7
+
+#define PCAPNG_EPB_FLAGS_INBOUND 0x1
+#define PCAPNG_VERDICT_XDP 2 // verdict type: Linux eBPF XDP, followed by the XDP action
+
+// if_tsresol: timestamps are in units of 10^-9 seconds.
+#define PCAPNG_TSRESOL_NSEC 9
+
+// Fields and options are padded to 32 bits.
+#define PAD4(len) (((len) + 3) & ~(size_t) 3)
+#define OPTION_SIZE(len) (4 + PAD4(len))
+
+struct pcapng_writer {
+	int fd;
+	uint8_t *buf;
+	size_t len; // number of buffered bytes
+	uint64_t tai_offset; // offset of the TAI clock to UTC in nano-seconds
+	uint64_t t_start; // time the file was opened in nano-seconds (UTC)
+};
+
+// Offset of the TAI clock to UTC (number of leap seconds). Both clocks are read
+// at slightly different times, so the difference is rounded to whole seconds.
+static uint64_t tai_utc_offset(void)
+{
+	struct timespec tai, utc;
+
+	clock_gettime(CLOCK_TAI, &tai);
+	clock_gettime(CLOCK_REALTIME, &utc);
+	int64_t diff = (tai.tv_sec - utc.tv_sec)*1000000000LL + (tai.tv_nsec - utc.tv_nsec);
+	if (diff < 0)
+		return 0; // TAI offset of the kernel not set
+	return (diff + 500000000LL)/1000000000LL*1000000000ULL;
+}
+
+static uint64_t now_utc(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t value)
+{
+	memcpy(p, &value, sizeof(value));
+	return p + sizeof(value);
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t value)
+{
+	memcpy(p, &value, sizeof(value));
+	return p + sizeof(value);
+}
+
+// Timestamps are stored as upper and lower 32 bits, each in the byte order of the section.
+static uint8_t *put_timestamp(uint8_t *p, uint64_t timestamp)
+{
+	p = put_u32(p, timestamp >> 32);
+	return put_u32(p, timestamp & 0xffffffff);
+}
+
+// Copy len bytes and pad them with zeros to 32 bits.
+static uint8_t *put_bytes(uint8_t *p, const void *data, size_t len)
+{
+	if (len > 0)
+		memcpy(p, data, len);
+	memset(p + len, 0, PAD4(len) - len);
+	return p + PAD4(len);
+}
+
+static uint8_t *put_option(uint8_t *p, uint16_t code, const void *value, uint16_t len)
+{
+	p = put_u16(p, code);
+	p = put_u16(p, len);
+	return put_bytes(p, value, len);
+}
+
+int pcapng_flush(struct pcapng_writer *writer)
+{
+	size_t done = 0;
+
+	while (done < writer->len) {
+		ssize_t n = write(writer->fd, writer->buf + done, writer->len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Could not write capture file");
+			return -1;
+		}
+		done += n;
+	}
+
+	writer->len = 0;
+	return 0;
+}
+
+// Returns a pointer to size bytes in the buffer, flushing it if required, or
+// NULL on error. The block is appended by commit_block().
+static uint8_t *reserve_block(struct pcapng_writer *writer, size_t size)
+{
+	if (size > PCAPNG_BUFFER_SIZE)
+		return NULL;
+	if (writer->len + size > PCAPNG_BUFFER_SIZE && pcapng_flush(writer) != 0)
+		return NULL;
+	return writer->buf + writer->len;
+}
+
+// Append the trailing length field of a block reserved by reserve_block().
+static void commit_block(struct pcapng_writer *writer, uint8_t *p, uint32_t size)
+{
+	put_u32(p, size);
+	writer->len += size;
+}
+
+static int write_section_header(struct pcapng_writer *writer)
+{
+	static const char userappl[] = "xdp-drop_and_count";
+	uint32_t size = 28 + OPTION_SIZE(strlen(userappl)) + OPTION_SIZE(0);
+
+	uint8_t *p = reserve_block(writer, size);
+	if (p == NULL)
+		return -1;
+	p = put_u32(p, PCAPNG_BLOCK_SHB);
+	p = put_u32(p, size);
+	p = put_u32(p, PCAPNG_BYTE_ORDER_MAGIC);
+	p = put_u16(p, 1); // major version
+	p = put_u16(p, 0); // minor version
+	p = put_timestamp(p, ~0ULL); // section length unknown
+	p = put_option(p, PCAPNG_SHB_USERAPPL, userappl, strlen(userappl));
+	p = put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+	commit_block(writer, p, size);
+
+	return 0;
+}
+
+static int write_interface(struct pcapng_writer *writer, const char *ifname, uint32_t snaplen)
+{
+	uint8_t tsresol = PCAPNG_TSRESOL_NSEC;
+	uint32_t size = 20 + OPTION_SIZE(strlen(ifname)) + OPTION_SIZE(sizeof(tsresol)) +
+		OPTION_SIZE(0);
+
+	uint8_t *p = reserve_block(writer, size);
+	if (p == NULL)
+		return -1;
+	p = put_u32(p, PCAPNG_BLOCK_IDB);
+	p = put_u32(p, size);
+	p = put_u16(p, PCAPNG_LINKTYPE_ETHERNET);
+	p = put_u16(p, 0); // reserved
+	p = put_u32(p, snaplen);
+	p = put_option(p, PCAPNG_IF_NAME, ifname, strlen(ifname));
+	p = put_option(p, PCAPNG_IF_TSRESOL, &tsresol, sizeof(tsresol));
+	p = put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+	commit_block(writer, p, size);
+
+	return 0;
+}
+
+struct pcapng_writer *pcapng_open(const char *filename, const char *ifname, uint32_t snaplen)
+{
+	struct pcapng_writer *writer = calloc(1, sizeof(*writer));
+	if (writer == NULL)
+		return NULL;
+
+	writer->buf = malloc(PCAPNG_BUFFER_SIZE);
+	if (writer->buf == NULL) {
+		free(writer);
+		return NULL;
+	}
+
+	if (strcmp(filename, "-") == 0)
+		writer->fd = STDOUT_FILENO;
+	else
+		writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (writer->fd < 0) {
+		perror("Could not create capture file");
+		free(writer->buf);
+		free(writer);
+		return NULL;
+	}
+
+	writer->tai_offset = tai_utc_offset();
+	writer->t_start = now_utc();
+
+	if (write_section_header(writer) != 0 || write_interface(writer, ifname, snaplen) != 0 ||
+	    pcapng_flush(writer) != 0) {
+		if (writer->fd != STDOUT_FILENO)
+			close(writer->fd);
+		free(writer->buf);
+		free(writer);
+		return NULL;
+	}
+
+	return writer;
+}
+
+int pcapng_write_packet(struct pcapng_writer *writer, uint64_t timestamp, const void *data,
+			uint32_t cap_len, uint32_t pkt_len, uint32_t rx_queue, unsigned int reason)
+{
+	uint32_t flags = PCAPNG_EPB_FLAGS_INBOUND;
+	uint8_t verdict[9] = { PCAPNG_VERDICT_XDP };
+	uint64_t action = reason != DROP_REASON_NONE ? XDP_DROP : XDP_PASS;
+	memcpy(&verdict[1], &action, sizeof(action));
+
+	// The drop reason is stored as packet comment.
+	char comment[64];
+	int comment_len = 0;
+	if (reason != DROP_REASON_NONE)
+		comment_len = snprintf(comment, sizeof(comment), "drop reason: %s", drop_reason_str(reason));
+	if (comment_len < 0 || (size_t) comment_len >= sizeof(comment))
+		comment_len = 0;
+
+	uint32_t size = 32 + PAD4(cap_len) + OPTION_SIZE(sizeof(flags)) +
+		OPTION_SIZE(sizeof(rx_queue)) + OPTION_SIZE(sizeof(verdict)) +
+		(comment_len > 0 ? OPTION_SIZE(comment_len) : 0) + OPTION_SIZE(0);
+
+	uint8_t *p = reserve_block(writer, size);
+	if (p == NULL)
+		return -1;
+	p = put_u32(p, PCAPNG_BLOCK_EPB);
+	p = put_u32(p, size);
+	p = put_u32(p, 0); // interface ID
+	p = put_timestamp(p, timestamp - writer->tai_offset);
+	p = put_u32(p, cap_len);
+	p = put_u32(p, pkt_len);
+	p = put_bytes(p, data, cap_len);
+	p = put_option(p, PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+	p = put_option(p, PCAPNG_EPB_QUEUE, &rx_queue, sizeof(rx_queue));
+	p = put_option(p, PCAPNG_EPB_VERDICT, verdict, sizeof(verdict));
+	if (comment_len > 0)
+		p = put_option(p, PCAPNG_OPT_COMMENT, comment, comment_len);
+	p = put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+	commit_block(writer, p, size);
+
+	return 0;
+}
+
+int pcapng_close(struct pcapng_writer *writer, uint64_t accepted, uint64_t lost)
+{
+	uint64_t t_end = now_utc();
+	uint32_t size = 24 + 4*OPTION_SIZE(sizeof(uint64_t)) + OPTION_SIZE(0);
+	uint32_t time_words[2];
+	int ret = -1;
+
+	uint8_t *p = reserve_block(writer, size);
+	if (p != NULL) {
+		p = put_u32(p, PCAPNG_BLOCK_ISB);
+		p = put_u32(p, size);
+		p = put_u32(p, 0); // interface ID
+		p = put_timestamp(p, t_end);
+		put_timestamp((uint8_t *) time_words, writer->t_start);
+		p = put_option(p, PCAPNG_ISB_STARTTIME, time_words, sizeof(time_words));
+		put_timestamp((uint8_t *) time_words, t_end);
+		p = put_option(p, PCAPNG_ISB_ENDTIME, time_words, sizeof(time_words));
+		p = put_option(p, PCAPNG_ISB_FILTERACCEPT, &accepted, sizeof(accepted));
+		p = put_option(p, PCAPNG_ISB_OSDROP, &lost, sizeof(lost));
+		p = put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+		commit_block(writer, p, size);
+		ret = pcapng_flush(writer);
+	}
+
+	if (writer->fd != STDOUT_FILENO && close(writer->fd) != 0) {
+		perror("Could not close capture file");
+		ret = -1;
+	}
+	free(writer->buf);
+	free(writer);
+	return ret;
+}
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Names of the stages as used on the command line (index is enum pipeline_stage).
+static const char *const stage_names[PIPELINE_MAX_STAGES] = {
+	[PIPELINE_STAGE_BLOCKLIST] = "blocklist",
+	[PIPELINE_STAGE_PARSE] = "parse",
+	[PIPELINE_STAGE_SKETCH] = "sketch",
+	[PIPELINE_STAGE_PSFP] = "psfp",
+	[PIPELINE_STAGE_ACL] = "acl",
+	[PIPELINE_STAGE_FILTER] = "filter",
+	[PIPELINE_STAGE_CAPTURE] = "capture",
+	[PIPELINE_STAGE_ACTION] = "action",
+};
+
+// Names of the stage programs in the BPF object file.
+static const char *const stage_progs[PIPELINE_MAX_STAGES] = {
+	[PIPELINE_STAGE_BLOCKLIST] = "xdp_stage_blocklist",
+	[PIPELINE_STAGE_PARSE] = "xdp_stage_parse",
+	[PIPELINE_STAGE_SKETCH] = "xdp_stage_sketch",
+	[PIPELINE_STAGE_PSFP] = "xdp_stage_psfp",
+	[PIPELINE_STAGE_ACL] = "xdp_stage_acl",
+	[PIPELINE_STAGE_FILTER] = "xdp_stage_filter",
+	[PIPELINE_STAGE_CAPTURE] = "xdp_stage_capture",
+	[PIPELINE_STAGE_ACTION] = "xdp_stage_action",
+};
+
+static void pipeline_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE pipeline show\n"
+		"%s -d DEVICE pipeline enable|disable blocklist|sketch|psfp|acl|filter|capture\n"
+		"  Stages psfp, acl, and filter are only active while rules are loaded, sketch while\n"
+		"  it is switched on (cf. subcommand sketch), capture while a capture is running.\n"
+		"  The parse stage is active if sketch, psfp, acl, or filter is, the action stage\n"
+		"  is always active.\n",
+		prog, prog);
+}
+
+// Returns true if the stage should be in the program array for the given configuration.
+static bool stage_active(const struct drop_config *cfg, int stage)
+{
+	bool enabled = !(cfg->disabled_stages & (1U << stage));
+
+	switch (stage) {
+	case PIPELINE_STAGE_BLOCKLIST:
+		return enabled;
+	case PIPELINE_STAGE_PARSE:
+		return stage_active(cfg, PIPELINE_STAGE_SKETCH) ||
+			stage_active(cfg, PIPELINE_STAGE_PSFP) || stage_active(cfg, PIPELINE_STAGE_ACL) ||
+			stage_active(cfg, PIPELINE_STAGE_FILTER);
+	case PIPELINE_STAGE_SKETCH:
+		return enabled && cfg->sketch_enabled;
+	case PIPELINE_STAGE_PSFP:
+		return enabled && cfg->psfp_enabled;
+	case PIPELINE_STAGE_ACL:
+		return enabled && cfg->acl_enabled;
+	case PIPELINE_STAGE_FILTER:
+		return enabled && cfg->filter_enabled;
+	case PIPELINE_STAGE_CAPTURE:
+		// Parses packets on demand, so it does not require the parse stage.
+		return enabled && cfg->capture_enabled;
+	case PIPELINE_STAGE_ACTION:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int pipeline_pin_programs(struct bpf_object *obj, const char *ifname)
+{
+	char path[PATH_MAX];
+
+	for (int stage = 0; stage < PIPELINE_MAX_STAGES; stage++) {
+		struct bpf_program *prog = bpf_object__find_program_by_name(obj, stage_progs[stage]);
+		if (prog == NULL) {
+			fprintf(stderr, "Could not find program %s\n", stage_progs[stage]);
+			return -1;
+		}
+
+		// Replace the pin of a previous instance or version of the program.
+		if (pin_path(path, sizeof(path), ifname, stage_progs[stage]) != 0)
+			return -1;
+		unlink(path);
+		if (bpf_obj_pin(bpf_program__fd(prog), path) != 0) {
+			perror("Could not pin stage program");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void pipeline_unpin_programs(const char *ifname)
+{
+	char path[PATH_MAX];
+
+	for (int stage = 0; stage < PIPELINE_MAX_STAGES; stage++) {
+		if (pin_path(path, sizeof(path), ifname, stage_progs[stage]) == 0)
+			unlink(path);
+	}
+}
+
+int pipeline_sync(const char *ifname)
+{
+	char path[PATH_MAX];
+	struct drop_config cfg;
+	__u32 config_key = 0;
+	int exitcode = EXIT_OK;
+
+	int config_fd = open_pinned_map(ifname, "xdp_config_map");
+	int pipeline_fd = open_pinned_map(ifname, "xdp_pipeline_map");
+	if (config_fd < 0 || pipeline_fd < 0) {
+		fprintf(stderr, "Could not open pinned pipeline maps (is the BPF program loaded?)\n");
+		exitcode = EXIT_FAIL_FINDMAP;
+		goto out;
+	}
+	if (bpf_map_lookup_elem(config_fd, &config_key, &cfg) != 0) {
+		perror("Could not read configuration");
+		exitcode = EXIT_FAIL_FINDELEM;
+		goto out;
+	}
+
+	// Update from the last stage to the first, so the action stage is present
+	// before any classification stage can jump to it.
+	for (int stage = PIPELINE_MAX_STAGES - 1; stage >= 0; stage--) {
+		__u32 index = stage;
+
+		if (!stage_active(&cfg, stage)) {
+			if (bpf_map_delete_elem(pipeline_fd, &index) != 0 && errno != ENOENT) {
+				perror("Could not disable pipeline stage");
+				exitcode = EXIT_FAIL_UPDATE;
+				goto out;
+			}
+			continue;
+		}
+
+		if (pin_path(path, sizeof(path), ifname, stage_progs[stage]) != 0) {
+			exitcode = EXIT_FAIL_PIN;
+			goto out;
+		}
+		int prog_fd = bpf_obj_get(path);
+		if (prog_fd < 0 ||
+		    bpf_map_update_elem(pipeline_fd, &index, &prog_fd, BPF_ANY) != 0) {
+			perror("Could not enable pipeline stage");
+			if (prog_fd >= 0)
+				close(prog_fd);
+			exitcode = EXIT_FAIL_UPDATE;
+			goto out;
+		}
+		close(prog_fd);
+	}
+
+out:
+	if (config_fd >= 0)
+		close(config_fd);
+	if (pipeline_fd >= 0)
+		close(pipeline_fd);
+	return exitcode;
+}
+
+static int pipeline_show(const char *ifname)
+{
+	int config_fd = open_pinned_map(ifname, "xdp_config_map");
+	int pipeline_fd = open_pinned_map(ifname, "xdp_pipeline_map");
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (config_fd < 0 || pipeline_fd < 0 ||
+	    bpf_map_lookup_elem(config_fd, &config_key, &cfg) != 0) {
+		fprintf(stderr, "Could not read pipeline configuration (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	for (int stage = 0; stage < PIPELINE_MAX_STAGES; stage++) {
+		__u32 index = stage;
+		__u32 prog_id;
+
+		// Looking up a program array entry returns the ID of the program.
+		bool active = (bpf_map_lookup_elem(pipeline_fd, &index, &prog_id) == 0);
+		printf("%-10s %s%s\n", stage_names[stage], active ? "active" : "inactive",
+		       (cfg.disabled_stages & (1U << stage)) ? " (disabled)" : "");
+	}
+
+	close(config_fd);
+	close(pipeline_fd);
+	return EXIT_OK;
+}
+
+static int pipeline_set_enabled(const char *ifname, const char *name, bool enable)
+{
+	int stage;
+
+	// Only stages without dependants can be disabled by the user.
+	if (strcmp(name, "blocklist") == 0)
+		stage = PIPELINE_STAGE_BLOCKLIST;
+	else if (strcmp(name, "sketch") == 0)
+		stage = PIPELINE_STAGE_SKETCH;
+	else if (strcmp(name, "psfp") == 0)
+		stage = PIPELINE_STAGE_PSFP;
+	else if (strcmp(name, "acl") == 0)
+		stage = PIPELINE_STAGE_ACL;
+	else if (strcmp(name, "filter") == 0)
+		stage = PIPELINE_STAGE_FILTER;
+	else if (strcmp(name, "capture") == 0)
+		stage = PIPELINE_STAGE_CAPTURE;
+	else
+		return EXIT_FAIL_USAGE;
+
+	int config_fd = open_pinned_map(ifname, "xdp_config_map");
+	struct drop_config cfg;
+	__u32 config_key = 0;
+	if (config_fd < 0 || bpf_map_lookup_elem(config_fd, &config_key, &cfg) != 0) {
+		fprintf(stderr, "Could not read configuration (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	if (enable)
+		cfg.disabled_stages &= ~(1U << stage);
+	else
+		cfg.disabled_stages |= (1U << stage);
+	int err = bpf_map_update_elem(config_fd, &config_key, &cfg, BPF_ANY);
+	close(config_fd);
+	if (err != 0) {
+		perror("Could not write configuration");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return pipeline_sync(ifname);
+}
+
+int do_pipeline(const char *ifname, int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("pipeline").
+	if (argc == 2 && strcmp(argv[1], "show") == 0)
+		return pipeline_show(ifname);
+
+	if (argc == 3 && (strcmp(argv[1], "enable") == 0 || strcmp(argv[1], "disable") == 0)) {
+		int exitcode = pipeline_set_enabled(ifname, argv[2], argv[1][0] == 'e');
+		if (exitcode != EXIT_FAIL_USAGE)
+			return exitcode;
+	}
+
+	pipeline_usage("xdp-drop_and_count-user");
+	return EXIT_FAIL_USAGE;
+}
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// The PSFP maps pinned by the running instance of the program.
+struct psfp_maps {
+	int config_fd;
+	int stream_fd;
+	int gate_fd;
+	int meter_fd;
+	int meter_state_fd;
+	int stats_fd;
+};
+
+// PSFP configuration as read from the configuration file.
+struct psfp_spec {
+	struct psfp_gate gates[PSFP_MAX_GATES];
+	bool gate_defined[PSFP_MAX_GATES];
+	struct psfp_meter meters[PSFP_MAX_METERS];
+	bool meter_defined[PSFP_MAX_METERS];
+	struct psfp_stream_key stream_keys[PSFP_MAX_STREAMS];
+	struct psfp_stream streams[PSFP_MAX_STREAMS];
+	size_t nstreams;
+};
+
+static void psfp_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE psfp load FILE\n"
+		"%s -d DEVICE psfp stats\n"
+		"  FILE contains one gate, meter, or stream per line:\n"
+		"  gate ID [base NS] [cycle NS] open|closed NS [open|closed NS]...\n"
+		"  meter ID cir RATE cbs BYTES [eir RATE ebs BYTES] [coupling] [drop-yellow]\n"
+		"  stream MAC VID PCP|any [gate ID] [meter ID] [max-sdu BYTES]\n"
+		"  Times are given in nano-seconds of the TAI clock, rates in bit/s (suffixes k, M, G).\n"
+		"  Untagged frames have VID 0 and PCP 0. Lines starting with # are ignored.\n",
+		prog, prog);
+}
+
+// Parse an unsigned number. Returns 0 on success.
+static int parse_u64(const char *str, uint64_t *value)
+{
+	char *end;
+
+	if (str == NULL || *str == '\0' || *str == '-')
+		return -1;
+	*value = strtoull(str, &end, 0);
+	return *end == '\0' ? 0 : -1;
+}
+
+// Parse a rate in bit/s with optional suffix k, M, or G, and convert it to byte/s.
+static int parse_rate(const char *str, uint64_t *bytes_per_sec)
+{
+	char *end;
+
+	if (str == NULL || *str == '\0' || *str == '-')
+		return -1;
+	uint64_t rate = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'k': rate *= 1000ULL; end++; break;
+	case 'M': rate *= 1000000ULL; end++; break;
+	case 'G': rate *= 1000000000ULL; end++; break;
+	}
+	if (*end != '\0')
+		return -1;
+
+	*bytes_per_sec = rate/8;
+	return 0;
+}
+
+// Parse a gate or meter ID, or "none".
+static int parse_id(const char *str, uint32_t max, uint32_t *id)
+{
+	uint64_t value;
+
+	if (str != NULL && strcmp(str, "none") == 0) {
+		*id = PSFP_NONE;
+		return 0;
+	}
+	if (parse_u64(str, &value) != 0 || value >= max)
+		return -1;
+
+	*id = value;
+	return 0;
+}
+
+static int parse_gate(struct psfp_spec *spec)
+{
+	uint32_t id;
+	uint64_t value;
+
+	if (parse_id(strtok(NULL, " \t\r\n"), PSFP_MAX_GATES, &id) != 0 || id == PSFP_NONE)
+		return -1;
+
+	struct psfp_gate *gate = &spec->gates[id];
+	memset(gate, 0, sizeof(*gate));
+	uint64_t total = 0;
+
+	char *tok;
+	while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+		if (parse_u64(strtok(NULL, " \t\r\n"), &value) != 0)
+			return -1;
+
+		if (strcmp(tok, "base") == 0) {
+			gate->base_time = value;
+		} else if (strcmp(tok, "cycle") == 0) {
+			gate->cycle_time = value;
+		} else if (strcmp(tok, "open") == 0 || strcmp(tok, "closed") == 0) {
+			if (gate->num_entries == PSFP_MAX_GATE_ENTRIES)
+				return -1;
+			gate->entries[gate->num_entries].open = (tok[0] == 'o');
+			gate->entries[gate->num_entries].interval = value;
+			gate->num_entries++;
+			total += value;
+		} else {
+			return -1;
+		}
+	}
+
+	// Without a cycle time, the cycle consists of the listed intervals.
+	if (gate->cycle_time == 0)
+		gate->cycle_time = total;
+	if (gate->num_entries == 0)
+		return -1;
+
+	spec->gate_defined[id] = true;
+	return 0;
+}
+
+static int parse_meter(struct psfp_spec *spec)
+{
+	uint32_t id;
+
+	if (parse_id(strtok(NULL, " \t\r\n"), PSFP_MAX_METERS, &id) != 0 || id == PSFP_NONE)
+		return -1;
+
+	struct psfp_meter *meter = &spec->meters[id];
+	memset(meter, 0, sizeof(*meter));
+
+	char *tok;
+	while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+		int ret;
+		if (strcmp(tok, "cir") == 0)
+			ret = parse_rate(strtok(NULL, " \t\r\n"), &meter->cir);
+		else if (strcmp(tok, "eir") == 0)
+			ret = parse_rate(strtok(NULL, " \t\r\n"), &meter->eir);
+		else if (strcmp(tok, "cbs") == 0)
+			ret = parse_u64(strtok(NULL, " \t\r\n"), &meter->cbs);
+		else if (strcmp(tok, "ebs") == 0)
+			ret = parse_u64(strtok(NULL, " \t\r\n"), &meter->ebs);
+		else if (strcmp(tok, "coupling") == 0)
+			ret = 0, meter->coupling = 1;
+		else if (strcmp(tok, "drop-yellow") == 0)
+			ret = 0, meter->drop_yellow = 1;
+		else
+			ret = -1;
+		if (ret != 0)
+			return -1;
+	}
+
+	spec->meter_defined[id] = true;
+	return 0;
+}
+
+static int parse_stream(struct psfp_spec *spec)
+{
+	if (spec->nstreams == PSFP_MAX_STREAMS)
+		return -1;
+
+	struct psfp_stream_key *key = &spec->stream_keys[spec->nstreams];
+	struct psfp_stream *stream = &spec->streams[spec->nstreams];
+	uint64_t value;
+
+	memset(key, 0, sizeof(*key));
+	if (parse_mac(strtok(NULL, " \t\r\n"), key->dst) != 0)
+		return -1;
+	if (parse_u64(strtok(NULL, " \t\r\n"), &value) != 0 || value > 0xfff)
+		return -1;
+	key->vlan_id = value;
+	char *pcp = strtok(NULL, " \t\r\n");
+	if (pcp != NULL && strcmp(pcp, "any") == 0)
+		key->pcp = PSFP_PCP_ANY;
+	else if (parse_u64(pcp, &value) == 0 && value < 8)
+		key->pcp = value;
+	else
+		return -1;
+
+	// The stream handle is the index into the per-stream counters.
+	*stream = (struct psfp_stream) {
+		.handle = spec->nstreams,
+		.gate_id = PSFP_NONE,
+		.meter_id = PSFP_NONE,
+	};
+
+	char *tok;
+	while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+		int ret;
+		if (strcmp(tok, "gate") == 0) {
+			ret = parse_id(strtok(NULL, " \t\r\n"), PSFP_MAX_GATES, &stream->gate_id);
+		} else if (strcmp(tok, "meter") == 0) {
+			ret = parse_id(strtok(NULL, " \t\r\n"), PSFP_MAX_METERS, &stream->meter_id);
+		} else if (strcmp(tok, "max-sdu") == 0) {
+			ret = parse_u64(strtok(NULL, " \t\r\n"), &value);
+			stream->max_sdu = value;
+		} else {
+			ret = -1;
+		}
+		if (ret != 0)
+			return -1;
+	}
+
+	for (size_t i = 0; i < spec->nstreams; i++) {
+		if (memcmp(&spec->stream_keys[i], key, sizeof(*key)) == 0)
+			return -1; // duplicate stream
+	}
+
+	spec->nstreams++;
+	return 0;
+}
+
+// Check that all gates and meters referenced by streams are defined.
+static int check_references(const struct psfp_spec *spec)
+{
+	for (size_t i = 0; i < spec->nstreams; i++) {
+		const struct psfp_stream *stream = &spec->streams[i];
+		if (stream->gate_id != PSFP_NONE && !spec->gate_defined[stream->gate_id]) {
+			fprintf(stderr, "Stream %zu: gate %u not defined\n", i, stream->gate_id);
+			return -1;
+		}
+		if (stream->meter_id != PSFP_NONE && !spec->meter_defined[stream->meter_id]) {
+			fprintf(stderr, "Stream %zu: meter %u not defined\n", i, stream->meter_id);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int open_psfp_maps(const char *ifname, struct psfp_maps *maps)
+{
+	maps->config_fd = open_pinned_map(ifname, "xdp_config_map");
+	maps->stream_fd = open_pinned_map(ifname, "xdp_psfp_stream_map");
+	maps->gate_fd = open_pinned_map(ifname, "xdp_psfp_gate_map");
+	maps->meter_fd = open_pinned_map(ifname, "xdp_psfp_meter_map");
+	maps->meter_state_fd = open_pinned_map(ifname, "xdp_psfp_meter_state_map");
+	maps->stats_fd = open_pinned_map(ifname, "xdp_psfp_stats_map");
+
+	if (maps->config_fd < 0 || maps->stream_fd < 0 || maps->gate_fd < 0 ||
+	    maps->meter_fd < 0 || maps->meter_state_fd < 0 || maps->stats_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+// Remove all streams from the stream map that are not part of the new configuration.
+static int remove_stale_streams(int map_fd, const struct psfp_spec *spec)
+{
+	struct psfp_stream_key key, next_key;
+	void *prev = NULL;
+
+	while (bpf_map_get_next_key(map_fd, prev, &next_key) == 0) {
+		bool stale = true;
+		for (size_t i = 0; i < spec->nstreams; i++) {
+			if (memcmp(&spec->stream_keys[i], &next_key, sizeof(next_key)) == 0) {
+				stale = false;
+				break;
+			}
+		}
+
+		if (stale) {
+			// Deleting the current key restarts the walk at the first key,
+			// so the previous key is kept.
+			if (bpf_map_delete_elem(map_fd, &next_key) != 0)
+				return -1;
+		} else {
+			key = next_key;
+			prev = &key;
+		}
+	}
+
+	return errno == ENOENT ? 0 : -1;
+}
+
+static int psfp_write(struct psfp_maps *maps, const struct psfp_spec *spec)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0) {
+		perror("Could not read configuration");
+		return EXIT_FAIL_FINDELEM;
+	}
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_UPDATE;
+
+	// Write gates and meters, and reset the token buckets, so all meters start
+	// with full buckets.
+	struct psfp_meter_state zero_state[ncpus];
+	memset(zero_state, 0, sizeof(zero_state));
+	for (uint32_t i = 0; i < PSFP_MAX_GATES; i++) {
+		if (spec->gate_defined[i] &&
+		    bpf_map_update_elem(maps->gate_fd, &i, &spec->gates[i], BPF_ANY) != 0) {
+			perror("Could not write PSFP gates");
+			return EXIT_FAIL_UPDATE;
+		}
+	}
+	for (uint32_t i = 0; i < PSFP_MAX_METERS; i++) {
+		if (!spec->meter_defined[i])
+			continue;
+		if (bpf_map_update_elem(maps->meter_fd, &i, &spec->meters[i], BPF_ANY) != 0 ||
+		    bpf_map_update_elem(maps->meter_state_fd, &i, zero_state, BPF_ANY) != 0) {
+			perror("Could not write PSFP meters");
+			return EXIT_FAIL_UPDATE;
+		}
+	}
+
+	// Reset the counters of all streams.
+	struct psfp_stream_stats zero_stats[ncpus];
+	memset(zero_stats, 0, sizeof(zero_stats));
+	for (uint32_t i = 0; i < spec->nstreams; i++) {
+		if (bpf_map_update_elem(maps->stats_fd, &i, zero_stats, BPF_ANY) != 0) {
+			perror("Could not reset PSFP counters");
+			return EXIT_FAIL_UPDATE;
+		}
+	}
+
+	// Add or replace the streams of the new configuration first, so streams
+	// present in both configurations are filtered without interruption.
+	if (map_update_entries(maps->stream_fd, spec->stream_keys, sizeof(spec->stream_keys[0]),
+			       spec->streams, sizeof(spec->streams[0]), spec->nstreams) != 0 ||
+	    remove_stale_streams(maps->stream_fd, spec) != 0) {
+		perror("Could not write PSFP streams");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	cfg.psfp_enabled = (spec->nstreams > 0);
+	if (bpf_map_update_elem(maps->config_fd, &config_key, &cfg, BPF_ANY) != 0) {
+		perror("Could not write configuration");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return EXIT_OK;
+}
+
+static int psfp_load(struct psfp_maps *maps, const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		perror("Could not open PSFP file");
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Too large for the stack.
+	struct psfp_spec *spec = calloc(1, sizeof(*spec));
+	if (spec == NULL) {
+		perror("Could not allocate memory");
+		fclose(f);
+		return EXIT_FAIL_UPDATE;
+	}
+
+	char line[512];
+	unsigned int lineno = 0;
+	int exitcode = EXIT_OK;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+
+		char *type = strtok(line, " \t\r\n");
+		if (type == NULL || type[0] == '#')
+			continue; // empty line or comment
+
+		int ret;
+		if (strcmp(type, "gate") == 0)
+			ret = parse_gate(spec);
+		else if (strcmp(type, "meter") == 0)
+			ret = parse_meter(spec);
+		else if (strcmp(type, "stream") == 0)
+			ret = parse_stream(spec);
+		else
+			ret = -1;
+		if (ret != 0) {
+			fprintf(stderr, "%s:%u: invalid entry\n", filename, lineno);
+			exitcode = EXIT_FAIL_USAGE;
+			goto out;
+		}
+	}
+
+	if (check_references(spec) != 0) {
+		exitcode = EXIT_FAIL_USAGE;
+		goto out;
+	}
+
+	exitcode = psfp_write(maps, spec);
+	if (exitcode == EXIT_OK)
+		printf("Loaded %zu PSFP streams\n", spec->nstreams);
+
+out:
+	free(spec);
+	fclose(f);
+	return exitcode;
+}
+
+static int psfp_stats(struct psfp_maps *maps)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0)
+		return EXIT_FAIL_FINDELEM;
+	if (!cfg.psfp_enabled) {
+		printf("PSFP disabled\n");
+		return EXIT_OK;
+	}
+
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_FINDELEM;
+	struct psfp_stream_stats stats[ncpus];
+
+	struct psfp_stream_key key, next_key;
+	void *prev = NULL;
+	struct psfp_stream stream;
+	while (bpf_map_get_next_key(maps->stream_fd, prev, &next_key) == 0) {
+		key = next_key;
+		prev = &key;
+		if (bpf_map_lookup_elem(maps->stream_fd, &key, &stream) != 0 ||
+		    bpf_map_lookup_elem(maps->stats_fd, &stream.handle, stats) != 0)
+			continue; // removed in the meantime
+
+		struct psfp_stream_stats sum = {};
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			sum.matching_frames += stats[cpu].matching_frames;
+			sum.passing_frames += stats[cpu].passing_frames;
+			sum.not_passing_frames += stats[cpu].not_passing_frames;
+			sum.passing_sdu += stats[cpu].passing_sdu;
+			sum.not_passing_sdu += stats[cpu].not_passing_sdu;
+			sum.red_frames += stats[cpu].red_frames;
+		}
+
+		printf("Stream %u (", stream.handle);
+		print_mac(key.dst, ETH_ALEN);
+		if (key.pcp == PSFP_PCP_ANY)
+			printf(" VID %u PCP any):\n", key.vlan_id);
+		else
+			printf(" VID %u PCP %u):\n", key.vlan_id, key.pcp);
+		printf("  matching %lu, passing SDU %lu, not passing SDU %lu,\n"
+		       "  passing gate %lu, not passing gate %lu, red %lu\n",
+		       sum.matching_frames, sum.passing_sdu, sum.not_passing_sdu,
+		       sum.passing_frames, sum.not_passing_frames, sum.red_frames);
+	}
+
+	return EXIT_OK;
+}
+
+int do_psfp(const char *ifname, int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("psfp").
+	if (argc < 2) {
+		psfp_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Open maps pinned by the running instance of the program.
+	struct psfp_maps maps;
+	if (open_psfp_maps(ifname, &maps) != 0) {
+		fprintf(stderr, "Could not open pinned PSFP maps (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	if (strcmp(argv[1], "load") == 0 && argc > 2) {
+		int exitcode = psfp_load(&maps, argv[2]);
+		// Activate or deactivate the pipeline stage depending on the number of rules.
+		if (exitcode == EXIT_OK)
+			exitcode = pipeline_sync(ifname);
+		return exitcode;
+	} else if (strcmp(argv[1], "stats") == 0)
+		return psfp_stats(&maps);
+
+	psfp_usage("xdp-drop_and_count-user");
+	return EXIT_FAIL_USAGE;
+}
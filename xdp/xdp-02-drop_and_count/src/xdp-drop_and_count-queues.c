@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// State for reading the per-RX-queue statistics once per poll.
+struct queue_poller {
+	int queue_stats_map_fd;
+	int nqueues;
+	int ncpus;
+	struct queue_stats *percpu; // ncpus values of one queue
+	struct queue_stats *cur; // nqueues values summed up over all CPUs
+	struct queue_stats *prev; // values of the previous poll
+};
+
+int num_rx_queues(const char *ifname)
+{
+	char path[PATH_MAX];
+	int n = snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+	if (n < 0 || (size_t) n >= sizeof(path))
+		return -1;
+
+	// Every RX queue has a directory rx-<index>.
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	int nqueues = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "rx-", 3) == 0)
+			nqueues++;
+	}
+	closedir(dir);
+
+	return nqueues;
+}
+
+// Read the per-CPU values of all queues and sum them up into poller->cur.
+static int read_queue_stats(struct queue_poller *poller)
+{
+	for (int queue = 0; queue < poller->nqueues; queue++) {
+		__u32 key = queue;
+		if (bpf_map_lookup_elem(poller->queue_stats_map_fd, &key, poller->percpu) != 0)
+			return -1;
+
+		struct queue_stats *sum = &poller->cur[queue];
+		memset(sum, 0, sizeof(*sum));
+		for (int cpu = 0; cpu < poller->ncpus; cpu++) {
+			sum->rx_packets += poller->percpu[cpu].rx_packets;
+			sum->rx_bytes += poller->percpu[cpu].rx_bytes;
+			sum->dropped_packets += poller->percpu[cpu].dropped_packets;
+			sum->passed_packets += poller->percpu[cpu].passed_packets;
+		}
+	}
+
+	return 0;
+}
+
+struct queue_poller *queue_poller_new(int queue_stats_map_fd, int nqueues)
+{
+	if (nqueues > QUEUE_STATS_MAX_QUEUES)
+		fprintf(stderr, "Reporting statistics of the first %d of %d RX queues only\n",
+			QUEUE_STATS_MAX_QUEUES, nqueues);
+	if (nqueues < 1 || nqueues > QUEUE_STATS_MAX_QUEUES)
+		nqueues = QUEUE_STATS_MAX_QUEUES;
+
+	struct queue_poller *poller = calloc(1, sizeof(*poller));
+	if (poller == NULL)
+		return NULL;
+
+	poller->queue_stats_map_fd = queue_stats_map_fd;
+	poller->nqueues = nqueues;
+	// Per-CPU maps store one value for each possible CPU.
+	poller->ncpus = libbpf_num_possible_cpus();
+	if (poller->ncpus > 0) {
+		poller->percpu = calloc(poller->ncpus, sizeof(*poller->percpu));
+		poller->cur = calloc(nqueues, sizeof(*poller->cur));
+		poller->prev = calloc(nqueues, sizeof(*poller->prev));
+	}
+	if (poller->percpu == NULL || poller->cur == NULL || poller->prev == NULL) {
+		queue_poller_free(poller);
+		return NULL;
+	}
+
+	// Start with the current values, so the first rates do not include packets
+	// counted before (e.g., by the previous version of a persistent instance).
+	if (read_queue_stats(poller) != 0) {
+		queue_poller_free(poller);
+		return NULL;
+	}
+	memcpy(poller->prev, poller->cur, nqueues*sizeof(*poller->cur));
+
+	return poller;
+}
+
+void queue_poller_free(struct queue_poller *poller)
+{
+	if (poller == NULL)
+		return;
+	free(poller->percpu);
+	free(poller->cur);
+	free(poller->prev);
+	free(poller);
+}
+
+// Print how evenly the packets of the last interval are spread over the RX
+// queues: the ratio of the busiest queue to the mean of all queues is 1.0 for a
+// perfect balance and nqueues if a single queue receives all packets.
+static void print_imbalance(const struct queue_poller *poller, double interval)
+{
+	uint64_t total = 0;
+	uint64_t max = 0;
+	int hottest = 0;
+
+	for (int queue = 0; queue < poller->nqueues; queue++) {
+		uint64_t packets = poller->cur[queue].rx_packets - poller->prev[queue].rx_packets;
+		total += packets;
+		if (packets > max) {
+			max = packets;
+			hottest = queue;
+		}
+	}
+
+	if (total == 0) {
+		printf("RX queues: %d, idle\n", poller->nqueues);
+		return;
+	}
+
+	double mean = (double) total/poller->nqueues;
+	printf("RX queues: %d, mean rate=%.0f pps, max/mean=%.2f, hottest queue=%d (%.1f%% of packets)\n",
+	       poller->nqueues, mean/interval, max/mean, hottest, 100.0*max/total);
+}
+
+int print_queue_stats(struct queue_poller *poller, double interval, bool delta, bool per_queue)
+{
+	if (read_queue_stats(poller) != 0) {
+		perror("Could not read per-queue statistics");
+		return EXIT_FAIL_FINDELEM;
+	}
+
+	if (interval > 0.0)
+		print_imbalance(poller, interval);
+
+	for (int queue = 0; per_queue && queue < poller->nqueues; queue++) {
+		const struct queue_stats *cur = &poller->cur[queue];
+		const struct queue_stats *prev = &poller->prev[queue];
+		if (delta && interval > 0.0) {
+			printf("  queue %2d -> rx rate=%.0f pps (%.0f B/s)    drop rate=%.0f pps    pass rate=%.0f pps\n",
+			       queue, (cur->rx_packets - prev->rx_packets)/interval,
+			       (cur->rx_bytes - prev->rx_bytes)/interval,
+			       (cur->dropped_packets - prev->dropped_packets)/interval,
+			       (cur->passed_packets - prev->passed_packets)/interval);
+		} else {
+			printf("  queue %2d -> rx count=%lu (%lu bytes)    drop count=%lu    pass count=%lu\n",
+			       queue, cur->rx_packets, cur->rx_bytes, cur->dropped_packets,
+			       cur->passed_packets);
+		}
+	}
+
+	memcpy(poller->prev, poller->cur, poller->nqueues*sizeof(*poller->cur));
+	return EXIT_OK;
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "xdp-drop_and_count-commons.h"
+#include "xdp-drop_and_count-user.h"
+
+// Default number of flows reported by "sketch top".
+#define SKETCH_DEFAULT_TOP 10
+
+// The sketch maps pinned by the running instance of the program.
+struct sketch_maps {
+	int config_fd;
+	int cms_fd;
+	int candidates_fd;
+};
+
+// A top-K candidate with its estimate from the merged sketch.
+struct sketch_flow {
+	struct flow_key key;
+	uint64_t estimate;
+};
+
+static void sketch_usage(const char *prog)
+{
+	fprintf(stderr, "%s -d DEVICE sketch enable [THRESHOLD]\n"
+		"%s -d DEVICE sketch disable\n"
+		"%s -d DEVICE sketch top [N]\n"
+		"%s -d DEVICE sketch reset\n"
+		"  Count IP flows in a count-min sketch and report the N heaviest flows\n"
+		"  (default %d) among the flows with at least THRESHOLD packets per CPU\n"
+		"  (default %d) since the last reset.\n",
+		prog, prog, prog, prog, SKETCH_DEFAULT_TOP, CMS_DEFAULT_THRESHOLD);
+}
+
+static int open_sketch_maps(const char *ifname, struct sketch_maps *maps)
+{
+	maps->config_fd = open_pinned_map(ifname, "xdp_config_map");
+	maps->cms_fd = open_pinned_map(ifname, "xdp_cms_map");
+	maps->candidates_fd = open_pinned_map(ifname, "xdp_cms_candidates_map");
+
+	if (maps->config_fd < 0 || maps->cms_fd < 0 || maps->candidates_fd < 0)
+		return -1;
+
+	return 0;
+}
+
+static int sketch_set_enabled(struct sketch_maps *maps, const char *ifname, bool enable,
+			      const char *threshold)
+{
+	struct drop_config cfg;
+	__u32 config_key = 0;
+
+	if (bpf_map_lookup_elem(maps->config_fd, &config_key, &cfg) != 0) {
+		perror("Could not read configuration");
+		return EXIT_FAIL_FINDELEM;
+	}
+
+	cfg.sketch_enabled = enable;
+	if (enable) {
+		cfg.sketch_threshold = threshold ? strtoul(threshold, NULL, 0) : CMS_DEFAULT_THRESHOLD;
+		if (cfg.sketch_threshold == 0)
+			return EXIT_FAIL_USAGE;
+	}
+	if (bpf_map_update_elem(maps->config_fd, &config_key, &cfg, BPF_ANY) != 0) {
+		perror("Could not write configuration");
+		return EXIT_FAIL_UPDATE;
+	}
+
+	return pipeline_sync(ifname);
+}
+
+// Read the per-CPU rows of the sketch and add them up into merged.
+static int merge_sketch(int cms_fd, struct cms_row *merged)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return -1;
+
+	// One row of all CPUs is 16 KiB per CPU, so it is allocated on the heap.
+	struct cms_row *rows = calloc(ncpus, sizeof(*rows));
+	if (rows == NULL)
+		return -1;
+
+	for (uint32_t row = 0; row < CMS_DEPTH; row++) {
+		if (bpf_map_lookup_elem(cms_fd, &row, rows) != 0) {
+			free(rows);
+			return -1;
+		}
+		memset(&merged[row], 0, sizeof(merged[row]));
+		for (int cpu = 0; cpu < ncpus; cpu++) {
+			for (int col = 0; col < CMS_WIDTH; col++)
+				merged[row].count[col] += rows[cpu].count[col];
+		}
+	}
+
+	free(rows);
+	return 0;
+}
+
+static uint64_t estimate_flow(const struct cms_row *merged, const struct flow_key *key)
+{
+	uint32_t h1 = cms_hash(key, CMS_SEED1);
+	uint32_t h2 = cms_hash(key, CMS_SEED2) | 1;
+	uint64_t estimate = UINT64_MAX;
+
+	for (uint32_t row = 0; row < CMS_DEPTH; row++) {
+		uint64_t count = merged[row].count[cms_column(h1, h2, row)];
+		if (count < estimate)
+			estimate = count;
+	}
+
+	return estimate;
+}
+
+static int compare_flows(const void *a, const void *b)
+{
+	const struct sketch_flow *fa = a;
+	const struct sketch_flow *fb = b;
+
+	if (fa->estimate != fb->estimate)
+		return fa->estimate < fb->estimate ? 1 : -1;
+	return 0;
+}
+
+static void print_flow(const struct sketch_flow *flow, uint64_t total)
+{
+	int af = flow->key.family == 4 ? AF_INET : AF_INET6;
+	char saddr[INET6_ADDRSTRLEN];
+	char daddr[INET6_ADDRSTRLEN];
+
+	inet_ntop(af, flow->key.saddr, saddr, sizeof(saddr));
+	inet_ntop(af, flow->key.daddr, daddr, sizeof(daddr));
+	printf("%12lu %6.2f%%  proto %3u  %s:%u -> %s:%u\n", flow->estimate,
+	       total ? 100.0*flow->estimate/total : 0.0, flow->key.proto,
+	       saddr, flow->key.sport, daddr, flow->key.dport);
+}
+
+static int sketch_top(struct sketch_maps *maps, unsigned int n)
+{
+	struct cms_row *merged = calloc(CMS_DEPTH, sizeof(*merged));
+	struct sketch_flow *flows = calloc(CMS_MAX_CANDIDATES, sizeof(*flows));
+	int exitcode = EXIT_OK;
+
+	if (merged == NULL || flows == NULL) {
+		perror("Could not allocate memory");
+		exitcode = EXIT_FAIL_FINDELEM;
+		goto out;
+	}
+
+	if (merge_sketch(maps->cms_fd, merged) != 0) {
+		perror("Could not read sketch");
+		exitcode = EXIT_FAIL_FINDELEM;
+		goto out;
+	}
+
+	// Every packet increments exactly one counter per row.
+	uint64_t total = 0;
+	for (int col = 0; col < CMS_WIDTH; col++)
+		total += merged[0].count[col];
+
+	// Estimate all candidates with the merged sketch.
+	size_t nflows = 0;
+	struct flow_key key, next_key;
+	void *prev = NULL;
+	while (nflows < CMS_MAX_CANDIDATES &&
+	       bpf_map_get_next_key(maps->candidates_fd, prev, &next_key) == 0) {
+		key = next_key;
+		prev = &key;
+		flows[nflows].key = key;
+		flows[nflows].estimate = estimate_flow(merged, &key);
+		nflows++;
+	}
+	qsort(flows, nflows, sizeof(*flows), compare_flows);
+
+	// Error bound of the count-min sketch: estimates exceed the true count by at
+	// most epsilon*total with probability 1 - delta.
+	double epsilon = M_E/CMS_WIDTH;
+	double delta = exp(-CMS_DEPTH);
+	printf("%lu packets, %zu candidates, error <= %.0f packets with probability %.2f%%\n",
+	       total, nflows, epsilon*total, 100.0*(1.0 - delta));
+	for (size_t i = 0; i < nflows && i < n; i++)
+		print_flow(&flows[i], total);
+
+out:
+	free(merged);
+	free(flows);
+	return exitcode;
+}
+
+static int sketch_reset(struct sketch_maps *maps)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 1)
+		return EXIT_FAIL_UPDATE;
+
+	struct cms_row *zero = calloc(ncpus, sizeof(*zero));
+	if (zero == NULL)
+		return EXIT_FAIL_UPDATE;
+
+	// Packets counted while the rows are cleared one after another are lost,
+	// which only affects the estimates within this short period.
+	int exitcode = EXIT_OK;
+	for (uint32_t row = 0; row < CMS_DEPTH; row++) {
+		if (bpf_map_update_elem(maps->cms_fd, &row, zero, BPF_ANY) != 0) {
+			perror("Could not reset sketch");
+			exitcode = EXIT_FAIL_UPDATE;
+			break;
+		}
+	}
+	free(zero);
+
+	// Always delete the first key, since deleting the current key of a
+	// walk restarts it anyway.
+	struct flow_key key;
+	while (exitcode == EXIT_OK &&
+	       bpf_map_get_next_key(maps->candidates_fd, NULL, &key) == 0) {
+		if (bpf_map_delete_elem(maps->candidates_fd, &key) != 0) {
+			perror("Could not reset candidates");
+			exitcode = EXIT_FAIL_UPDATE;
+		}
+	}
+
+	return exitcode;
+}
+
+int do_sketch(const char *ifname, int argc, char *argv[])
+{
+	// argv[0] is the name of the subcommand ("sketch").
+	if (argc < 2) {
+		sketch_usage("xdp-drop_and_count-user");
+		return EXIT_FAIL_USAGE;
+	}
+
+	// Open maps pinned by the running instance of the program.
+	struct sketch_maps maps;
+	if (open_sketch_maps(ifname, &maps) != 0) {
+		fprintf(stderr, "Could not open pinned sketch maps (is the BPF program loaded?)\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	int exitcode = EXIT_FAIL_USAGE;
+	if (strcmp(argv[1], "enable") == 0)
+		exitcode = sketch_set_enabled(&maps, ifname, true, argc > 2 ? argv[2] : NULL);
+	else if (strcmp(argv[1], "disable") == 0)
+		exitcode = sketch_set_enabled(&maps, ifname, false, NULL);
+	else if (strcmp(argv[1], "top") == 0)
+		exitcode = sketch_top(&maps, argc > 2 ? strtoul(argv[2], NULL, 0) : SKETCH_DEFAULT_TOP);
+	else if (strcmp(argv[1], "reset") == 0)
+		exitcode = sketch_reset(&maps);
+
+	if (exitcode == EXIT_FAIL_USAGE)
+		sketch_usage("xdp-drop_and_count-user");
+	return exitcode;
+}
@@ -2,6 +2,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -13,14 +22,7 @@
 #include <common_user_bpf_xdp.h>
 
 #include "xdp-drop_and_count-commons.h"
-
-#define EXIT_OK 0
-#define EXIT_FAIL_BPFLOAD 1
-#define EXIT_FAIL_FINDMAP 2
-#define EXIT_FAIL_FINDELEM 3
-#define EXIT_FAIL_USAGE 4
-#define EXIT_FAIL_DEVICE 5
-#define EXIT_FAILSIGNAL 6
+#include "xdp-drop_and_count-user.h"
 
 static int do_exit = 0;
 
@@ -36,6 +38,73 @@ int get_map_fd(struct bpf_object *bpf_obj, const char *maps_name)
 	return bpf_map__fd(map);
 }
 
+int pin_path(char *path, size_t len, const char *ifname, const char *name)
+{
+	int n = snprintf(path, len, "%s/%s/%s", PIN_BASEDIR, ifname, name);
+	if (n < 0 || (size_t) n >= len)
+		return -1;
+	return 0;
+}
+
+int open_pinned_map(const char *ifname, const char *map_name)
+{
+	char path[PATH_MAX];
+	if (pin_path(path, sizeof(path), ifname, map_name) != 0)
+		return -1;
+
+	return bpf_obj_get(path);
+}
+
+int parse_mac(const char *str, unsigned char *addr)
+{
+	unsigned int bytes[ETH_ALEN];
+	char end;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x%c", &bytes[0], &bytes[1], &bytes[2],
+		   &bytes[3], &bytes[4], &bytes[5], &end) != ETH_ALEN)
+		return -1;
+
+	for (size_t i = 0; i < ETH_ALEN; i++) {
+		if (bytes[i] > 0xff)
+			return -1;
+		addr[i] = bytes[i];
+	}
+
+	return 0;
+}
+
+// Number of entries pushed to the kernel with a single batch system call.
+#define UPDATE_BATCH_SIZE 4096
+
+int map_update_entries(int map_fd, const void *keys, size_t key_size,
+		       const void *values, size_t value_size, size_t count)
+{
+	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts,
+		.elem_flags = BPF_ANY,
+		.flags = 0,
+	);
+	const char *k = keys;
+	const char *v = values;
+
+	for (size_t i = 0; i < count; i += UPDATE_BATCH_SIZE) {
+		__u32 n = count - i < UPDATE_BATCH_SIZE ? count - i : UPDATE_BATCH_SIZE;
+		if (bpf_map_update_batch(map_fd, k + i*key_size, v + i*value_size, &n, &opts) == 0)
+			continue;
+
+		// Batch operations are not supported by older kernels and some map types
+		// (e.g., LPM tries). Fall back to one system call per entry.
+		if (!BATCH_UNSUPPORTED(errno))
+			return -1;
+		for (size_t j = i; j < count; j++) {
+			if (bpf_map_update_elem(map_fd, k + j*key_size, v + j*value_size, BPF_ANY) != 0)
+				return -1;
+		}
+		break;
+	}
+
+	return 0;
+}
+
 void print_mac(unsigned char *addr, size_t len)
 {
 	for (size_t i = 0; i < len; i++) {
@@ -45,53 +114,461 @@ void print_mac(unsigned char *addr, size_t len)
 	}
 }
 
-void print_stats_per_mac(int stats_per_mac_map_fd)
+// Aggregate the per-CPU values of one entry of the per-MAC map.
+static void sum_mac_stats(const struct hash_map_value *percpu_values, int ncpus,
+			  struct hash_map_value *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		sum->dropped_packets += percpu_values[cpu].dropped_packets;
+		sum->dropped_bytes += percpu_values[cpu].dropped_bytes;
+		sum->passed_packets += percpu_values[cpu].passed_packets;
+		sum->passed_bytes += percpu_values[cpu].passed_bytes;
+		// The last drop is the latest drop seen by any CPU.
+		if (percpu_values[cpu].t_lastdrop > sum->t_lastdrop)
+			sum->t_lastdrop = percpu_values[cpu].t_lastdrop;
+	}
+}
+
+// Number of per-MAC entries read from the kernel with a single batch system call.
+#define STATS_BATCH_SIZE 4096
+
+// Reusable buffers for reading the per-MAC map in batches.
+struct mac_stats_buffer {
+	int ncpus;
+	struct hash_map_key keys[STATS_BATCH_SIZE];
+	// For per-CPU maps, a lookup returns one value for each possible CPU,
+	// so this array holds STATS_BATCH_SIZE*ncpus values.
+	struct hash_map_value *values;
+};
+
+static struct mac_stats_buffer *alloc_mac_stats_buffer(int ncpus)
+{
+	struct mac_stats_buffer *buf = calloc(1, sizeof(*buf));
+	if (buf == NULL)
+		return NULL;
+
+	buf->ncpus = ncpus;
+	buf->values = calloc((size_t) STATS_BATCH_SIZE*ncpus, sizeof(*buf->values));
+	if (buf->values == NULL) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void free_mac_stats_buffer(struct mac_stats_buffer *buf)
+{
+	free(buf->values);
+	free(buf);
+}
+
+static void print_mac_stats(struct hash_map_key *key, const struct hash_map_value *value,
+			    double interval)
+{
+	print_mac(key->addr, ETH_ALEN);
+	if (interval > 0.0) {
+		// Delta mode: counters have been reset by the last poll.
+		printf(" -> drop rate=%.0f pps (%.0f B/s)    pass rate=%.0f pps (%.0f B/s)\n",
+		       value->dropped_packets/interval, value->dropped_bytes/interval,
+		       value->passed_packets/interval, value->passed_bytes/interval);
+	} else {
+		printf(" -> drop count=%lu (%lu bytes)    pass count=%lu (%lu bytes)    t last drop=%lu \n",
+		       value->dropped_packets, value->dropped_bytes,
+		       value->passed_packets, value->passed_bytes, value->t_lastdrop);
+	}
+}
+
+// Fallback for kernels without batch operations on hash maps: two system calls per entry.
+static int print_stats_per_mac_iter(int stats_per_mac_map_fd, struct mac_stats_buffer *buf,
+				    double interval)
 {
+	struct hash_map_value value;
+
 	// We can iterate through all keys of the hash map as follows:
 	// 1. Set current key to NULL for first query.
-	struct hash_map_key next_key;
-	struct hash_map_value value;
-	if (bpf_map_get_next_key(stats_per_mac_map_fd, NULL, &next_key) != 0)
-		return; // empty hash map
-
-	do {
-		struct hash_map_key current_key = next_key;
-		// Lock entry for reading element atomically.
-		bpf_map_lookup_elem_flags(stats_per_mac_map_fd, &current_key, &value, BPF_F_LOCK);
-		print_mac(current_key.addr, ETH_ALEN);
-		printf(" -> drop count=%lu    t last drop=%lu \n", value.dropped, value.t_lastdrop);
-	} while (bpf_map_get_next_key(stats_per_mac_map_fd, NULL, &next_key) == 0);
-	
+	// 2. Pass the current key to get the key following the current key.
+	// The next key is queried before the current key is deleted in delta mode.
+	struct hash_map_key current_key, next_key;
+	bool more = (bpf_map_get_next_key(stats_per_mac_map_fd, NULL, &current_key) == 0);
+
+	while (more) {
+		more = (bpf_map_get_next_key(stats_per_mac_map_fd, &current_key, &next_key) == 0);
+		// Entries might have been evicted meanwhile by the LRU map.
+		if (bpf_map_lookup_elem(stats_per_mac_map_fd, &current_key, buf->values) == 0) {
+			if (interval > 0.0)
+				bpf_map_delete_elem(stats_per_mac_map_fd, &current_key);
+			sum_mac_stats(buf->values, buf->ncpus, &value);
+			print_mac_stats(&current_key, &value, interval);
+		}
+		current_key = next_key;
+	}
+
+	return EXIT_OK;
 }
 
-int poll_stats(int stats_map_fd, int stats_per_mac_map_fd)
+// Print per-MAC statistics, reading up to STATS_BATCH_SIZE entries per system call.
+// If interval is positive (delta mode), entries are deleted while reading, so
+// the next poll only sees packets received within the next interval, and rates
+// are printed. Packets counted by the BPF program while a batch is copied
+// might be lost in delta mode.
+int print_stats_per_mac(int stats_per_mac_map_fd, struct mac_stats_buffer *buf,
+			double interval)
 {
-	__u32 key = 0; // first and only key in map
-	
-	uint64_t drop_cnt;
-	while (!do_exit) {
-		// Note that the next call involves a system call that *copies*
-		// the value of the requested data. Since data is updated on the kernel-side
-		// with an atomic operation, we do not need to lock the element here.
-		if (bpf_map_lookup_elem(stats_map_fd, &key, &drop_cnt) != 0)
+	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts,
+		.elem_flags = 0,
+		.flags = 0,
+	);
+	struct hash_map_value value;
+	// For hash maps, the batch position is the index of a hash bucket.
+	__u32 batch;
+	void *in_batch = NULL; // NULL starts at the first entry
+
+	while (1) {
+		__u32 count = STATS_BATCH_SIZE;
+		int err;
+		if (interval > 0.0)
+			err = bpf_map_lookup_and_delete_batch(stats_per_mac_map_fd, in_batch, &batch,
+							      buf->keys, buf->values, &count, &opts);
+		else
+			err = bpf_map_lookup_batch(stats_per_mac_map_fd, in_batch, &batch,
+						   buf->keys, buf->values, &count, &opts);
+		if (err != 0 && errno != ENOENT) {
+			if (in_batch == NULL && BATCH_UNSUPPORTED(errno))
+				return print_stats_per_mac_iter(stats_per_mac_map_fd, buf, interval);
+			perror("Could not read per-MAC statistics");
 			return EXIT_FAIL_FINDELEM;
-		
-		printf("Total drop count: %lu\n", drop_cnt);
+		}
+
+		for (__u32 i = 0; i < count; i++) {
+			sum_mac_stats(&buf->values[i*buf->ncpus], buf->ncpus, &value);
+			print_mac_stats(&buf->keys[i], &value, interval);
+		}
 
-		print_stats_per_mac(stats_per_mac_map_fd);
-		
-		sleep(1); // sleep one sec.
+		// ENOENT signals that the last entry has been read.
+		if (err != 0)
+			break;
+		in_batch = &batch;
 	}
 
 	return EXIT_OK;
 }
 
+static double elapsed_sec(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec)/1e9;
+}
+
+// State of the periodic statistics output.
+struct stats_poller {
+	const struct cpu_counters *counters;
+	int stats_per_mac_map_fd;
+	int ncpus; // CPUs with their own entry in the counters array
+	bool delta;
+	uint64_t prev_drop_cnt;
+	struct timespec prev_time;
+	struct mac_stats_buffer *buf;
+	struct queue_poller *queues;
+	bool per_queue;
+};
+
+const struct cpu_counters *mmap_counters(int counters_map_fd)
+{
+	// Memory-mapped arrays are mapped as a whole.
+	void *counters = mmap(NULL, COUNTERS_MMAP_SIZE, PROT_READ, MAP_SHARED, counters_map_fd, 0);
+	if (counters == MAP_FAILED)
+		return NULL;
+
+	return counters;
+}
+
+void munmap_counters(const struct cpu_counters *counters)
+{
+	munmap((void *) counters, COUNTERS_MMAP_SIZE);
+}
+
+int num_counter_cpus(void)
+{
+	int ncpus = libbpf_num_possible_cpus();
+	if (ncpus > COUNTERS_MAX_CPUS)
+		ncpus = COUNTERS_MAX_CPUS;
+	return ncpus;
+}
+
+void sum_counters(const struct cpu_counters *counters, int ncpus, uint64_t *sum)
+{
+	memset(sum, 0, COUNTER_MAX*sizeof(*sum));
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		// The BPF program updates the counters concurrently. Aligned 64-bit
+		// loads are atomic, so we read consistent values of each counter.
+		const volatile uint64_t *value = counters[cpu].value;
+		for (int i = 0; i < COUNTER_MAX; i++)
+			sum[i] += value[i];
+	}
+}
+
+const char *drop_reason_str(unsigned int reason)
+{
+	switch (reason) {
+	case DROP_REASON_BLOCKLIST:
+		return "blocklist";
+	case DROP_REASON_ACL:
+		return "acl";
+	case DROP_REASON_PSFP_SDU:
+		return "psfp-sdu";
+	case DROP_REASON_PSFP_GATE:
+		return "psfp-gate";
+	case DROP_REASON_PSFP_METER:
+		return "psfp-meter";
+	case DROP_REASON_FILTER:
+		return "filter";
+	default:
+		return "unknown";
+	}
+}
+
+static int print_stats(struct stats_poller *poller)
+{
+	uint64_t counters[COUNTER_MAX];
+
+	// Reading the memory-mapped counters involves no system call.
+	sum_counters(poller->counters, poller->ncpus, counters);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double interval = elapsed_sec(&poller->prev_time, &now);
+	poller->prev_time = now;
+
+	uint64_t drop_cnt = counters[COUNTER_DROPPED_PACKETS];
+	if (poller->delta) {
+		printf("Total drop rate: %.0f pps\n", (drop_cnt - poller->prev_drop_cnt)/interval);
+		poller->prev_drop_cnt = drop_cnt;
+	} else {
+		printf("Total drop count: %lu\n", drop_cnt);
+	}
+	if (counters[COUNTER_EVENTS_LOST] > 0)
+		printf("Lost drop events: %lu\n", counters[COUNTER_EVENTS_LOST]);
+
+	// The queue imbalance always refers to the last interval.
+	int exitcode = print_queue_stats(poller->queues, interval, poller->delta, poller->per_queue);
+	if (exitcode != EXIT_OK)
+		return exitcode;
+
+	if (!poller->delta)
+		interval = 0.0; // print absolute per-MAC counters
+	return print_stats_per_mac(poller->stats_per_mac_map_fd, poller->buf, interval);
+}
+
+// Called by libbpf for every drop event in the ring buffer.
+static int handle_drop_event(void *ctx, void *data, size_t size)
+{
+	const struct drop_event *event = data;
+
+	if (size < sizeof(*event))
+		return 0;
+
+	printf("Drop at %lu.%09lu (TAI): ", event->timestamp/1000000000UL,
+	       event->timestamp%1000000000UL);
+	print_mac((unsigned char *) event->src, ETH_ALEN);
+	printf(" -> ");
+	print_mac((unsigned char *) event->dst, ETH_ALEN);
+	printf(" proto=0x%04x len=%u queue=%u reason=%s\n", ntohs(event->eth_proto),
+	       event->pkt_len, event->rx_queue, drop_reason_str(event->reason));
+
+	return 0;
+}
+
+// Print statistics once per second until the user terminates the program.
+// If rb is not NULL, drop events are printed as soon as they arrive.
+// Both, the one-second timer and the ring buffer, are waited for with a single epoll instance.
+int poll_stats(const struct cpu_counters *counters, int stats_per_mac_map_fd,
+	       struct queue_poller *queues, bool delta, bool per_queue, struct ring_buffer *rb)
+{
+	struct stats_poller poller = {
+		.counters = counters,
+		.stats_per_mac_map_fd = stats_per_mac_map_fd,
+		.delta = delta,
+		.queues = queues,
+		.per_queue = per_queue,
+	};
+
+	poller.ncpus = num_counter_cpus();
+	// Per-CPU maps store one value for each possible CPU, even beyond COUNTERS_MAX_CPUS.
+	int possible_cpus = libbpf_num_possible_cpus();
+	if (poller.ncpus < 1 || possible_cpus < 1)
+		return EXIT_FAIL_FINDELEM;
+
+	// Allocate the buffers for reading the per-MAC map once and reuse them for every poll.
+	poller.buf = alloc_mac_stats_buffer(possible_cpus);
+	if (poller.buf == NULL) {
+		perror("Could not allocate memory");
+		return EXIT_FAIL_FINDELEM;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &poller.prev_time);
+
+	int exitcode = EXIT_OK;
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (epoll_fd < 0 || timer_fd < 0) {
+		perror("Could not create epoll or timer file descriptor");
+		exitcode = EXIT_FAIL_FINDELEM;
+		goto out;
+	}
+
+	struct itimerspec period = {
+		.it_interval = { .tv_sec = 1 }, // print statistics once per second
+		.it_value = { .tv_sec = 1 },
+	};
+	timerfd_settime(timer_fd, 0, &period, NULL);
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = timer_fd };
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+	int rb_fd = -1;
+	if (rb != NULL) {
+		// The ring buffer manager of libbpf has its own epoll file descriptor,
+		// which becomes readable when new events are available.
+		rb_fd = ring_buffer__epoll_fd(rb);
+		ev.data.fd = rb_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rb_fd, &ev);
+	}
+
+	while (!do_exit) {
+		struct epoll_event events[2];
+		int n = epoll_wait(epoll_fd, events, 2, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue; // interrupted by signal, e.g., Ctrl-C
+			perror("epoll_wait failed");
+			exitcode = EXIT_FAIL_FINDELEM;
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == rb_fd) {
+				// Consume all available events without blocking.
+				if (ring_buffer__poll(rb, 0) < 0) {
+					exitcode = EXIT_FAIL_FINDELEM;
+					do_exit = 1;
+				}
+			} else if (events[i].data.fd == timer_fd) {
+				uint64_t expirations;
+				if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+					continue;
+				exitcode = print_stats(&poller);
+				if (exitcode != EXIT_OK)
+					do_exit = 1;
+			}
+		}
+		fflush(stdout);
+	}
+
+out:
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	free_mac_stats_buffer(poller.buf);
+
+	return exitcode;
+}
+
+// Configure the loaded BPF program and report statistics until the user terminates
+// the program.
+static int run_instance(struct bpf_object *bpf_obj, const char *ifname,
+			unsigned int event_sample_rate, bool delta, bool per_queue)
+{
+	// Map the global counters of map "xdp_counters_map" into memory.
+	const struct cpu_counters *counters = mmap_counters(get_map_fd(bpf_obj, "xdp_counters_map"));
+	if (counters == NULL) {
+		fprintf(stderr, "Could not map counters\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	// Get file descriptor of map "xdp_stats_per_mac_map".
+	int stats_per_mac_map_fd = get_map_fd(bpf_obj, "xdp_stats_per_mac_map");
+	if (stats_per_mac_map_fd < 0) {
+		munmap_counters(counters);
+		fprintf(stderr, "Could not find map\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	// Write configuration for the BPF program. Keep the ACL and PSFP settings,
+	// which are set by the subcommands and survive upgrades of a persistent instance.
+	int config_map_fd = get_map_fd(bpf_obj, "xdp_config_map");
+	__u32 config_key = 0;
+	struct drop_config drop_cfg;
+	if (config_map_fd < 0 ||
+	    bpf_map_lookup_elem(config_map_fd, &config_key, &drop_cfg) != 0) {
+		munmap_counters(counters);
+		fprintf(stderr, "Could not read configuration map\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+	drop_cfg.event_sample_rate = event_sample_rate;
+	if (bpf_map_update_elem(config_map_fd, &config_key, &drop_cfg, BPF_ANY) != 0) {
+		munmap_counters(counters);
+		fprintf(stderr, "Could not write configuration map\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	// Set up the consumer of the drop event ring buffer.
+	struct ring_buffer *rb = NULL;
+	if (event_sample_rate > 0) {
+		rb = ring_buffer__new(get_map_fd(bpf_obj, "xdp_drop_events"),
+				      handle_drop_event, NULL, NULL);
+		if (libbpf_get_error(rb)) {
+			munmap_counters(counters);
+			fprintf(stderr, "Could not create ring buffer\n");
+			return EXIT_FAIL_FINDMAP;
+		}
+	}
+
+	// Compare the RX queues of the device. If the number of queues is unknown,
+	// all queues with an entry in the map are reported.
+	struct queue_poller *queues = queue_poller_new(get_map_fd(bpf_obj, "xdp_queue_stats_map"),
+						       num_rx_queues(ifname));
+	if (queues == NULL) {
+		ring_buffer__free(rb);
+		munmap_counters(counters);
+		fprintf(stderr, "Could not read per-queue statistics\n");
+		return EXIT_FAIL_FINDMAP;
+	}
+
+	// Poll for new statistics values until user terminates program.
+	int exitcode = poll_stats(counters, stats_per_mac_map_fd, queues, delta, per_queue, rb);
+
+	queue_poller_free(queues);
+	ring_buffer__free(rb);
+	munmap_counters(counters);
+
+	return exitcode;
+}
+
 static void usage(const char *prog)
 {
 	fprintf(stderr, "%s "
 		"-f BPF_PROG_FILENAME "
 		"-d DEVICE "
-		"\n", prog);
+		"[-r] "
+		"[-e SAMPLE_RATE] "
+		"[-p] "
+		"[-q] "
+		"\n"
+		"  -r: report rates between polls instead of absolute counters\n"
+		"  -q: report the counters of every RX queue, not only their imbalance\n"
+		"  -e: print an event for one out of SAMPLE_RATE dropped packets\n"
+		"  -p: persistent mode: reuse pinned maps, atomically replace the program of a\n"
+		"      running instance, and keep the program attached on exit\n"
+		"%s -d DEVICE -U\n"
+		"  Detach the program of a persistent instance and remove its pinned maps\n"
+		"%s -d DEVICE blocklist add|del|load ...\n"
+		"%s -d DEVICE acl load|stats ...\n"
+		"%s -d DEVICE psfp load|stats ...\n"
+		"%s -d DEVICE sketch enable|disable|top|reset ...\n"
+		"%s -d DEVICE filter load|compile|stats ...\n"
+		"%s -d DEVICE capture FILE [snaplen N] [count N] [drops] [EXPRESSION]\n"
+		"%s -d DEVICE pipeline show|enable|disable ...\n"
+		"%s metrics [ADDR:]PORT|SOCKET_PATH DEVICE...\n", prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
 }
 
 static void sigint_handler(int signal)
@@ -110,8 +587,13 @@ int main(int argc, char *argv[])
 	cfg.ifname[0] = 0;
 	cfg.filename[0] = 0;
 	
+	bool delta = false;
+	bool persistent = false;
+	bool per_queue = false;
+	unsigned int event_sample_rate = 0; // no drop events by default
+
 	int opt;
-	while ( (opt = getopt(argc, argv, "d:f:")) != -1 ) {
+	while ( (opt = getopt(argc, argv, "d:f:re:pUq")) != -1 ) {
 		switch(opt) {
 		case 'd' :
 			strncpy(cfg.ifname, optarg, IF_NAMESIZE);
@@ -119,6 +601,21 @@ int main(int argc, char *argv[])
 		case 'f' :
 			strncpy(cfg.filename, optarg, sizeof(cfg.filename));
 			break;
+		case 'r' :
+			delta = true;
+			break;
+		case 'e' :
+			event_sample_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'p' :
+			persistent = true;
+			break;
+		case 'U' :
+			cfg.do_unload = true;
+			break;
+		case 'q' :
+			per_queue = true;
+			break;
 		case ':' :
 		case '?' :
 		default :
@@ -127,11 +624,49 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// The metrics exporter reads the counters of several devices.
+	if (optind < argc && strcmp(argv[optind], "metrics") == 0)
+		return do_metrics(argc - optind, &argv[optind]);
+
 	if (strlen(cfg.ifname) == 0) {
 		usage(argv[0]);
 		return EXIT_FAIL_USAGE;
 	}
 
+	// Subcommands update the maps of an already running instance.
+	if (optind < argc) {
+		if (strcmp(argv[optind], "blocklist") == 0)
+			return do_blocklist(cfg.ifname, argc - optind, &argv[optind]);
+		if (strcmp(argv[optind], "acl") == 0)
+			return do_acl(cfg.ifname, argc - optind, &argv[optind]);
+		if (strcmp(argv[optind], "psfp") == 0)
+			return do_psfp(cfg.ifname, argc - optind, &argv[optind]);
+		if (strcmp(argv[optind], "sketch") == 0)
+			return do_sketch(cfg.ifname, argc - optind, &argv[optind]);
+		if (strcmp(argv[optind], "filter") == 0)
+			return do_filter(cfg.ifname, argc - optind, &argv[optind]);
+		if (strcmp(argv[optind], "capture") == 0)
+			return do_capture(cfg.ifname, argc - optind, &argv[optind]);
+		if (strcmp(argv[optind], "pipeline") == 0)
+			return do_pipeline(cfg.ifname, argc - optind, &argv[optind]);
+		usage(argv[0]);
+		return EXIT_FAIL_USAGE;
+	}
+
+	if ( (cfg.ifindex = if_nametoindex(cfg.ifname)) == 0) {
+		perror("Could not get interface index");
+		return EXIT_FAIL_DEVICE;
+	}
+
+	// Maps are pinned to PIN_BASEDIR/<device>/, so other invocations of this
+	// program can update them and a persistent instance can reuse them.
+	char pin_dir[PATH_MAX];
+	if (pin_path(pin_dir, sizeof(pin_dir), cfg.ifname, "") != 0)
+		return EXIT_FAIL_PIN;
+
+	if (cfg.do_unload)
+		return xdp_unload_persistent(&cfg, pin_dir);
+
 	if (strlen(cfg.filename) == 0) {
 		usage(argv[0]);
 		return EXIT_FAIL_USAGE;
@@ -144,40 +679,39 @@ int main(int argc, char *argv[])
 		perror("Could not attach signal handler");
 		return EXIT_FAILSIGNAL;
 	}
-	
-	if ( (cfg.ifindex = if_nametoindex(cfg.ifname)) == 0) {
-		perror("Could not get interface index");
-		return EXIT_FAIL_DEVICE;
-	}
 
-	// Load BPF program and attach it to network interface using libbpf.
-	struct bpf_object *bpf_obj = load_bpf_and_xdp_attach(&cfg);
-	if (!bpf_obj) {
-		fprintf(stderr, "Could not load and attach BPF program\n");
-		return EXIT_FAIL_BPFLOAD;
-	}
+	struct bpf_object *bpf_obj;
+	if (persistent) {
+		// Load BPF program reusing the pinned maps, and replace a running instance.
+		bpf_obj = load_bpf_and_xdp_replace(&cfg, pin_dir);
+		if (!bpf_obj) {
+			fprintf(stderr, "Could not load and attach BPF program\n");
+			return EXIT_FAIL_BPFLOAD;
+		}
+	} else {
+		// Unpinning the maps below would break a running persistent instance.
+		char link_path[PATH_MAX];
+		if (pin_path(link_path, sizeof(link_path), cfg.ifname, XDP_LINK_PIN_NAME) != 0 ||
+		    access(link_path, F_OK) == 0) {
+			fprintf(stderr, "A persistent instance is attached to %s (use -p or -U)\n",
+				cfg.ifname);
+			return EXIT_FAIL_BPFLOAD;
+		}
 
-	// Get file descriptor of map "xdp_drop_stats_map".
-	int stats_map_fd = get_map_fd(bpf_obj, "xdp_drop_stats_map");
-	if (stats_map_fd < 0) {
-		xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
-		fprintf(stderr, "Could not find map\n");
-		return EXIT_FAIL_FINDMAP;
+		// Load BPF program and attach it to network interface using libbpf.
+		// Maps are pinned, so the blocklist can be updated by other invocations of this program.
+		bpf_obj = load_bpf_and_xdp_attach_pinned(&cfg, pin_dir);
+		if (!bpf_obj) {
+			fprintf(stderr, "Could not load and attach BPF program\n");
+			return EXIT_FAIL_BPFLOAD;
+		}
 	}
 
-	// Get file descriptor of map "xdp_stats_per_mac_map".
-	int stats_per_mac_map_fd = get_map_fd(bpf_obj, "xdp_stats_per_mac_map");
-	if (stats_per_mac_map_fd < 0) {
-		xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
-		fprintf(stderr, "Could not find map\n");
-		return EXIT_FAIL_FINDMAP;
-	}
-	
-	// Poll for new statistics values until user terminates program.
-	int exitcode = poll_stats(stats_map_fd, stats_per_mac_map_fd);
+	int exitcode = run_instance(bpf_obj, cfg.ifname, event_sample_rate, delta, per_queue);
 
-	// Detach XDP program from interface using libbpf.
-	xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
+	// A persistent instance keeps its program and maps in place for the next upgrade.
+	if (!persistent)
+		xdp_detach_instance(&cfg, bpf_obj, pin_dir);
 
 	return exitcode;
 }
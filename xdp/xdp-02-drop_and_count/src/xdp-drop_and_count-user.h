@@ -0,0 +1,174 @@
+#ifndef DROP_AND_COUNT_USER_H
+#define DROP_AND_COUNT_USER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#define EXIT_OK 0
+#define EXIT_FAIL_BPFLOAD 1
+#define EXIT_FAIL_FINDMAP 2
+#define EXIT_FAIL_FINDELEM 3
+#define EXIT_FAIL_USAGE 4
+#define EXIT_FAIL_DEVICE 5
+#define EXIT_FAILSIGNAL 6
+#define EXIT_FAIL_PIN 7
+#define EXIT_FAIL_UPDATE 8
+
+// Maps are pinned to the BPF file system in directory PIN_BASEDIR/<device>/,
+// so other invocations of the user-space program can update them while the
+// BPF program is running.
+#define PIN_BASEDIR "/sys/fs/bpf"
+
+// Name of the pinned XDP link of a persistent instance (started with -p) in the pin directory.
+#define XDP_LINK_PIN_NAME "xdp_link"
+
+// Kernel-internal error code returned by the bpf() system call if a map does not
+// support batch operations. It is not defined in the user-space headers.
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+// Returns true if errno indicates that batch operations are not supported.
+#define BATCH_UNSUPPORTED(err) ((err) == EINVAL || (err) == ENOTSUPP || (err) == EOPNOTSUPP)
+
+// Build the path of the object with the given name pinned for the given device.
+// Returns 0 on success.
+int pin_path(char *path, size_t len, const char *ifname, const char *name);
+
+// Open the map with the given name pinned for the given device.
+// Returns the file descriptor of the map or a negative value on error.
+int open_pinned_map(const char *ifname, const char *map_name);
+
+// Parse MAC address of the form xx:xx:xx:xx:xx:xx.
+// Returns 0 on success.
+int parse_mac(const char *str, unsigned char *addr);
+
+void print_mac(unsigned char *addr, size_t len);
+
+// Size of the memory-mapped global counters (multiple of the page size).
+#define COUNTERS_MMAP_SIZE (COUNTERS_MAX_CPUS*sizeof(struct cpu_counters))
+
+// Map the global counters of map xdp_counters_map read-only into memory.
+// Returns NULL on error.
+const struct cpu_counters *mmap_counters(int counters_map_fd);
+
+void munmap_counters(const struct cpu_counters *counters);
+
+// Number of CPUs with their own entry in the counters map.
+int num_counter_cpus(void);
+
+// Sum up the counters of ncpus CPUs. sum must have COUNTER_MAX entries.
+void sum_counters(const struct cpu_counters *counters, int ncpus, uint64_t *sum);
+
+const char *drop_reason_str(unsigned int reason);
+
+// Number of RX queues of the device, or -1 on error.
+int num_rx_queues(const char *ifname);
+
+// Reader of the per-RX-queue statistics of map xdp_queue_stats_map.
+struct queue_poller;
+
+// Returns NULL on error. nqueues is limited to QUEUE_STATS_MAX_QUEUES.
+struct queue_poller *queue_poller_new(int queue_stats_map_fd, int nqueues);
+
+void queue_poller_free(struct queue_poller *poller);
+
+// Print the imbalance of the RX queues within the last interval (in seconds),
+// and if per_queue is true, the counters (or with delta, the rates) of every queue.
+int print_queue_stats(struct queue_poller *poller, double interval, bool delta, bool per_queue);
+
+// Insert or update count entries of a map with as few system calls as possible,
+// i.e., using batch operations if supported by the map and kernel.
+// keys and values are arrays of key_size and value_size elements.
+// Returns 0 on success, or -1 and sets errno on error.
+int map_update_entries(int map_fd, const void *keys, size_t key_size,
+		       const void *values, size_t value_size, size_t count);
+
+struct filter;
+
+// Compile the pcap-filter expression given as one or more arguments (joined by
+// spaces) to filter. An empty expression matches every packet.
+// Returns EXIT_OK, or prints the error and returns EXIT_FAIL_USAGE.
+int filter_compile_args(int argc, char *argv[], struct filter *filter);
+
+// Writer of pcapng files with nano-second timestamps. Blocks are assembled in a
+// large buffer and written with few system calls.
+struct pcapng_writer;
+
+// Create filename ("-": standard output) and write the section header and the
+// description of interface ifname. Returns NULL on error.
+struct pcapng_writer *pcapng_open(const char *filename, const char *ifname, uint32_t snaplen);
+
+// Append a packet received at timestamp (in nano-seconds, TAI clock) from
+// rx_queue. reason is the enum drop_reason of dropped packets or DROP_REASON_NONE.
+// Returns 0 on success.
+int pcapng_write_packet(struct pcapng_writer *writer, uint64_t timestamp, const void *data,
+			uint32_t cap_len, uint32_t pkt_len, uint32_t rx_queue, unsigned int reason);
+
+// Write the buffered blocks to the file. Returns 0 on success.
+int pcapng_flush(struct pcapng_writer *writer);
+
+// Append the interface statistics (packets accepted by the capture filter and
+// packets lost), flush, and close the file. Returns 0 on success.
+int pcapng_close(struct pcapng_writer *writer, uint64_t accepted, uint64_t lost);
+
+struct config;
+struct bpf_object;
+
+// Load the BPF object file cfg->filename, pin its maps and stage programs to
+// pin_dir (which must end with '/'), and attach it to cfg->ifindex with cfg->xdp_flags.
+// Returns the loaded object or NULL on error.
+struct bpf_object *load_bpf_and_xdp_attach_pinned(const struct config *cfg, const char *pin_dir);
+
+// Load the BPF object file cfg->filename reusing the maps pinned in pin_dir (which
+// must end with '/'), and attach it to cfg->ifindex. A program attached by a
+// running instance is replaced atomically, so no packet passes unfiltered and
+// no counter is reset. The program stays attached after this process exits.
+// Returns the loaded object or NULL on error.
+struct bpf_object *load_bpf_and_xdp_replace(const struct config *cfg, const char *pin_dir);
+
+// Detach the program of the instance in obj (started without -p) and remove
+// its pins, unless a persistent instance has replaced the program meanwhile.
+void xdp_detach_instance(const struct config *cfg, struct bpf_object *obj, const char *pin_dir);
+
+// Detach the program of a persistent instance and remove its pinned maps.
+int xdp_unload_persistent(const struct config *cfg, const char *pin_dir);
+
+// Pin the stage programs of the pipeline, replacing the pins of a previous version.
+// Returns 0 on success.
+int pipeline_pin_programs(struct bpf_object *obj, const char *ifname);
+
+void pipeline_unpin_programs(const char *ifname);
+
+// Fill the program array of the pipeline with the stages that are active for
+// the current configuration, and remove all others.
+int pipeline_sync(const char *ifname);
+
+// Subcommand "blocklist": add, remove or bulk-load blocked MAC addresses.
+int do_blocklist(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "acl": load ACL rules from a file or print per-rule counters.
+int do_acl(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "psfp": load stream filters, gates, and meters from a file or print per-stream counters.
+int do_psfp(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "sketch": switch the count-min sketch on or off, report the heaviest flows, or reset it.
+int do_sketch(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "filter": compile pcap-filter expressions to filters, load them from a file,
+// or print per-filter counters.
+int do_filter(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "capture": write packets matching a pcap-filter expression to a pcapng file.
+int do_capture(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "pipeline": show the stages of the pipeline, or enable or disable a stage.
+int do_pipeline(const char *ifname, int argc, char *argv[]);
+
+// Subcommand "metrics": serve the counters of one or more devices in Prometheus format.
+int do_metrics(int argc, char *argv[]);
+
+#endif
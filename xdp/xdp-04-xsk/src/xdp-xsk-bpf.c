@@ -1,33 +1,265 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <linux/bpf.h>
-//#include <linux/if_ether.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 //#include <linux/types.h>
 
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "xdp-xsk-commons.h"
+
+// Timestamp of the packet taken by the NIC (Linux 6.3). The verifier only
+// accepts the call in a program bound to the device (cf. xdp_prog_hw_ts).
+// Drivers without support return -EOPNOTSUPP, and -ENODATA for packets
+// without timestamp.
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx, uint64_t *timestamp) __ksym __weak;
+
+// Older libbpf versions lack this macro. The address of a missing weak kfunc is 0.
+#ifndef bpf_ksym_exists
+#define bpf_ksym_exists(sym) (!!(sym))
+#endif
+
+// Maximum number of stacked VLAN tags (802.1Q and 802.1ad) that are parsed.
+#define VLAN_MAX_DEPTH 2
+
+#ifndef ETH_P_1588
+#define ETH_P_1588 0x88f7
+#endif
+
+// The VLAN header is not part of the UAPI headers.
+struct vlan_hdr {
+	__be16 h_vlan_TCI;
+	__be16 h_vlan_encapsulated_proto;
+};
+
+// Input of the flow hash: addresses (IPv4 in the first 4 bytes), L4 protocol, and ports.
+struct flow_key {
+	uint8_t saddr[16];
+	uint8_t daddr[16];
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t proto;
+};
 
 // This map is required by an XSK program to indicate, which RX queues should be redirected
-// to an XSK (socket of type AF_XDP bound by the application). 
+// to an XSK (socket of type AF_XDP bound by the application).
 struct {
-	__uint(type, BPF_MAP_TYPE_ARRAY);
-	__uint(max_entries, 64); // assume there are at maximum this number of RX queues for a network device
-	__type(key, sizeof(uint32_t)); 
-	__type(value, sizeof(uint32_t));
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__uint(max_entries, MAX_RX_QUEUES); // assume there are at maximum this number of RX queues for a network device
+	__type(key, uint32_t);
+	__type(value, uint32_t); // file descriptor of the XSK
 } xsk_map SEC(".maps");
 
+// Per-RX-queue statistics (cf. struct queue_stats).
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, MAX_RX_QUEUES);
+	__type(key, uint32_t);
+	__type(value, struct queue_stats);
+} xdp_queue_stats_map SEC(".maps");
 
-SEC("xdp-xsk")
-int xdp_prog_main(struct xdp_md *ctx)
+// Hash of a flow (MurmurHash3 mixing, as in the count-min sketch of
+// xdp-drop_and_count). 0 marks packets without flow, so it is never returned.
+static __always_inline uint32_t flow_hash(const struct flow_key *key)
+{
+	const uint32_t *words = (const uint32_t *) key;
+	uint32_t h = 0;
+
+	for (unsigned int i = 0; i < sizeof(*key)/sizeof(uint32_t); i++) {
+		uint32_t k = words[i]*0xcc9e2d51;
+		k = (k << 15) | (k >> 17);
+		h ^= k*0x1b873593;
+		h = (h << 13) | (h >> 19);
+		h = h*5 + 0xe6546b64;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h != 0 ? h : 1;
+}
+
+// Parse Ethernet, VLAN, IPv4/IPv6, and TCP/UDP/SCTP headers into meta (all
+// fields but the timestamp and the magic). IPv6 extension headers are not
+// parsed, i.e., l4_proto is the next header of the IPv6 header.
+static __always_inline void parse_headers(void *hdr, void *endptr, struct xsk_rx_meta *meta)
+{
+	struct ethhdr *eth_hdr = hdr;
+	void *pos = hdr + sizeof(struct ethhdr);
+	struct flow_key key = {};
+
+	meta->class_id = XSK_CLASS_OTHER;
+	// Bounds check
+	if (pos > endptr)
+		goto truncated;
+
+	__be16 proto = eth_hdr->h_proto;
+	for (int i = 0; i < VLAN_MAX_DEPTH; i++) {
+		if (proto != bpf_htons(ETH_P_8021Q) && proto != bpf_htons(ETH_P_8021AD))
+			break;
+
+		struct vlan_hdr *vlan_hdr = pos;
+		if (pos + sizeof(struct vlan_hdr) > endptr)
+			goto truncated;
+		if (i == 0) {
+			meta->vlan_tci = bpf_ntohs(vlan_hdr->h_vlan_TCI);
+			meta->flags |= XSK_META_VLAN;
+		}
+		proto = vlan_hdr->h_vlan_encapsulated_proto;
+		pos += sizeof(struct vlan_hdr);
+	}
+	meta->proto = bpf_ntohs(proto);
+	meta->l3_offset = pos - hdr;
+
+	int is_fragment = 0;
+	if (proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr *ip_hdr = pos;
+		if (pos + sizeof(struct iphdr) > endptr || ip_hdr->ihl < 5)
+			goto truncated;
+		__builtin_memcpy(key.saddr, &ip_hdr->saddr, 4);
+		__builtin_memcpy(key.daddr, &ip_hdr->daddr, 4);
+		meta->l4_proto = ip_hdr->protocol;
+		// Only the first fragment contains the L4 header.
+		is_fragment = (ip_hdr->frag_off & bpf_htons(0x1fff)) != 0;
+		pos += ip_hdr->ihl*4;
+	} else if (proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr *ip6_hdr = pos;
+		if (pos + sizeof(struct ipv6hdr) > endptr)
+			goto truncated;
+		__builtin_memcpy(key.saddr, &ip6_hdr->saddr, 16);
+		__builtin_memcpy(key.daddr, &ip6_hdr->daddr, 16);
+		meta->l4_proto = ip6_hdr->nexthdr;
+		pos += sizeof(struct ipv6hdr);
+	} else {
+		if (proto == bpf_htons(ETH_P_ARP))
+			meta->class_id = XSK_CLASS_ARP;
+		else if (proto == bpf_htons(ETH_P_1588))
+			meta->class_id = XSK_CLASS_PTP;
+		return; // no IP packet
+	}
+
+	if (!is_fragment) {
+		meta->l4_offset = pos - hdr;
+		if (meta->l4_proto == IPPROTO_TCP || meta->l4_proto == IPPROTO_UDP ||
+		    meta->l4_proto == IPPROTO_SCTP) {
+			// Source and destination port are the first two fields of all these protocols.
+			__be16 *ports = pos;
+			if (pos + 2*sizeof(__be16) > endptr)
+				goto truncated;
+			meta->sport = bpf_ntohs(ports[0]);
+			meta->dport = bpf_ntohs(ports[1]);
+			meta->flags |= XSK_META_PORTS;
+			key.sport = meta->sport;
+			key.dport = meta->dport;
+		}
+	}
+	key.proto = meta->l4_proto;
+	meta->flow_hash = flow_hash(&key);
+
+	if (meta->l4_proto == IPPROTO_ICMP || meta->l4_proto == IPPROTO_ICMPV6)
+		meta->class_id = XSK_CLASS_ICMP;
+	else if (meta->l4_proto == IPPROTO_TCP)
+		meta->class_id = XSK_CLASS_TCP;
+	else if (meta->l4_proto == IPPROTO_UDP)
+		meta->class_id = (meta->flags & XSK_META_PORTS) && meta->dport == GEN_DST_PORT ?
+				 XSK_CLASS_GEN : XSK_CLASS_UDP;
+	return;
+
+truncated:
+	meta->flags |= XSK_META_TRUNCATED;
+}
+
+// Store the arrival time of the packet and the parsed headers in front of
+// it. On error, the packet is redirected without metadata.
+static __always_inline void store_rx_meta(struct xdp_md *ctx, bool hw_timestamp)
+{
+	// Parse into the stack first: adjusting the metadata invalidates all
+	// packet pointers.
+	struct xsk_rx_meta parsed = {};
+	parse_headers((void *)(long) ctx->data, (void *)(long) ctx->data_end, &parsed);
+
+	if (bpf_xdp_adjust_meta(ctx, -(int) sizeof(struct xsk_rx_meta)) != 0)
+		return;
+
+	void *data = (void *)(long) ctx->data;
+	struct xsk_rx_meta *meta = (void *)(long) ctx->data_meta;
+	if ((void *) (meta + 1) > data)
+		return;
+
+	*meta = parsed;
+	if (hw_timestamp && bpf_ksym_exists(bpf_xdp_metadata_rx_timestamp) &&
+	    bpf_xdp_metadata_rx_timestamp(ctx, &meta->rx_timestamp) == 0)
+		meta->flags |= XSK_META_HW_TIMESTAMP;
+	else
+		meta->rx_timestamp = bpf_ktime_get_tai_ns();
+	meta->magic = XSK_META_MAGIC;
+}
+
+// Unlike xdp-drop_and_count, the program is not split into tail-called stages.
+// xdp_prog_hw_ts must be bound to the device to call the kfunc, and the kernel
+// does not accept device-bound programs in program arrays, so parsing cannot
+// run in a separate stage there. Parsing a packet costs about as much as a
+// tail call, so splitting only xdp_prog_main would gain nothing, but would
+// make the two programs behave differently.
+static __always_inline int redirect_to_xsk(struct xdp_md *ctx, bool hw_timestamp)
 {
 	int index = ctx->rx_queue_index;
-	
+	int action = XDP_PASS; // no XSK bound for this RX queue -> pass on packet to network stack
+
+	// NULL if the queue index exceeds MAX_RX_QUEUES.
+	struct queue_stats *stats = bpf_map_lookup_elem(&xdp_queue_stats_map, &index);
+
 	// Check whether an XSK (socket of type AF_XDP) has been bound to RX queue of the device
 	// from which the current packet has been received.
-	if (bpf_map_lookup_elem(&xsk_map, &index))
-		return bpf_redirect_map(&xsk_map, index, 0);
+	if (bpf_map_lookup_elem(&xsk_map, &index)) {
+		store_rx_meta(ctx, hw_timestamp);
+		action = bpf_redirect_map(&xsk_map, index, 0);
+	}
+
+	if (stats != NULL) {
+		stats->rx_packets++;
+		stats->rx_bytes += ctx->data_end - ctx->data;
+		if (action == XDP_REDIRECT)
+			stats->redirected_packets++;
+		else if (action == XDP_PASS)
+			stats->passed_packets++;
+		else
+			stats->dropped_packets++; // XDP_ABORTED: socket closed meanwhile
+	}
 
-	// No XSK bound for this RX queue -> pass on packet to network stack
+	return action;
+}
+
+SEC("xdp-xsk")
+int xdp_prog_main(struct xdp_md *ctx)
+{
+	return redirect_to_xsk(ctx, false);
+}
+
+// Same as xdp_prog_main, but with the timestamps of the NIC. User space loads
+// this program bound to the device if the kernel supports it.
+SEC("xdp-xsk-hw-ts")
+int xdp_prog_hw_ts(struct xdp_md *ctx)
+{
+	return redirect_to_xsk(ctx, true);
+}
+
+// Only for xdp-bench: BPF_PROG_TEST_RUN cannot redirect to an XSK, so
+// xdp_prog_main takes the XDP_PASS path there. This program runs the work
+// done before the redirect (parsing, flow hash, and metadata) instead. User
+// space never loads it.
+SEC("xdp-xsk-bench")
+int xdp_prog_meta(struct xdp_md *ctx)
+{
+	store_rx_meta(ctx, false);
 	return XDP_PASS;
 }
 
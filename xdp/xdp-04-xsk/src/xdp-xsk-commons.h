@@ -0,0 +1,63 @@
+#ifndef XSK_COMMONS_H
+#define XSK_COMMONS_H
+
+// Maximum number of RX queues of a network device, i.e., entries of xsk_map
+// and xdp_queue_stats_map.
+#define MAX_RX_QUEUES 64
+
+// Per-RX-queue counters (index is ctx->rx_queue_index). The map is a per-CPU
+// array, since several CPUs might serve the same queue. User space sums up the
+// values of all CPUs, and compares the queues to see how evenly RSS spreads the load.
+struct queue_stats {
+	uint64_t rx_packets; // packets received from this queue
+	uint64_t rx_bytes; // bytes received from this queue
+	uint64_t redirected_packets; // packets redirected to the XSK bound to this queue
+	uint64_t passed_packets; // packets passed to the network stack (no XSK bound)
+	uint64_t dropped_packets; // packets dropped since the redirect failed
+};
+
+// Metadata the BPF program stores in front of a packet redirected to an XSK
+// (cf. bpf_xdp_adjust_meta): the arrival time, and the result of parsing the
+// headers, so user space can dispatch the packet without reading it. User
+// space finds the metadata right before the packet data in the UMEM frame, in
+// copy mode as well as in zero-copy mode. Its size must be a multiple of 4
+// bytes, and at most 32 bytes.
+struct xsk_rx_meta {
+	uint64_t rx_timestamp; // arrival time in nano-seconds
+	uint32_t flow_hash; // hash of addresses, L4 protocol, and ports (0: no IP packet)
+	uint16_t l3_offset; // offset of the network header from the start of the packet
+	uint16_t l4_offset; // offset of the transport header (0: none or not parsed)
+	uint16_t proto; // EtherType after the VLAN tags (host byte order)
+	uint16_t vlan_tci; // TCI of the outermost VLAN tag (host byte order), if XSK_META_VLAN
+	uint8_t l4_proto; // IP protocol (IPv6: next header of the fixed header)
+	uint8_t class_id; // XSK_CLASS_*
+	uint16_t flags; // XSK_META_*
+	uint16_t sport; // L4 ports (host byte order), if XSK_META_PORTS
+	uint16_t dport;
+	uint32_t magic; // XSK_META_MAGIC, unless the driver does not support metadata
+};
+
+#define XSK_META_MAGIC 0x58534b4d // "XSKM"
+
+// rx_timestamp was taken by the NIC, in the time of its PTP hardware clock
+// (TAI if synchronized by ptp4l). Otherwise, it is CLOCK_TAI at the XDP hook.
+#define XSK_META_HW_TIMESTAMP (1 << 0)
+#define XSK_META_VLAN (1 << 1) // the packet has a VLAN tag (PCP: vlan_tci >> 13)
+#define XSK_META_PORTS (1 << 2) // TCP, UDP, or SCTP header (not for later fragments)
+#define XSK_META_TRUNCATED (1 << 3) // headers end beyond the packet, parsed up to there
+
+// Classes of packets (class_id) for the dispatching in user space.
+enum xsk_class {
+	XSK_CLASS_OTHER,
+	XSK_CLASS_ARP,
+	XSK_CLASS_PTP, // IEEE 1588 over Ethernet
+	XSK_CLASS_ICMP, // ICMP or ICMPv6
+	XSK_CLASS_TCP,
+	XSK_CLASS_UDP,
+	XSK_CLASS_GEN, // UDP frames of the generator of xdp-xsk-user (cf. GEN_DST_PORT)
+};
+
+// Destination UDP port of the generated frames (discard).
+#define GEN_DST_PORT 9
+
+#endif
@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include <linux/if_ether.h>
+
+#include <bpf/xsk.h>
+
+#include "xdp-xsk-user.h"
+
+// Maximum number of packets moved from the RX ring to the TX ring at once.
+#define FWD_BATCH_SIZE 64
+
+// Swap source and destination MAC address, so the frame goes back to its sender.
+static void swap_macs(uint8_t *frame)
+{
+	uint8_t tmp[ETH_ALEN];
+
+	memcpy(tmp, frame, ETH_ALEN);
+	memcpy(frame, frame + ETH_ALEN, ETH_ALEN);
+	memcpy(frame + ETH_ALEN, tmp, ETH_ALEN);
+}
+
+// A frame cycles through four rings: the fill ring of xsk gives it to the
+// driver, the RX ring of xsk hands it over with a packet, the TX ring of out
+// gives it back to the driver, and the completion ring of out returns it once
+// sent. From there, it goes to the frame cache of xsk, which refills the fill
+// ring. The frames are never copied; both sockets share the UMEM.
+void forward_pkts(struct xsk_socket_info *xsk, struct xsk_socket_info *out)
+{
+	uint32_t idx_rx = 0, idx_tx = 0;
+
+	// Reclaim the frames of sent packets first, so the fill ring does not run dry.
+	xsk_complete_tx(out, xsk);
+
+	uint32_t rcvd = xsk_ring_cons__peek(&xsk->rx, FWD_BATCH_SIZE, &idx_rx);
+	xsk_record_batch(xsk->stats.rx_batches, rcvd);
+	if (rcvd > 0) {
+		// Packets that do not fit into the TX ring stay in the RX ring
+		// as a whole: the batch is trimmed to the last descriptor that
+		// ends a packet. If the RX ring fills up, the kernel drops
+		// packets (rx_ring_full). The kernel only sends complete
+		// packets, so the fragments of a packet that continues beyond
+		// the batch wait in the TX ring for the next batch.
+		uint32_t nfree = xsk_prod_nb_free(&out->tx, rcvd);
+		if (nfree < rcvd) {
+			uint32_t keep = 0;
+			for (uint32_t i = 0; i < nfree; i++) {
+				if (!(xsk_ring_cons__rx_desc(&xsk->rx, idx_rx + i)->options & XDP_PKT_CONTD))
+					keep = i + 1;
+			}
+			xsk_ring_cons__cancel(&xsk->rx, rcvd - keep);
+			rcvd = keep;
+		}
+		xsk_record_batch(xsk->stats.tx_batches, rcvd);
+	}
+	if (rcvd == 0) {
+		// Nothing to forward, but the kernel might wait for a kick to
+		// send the frames in the TX ring.
+		if (out->outstanding_tx > 0 && xsk_tx_needs_kick(out))
+			xsk_kick_tx(out);
+		return;
+	}
+
+	// Before we go on, replenish fill ring with new frames so kernel can go receiving.
+	replenish_fill_ring(xsk);
+
+	xsk_ring_prod__reserve(&out->tx, rcvd, &idx_tx);
+	uint64_t bytes = 0;
+	uint32_t npkts = 0;
+
+	for (uint32_t i = 0; i < rcvd; i++) {
+		const struct xdp_desc *rx_desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+		bytes += rx_desc->len;
+
+		// Only the first fragment of a packet has the Ethernet header.
+		if (out == xsk && xsk->rx_pkt.nfrags == 0)
+			swap_macs(xsk_pkt_data(xsk->umem, rx_desc->addr));
+		// The address still points to the packet after the headroom
+		// (in the unaligned mode, by the offset in its upper bits).
+		struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&out->tx, idx_tx++);
+		tx_desc->addr = rx_desc->addr;
+		tx_desc->len = rx_desc->len;
+		tx_desc->options = rx_desc->options & XDP_PKT_CONTD;
+
+		if (rx_desc->options & XDP_PKT_CONTD) {
+			xsk->rx_pkt.nfrags++;
+		} else {
+			xsk->rx_pkt.nfrags = 0;
+			npkts++;
+		}
+	}
+
+	// Move RX pointer in RX ring after the processed packets.
+	xsk_ring_cons__release(&xsk->rx, rcvd);
+	xsk_ring_prod__submit(&out->tx, rcvd);
+	out->outstanding_tx += rcvd;
+	if (xsk_tx_needs_kick(out))
+		xsk_kick_tx(out);
+
+	// Read by the statistics output of the main thread. The packets
+	// forwarded by a worker are counted at its input socket.
+	__atomic_store_n(&xsk->stats.rx_packets, xsk->stats.rx_packets + npkts, __ATOMIC_RELAXED);
+	__atomic_store_n(&xsk->stats.rx_bytes, xsk->stats.rx_bytes + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&xsk->stats.tx_packets, xsk->stats.tx_packets + npkts, __ATOMIC_RELAXED);
+	__atomic_store_n(&xsk->stats.tx_bytes, xsk->stats.tx_bytes + bytes, __ATOMIC_RELAXED);
+}
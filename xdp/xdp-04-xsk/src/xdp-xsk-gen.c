@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include <bpf/xsk.h>
+
+#include "xdp-xsk-commons.h"
+#include "xdp-xsk-user.h"
+
+// Addresses of the generated frames (benchmarking range of RFC 2544).
+#define GEN_SRC_IP 0xc6120001 // 198.18.0.1
+#define GEN_DST_IP 0xc6120002 // 198.18.0.2
+// The source port is this base plus the queue of the socket, so every socket
+// sends its own flow, which receivers can spread over their queues with RSS.
+#define GEN_SRC_PORT_BASE 1024
+
+// Maximum number of frames submitted to the TX ring at once.
+#define TX_BATCH_SIZE 64
+
+// If rate limited, the generator sleeps instead of spinning if the next frame
+// is due in more than this number of nano-seconds.
+#define GEN_MIN_SLEEP_NS 100000
+
+// Time to wait for outstanding frames on exit in nano-seconds.
+#define GEN_DRAIN_NS 1000000000ULL
+
+int gen_init_config(struct gen_config *gen, const char *ifname)
+{
+	struct ifreq ifr;
+
+	memset(gen, 0, sizeof(*gen));
+	memset(gen->dst_mac, 0xff, ETH_ALEN);
+	gen->frame_len = GEN_DEFAULT_FRAME_LEN;
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IF_NAMESIZE - 1);
+	int err = ioctl(fd, SIOCGIFHWADDR, &ifr);
+	close(fd);
+	if (err != 0)
+		return -1;
+	memcpy(gen->src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	return 0;
+}
+
+int gen_parse_payload(const void *frame, uint32_t len, struct gen_payload *payload)
+{
+	const struct ethhdr *eth = frame;
+	const struct iphdr *ip = (const struct iphdr *) (eth + 1);
+	const struct udphdr *udp = (const struct udphdr *) (ip + 1);
+
+	if (len < GEN_MIN_FRAME_LEN || eth->h_proto != htons(ETH_P_IP) ||
+	    ip->ihl != sizeof(*ip)/4 || ip->protocol != IPPROTO_UDP || udp->dest != htons(GEN_DST_PORT))
+		return -1;
+
+	memcpy(payload, (const uint8_t *) frame + GEN_HEADERS_LEN, sizeof(*payload));
+	payload->seq = be64toh(payload->seq);
+	payload->timestamp = be64toh(payload->timestamp);
+	return 0;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return now.tv_sec*1000000000ULL + now.tv_nsec;
+}
+
+static uint16_t ip_checksum(const void *hdr, size_t len)
+{
+	const uint16_t *words = hdr;
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < len/2; i++)
+		sum += words[i];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+// Write the template of the frames. The payload is patched for every frame.
+static void build_template(uint8_t *frame, const struct gen_config *gen, uint32_t queue)
+{
+	struct ethhdr *eth = (struct ethhdr *) frame;
+	struct iphdr *ip = (struct iphdr *) (eth + 1);
+	struct udphdr *udp = (struct udphdr *) (ip + 1);
+
+	memset(frame, 0, gen->frame_len);
+
+	memcpy(eth->h_dest, gen->dst_mac, ETH_ALEN);
+	memcpy(eth->h_source, gen->src_mac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	ip->version = 4;
+	ip->ihl = sizeof(*ip)/4;
+	ip->tot_len = htons(gen->frame_len - sizeof(*eth));
+	ip->frag_off = htons(0x4000); // don't fragment
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = htonl(GEN_SRC_IP);
+	ip->daddr = htonl(GEN_DST_IP);
+	// The IP header is the same for all frames, so the checksum is computed once.
+	ip->check = ip_checksum(ip, sizeof(*ip));
+
+	udp->source = htons(GEN_SRC_PORT_BASE + queue);
+	udp->dest = htons(GEN_DST_PORT);
+	udp->len = htons(gen->frame_len - sizeof(*eth) - sizeof(*ip));
+	udp->check = 0; // no checksum (optional for IPv4), since the payload changes
+}
+
+// Number of frames that may be sent now without exceeding the rate.
+static uint64_t frames_due(const struct gen_config *gen, uint64_t start, uint64_t sent)
+{
+	uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+	uint64_t due = (uint64_t) ((double) elapsed*gen->rate/1e9);
+	if (due > sent)
+		return due - sent;
+
+	// Sleep until the next frame is due if that takes long enough.
+	double wait = (sent + 1)*1e9/gen->rate - elapsed;
+	if (wait >= GEN_MIN_SLEEP_NS) {
+		struct timespec t = { .tv_sec = wait/1e9, .tv_nsec = (uint64_t) wait%1000000000ULL };
+		nanosleep(&t, NULL);
+	}
+	return 0;
+}
+
+void generate_pkts(struct xsk_socket_info *xsk, const struct gen_config *gen)
+{
+	uint64_t sent = 0;
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	uint64_t addrs[TX_BATCH_SIZE];
+	uint8_t template[GEN_MAX_FRAME_LEN];
+
+	build_template(template, gen, xsk->queue);
+
+	while (!do_exit && (gen->count == 0 || sent < gen->count)) {
+		xsk_complete_tx(xsk, xsk);
+
+		uint64_t batch = TX_BATCH_SIZE;
+		if (gen->count > 0 && batch > gen->count - sent)
+			batch = gen->count - sent;
+		if (gen->rate > 0 && batch > 0) {
+			uint64_t due = frames_due(gen, start, sent);
+			if (batch > due)
+				batch = due;
+		}
+
+		uint32_t nframes = 0;
+		while (nframes < batch && (addrs[nframes] = xsk_alloc_umem_frame(xsk)) != INVALID_UMEM_FRAME)
+			nframes++;
+
+		uint32_t idx_tx = 0;
+		uint32_t nreserved = nframes > 0 ? xsk_ring_prod__reserve(&xsk->tx, nframes, &idx_tx) : 0;
+		if (nreserved == 0) {
+			if (nframes > 0)
+				xsk_record_batch(xsk->stats.tx_batches, 0);
+			for (uint32_t i = 0; i < nframes; i++)
+				xsk_free_umem_frame(xsk, addrs[i]);
+			// All frames are in flight (or the TX ring is full), so the
+			// kernel might wait for a kick to send them.
+			if (xsk->outstanding_tx > 0 && xsk_tx_needs_kick(xsk))
+				xsk_kick_tx(xsk);
+			continue;
+		}
+
+		// One timestamp per batch: the frames of a batch are sent back-to-back.
+		struct gen_payload payload = { .timestamp = htobe64(clock_ns(CLOCK_TAI)) };
+		for (uint32_t i = 0; i < nreserved; i++) {
+			uint8_t *frame = xsk_umem__get_data(xsk->umem->buffer, addrs[i]);
+			// The frames keep the template between sends, so only the
+			// payload is patched. The template is written when this
+			// socket uses a frame first, i.e., the frame is still empty
+			// or was sent by another socket of a shared UMEM before
+			// (with another source port).
+			if (memcmp(frame, template, GEN_HEADERS_LEN) != 0)
+				memcpy(frame, template, gen->frame_len);
+			payload.seq = htobe64(sent + i);
+			memcpy(frame + GEN_HEADERS_LEN, &payload, sizeof(payload));
+
+			struct xdp_desc *desc = xsk_ring_prod__tx_desc(&xsk->tx, idx_tx++);
+			desc->addr = addrs[i];
+			desc->len = gen->frame_len;
+		}
+		xsk_ring_prod__submit(&xsk->tx, nreserved);
+		xsk->outstanding_tx += nreserved;
+		sent += nreserved;
+		xsk_record_batch(xsk->stats.tx_batches, nreserved);
+
+		if (xsk_tx_needs_kick(xsk))
+			xsk_kick_tx(xsk);
+
+		// Read by the statistics output of the main thread.
+		__atomic_store_n(&xsk->stats.tx_packets, sent, __ATOMIC_RELAXED);
+		__atomic_store_n(&xsk->stats.tx_bytes, sent*gen->frame_len, __ATOMIC_RELAXED);
+	}
+
+	// Wait until the outstanding frames are sent, so none is lost when the
+	// socket is closed.
+	uint64_t deadline = clock_ns(CLOCK_MONOTONIC) + GEN_DRAIN_NS;
+	while (xsk->outstanding_tx > 0 && clock_ns(CLOCK_MONOTONIC) < deadline) {
+		if (xsk_tx_needs_kick(xsk))
+			xsk_kick_tx(xsk);
+		xsk_complete_tx(xsk, xsk);
+	}
+}
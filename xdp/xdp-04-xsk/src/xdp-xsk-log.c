@@ -0,0 +1,165 @@
+#define _GNU_SOURCE // SCHED_IDLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "xdp-xsk-commons.h"
+#include "xdp-xsk-user.h"
+
+// Time the logger sleeps if all rings are empty in nano-seconds.
+#define LOGGER_IDLE_NS 10000000
+
+// Maximum number of records taken from one ring at once, so a busy queue
+// cannot starve the others.
+#define LOGGER_BATCH_SIZE 256
+
+struct log_ring *log_ring_create(void)
+{
+	void *ring;
+
+	if (posix_memalign(&ring, CACHE_LINE_SIZE, sizeof(struct log_ring)) != 0)
+		return NULL;
+	memset(ring, 0, sizeof(struct log_ring));
+
+	return ring;
+}
+
+void log_ring_free(struct log_ring *ring)
+{
+	free(ring);
+}
+
+// Take the next record from the ring. Returns false if the ring is empty.
+static bool log_ring_pop(struct log_ring *ring, struct log_record *record)
+{
+	uint32_t tail = ring->tail;
+
+	if (tail == ring->cached_head) {
+		ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail == ring->cached_head)
+			return false;
+	}
+
+	*record = ring->records[tail & (LOG_RING_SIZE - 1)];
+	// Hand the slot back to the producer after it is read.
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void print_mac(const unsigned char *addr)
+{
+	for (size_t i = 0; i < ETH_ALEN; i++) {
+		printf("%02x", addr[i]);
+		if (i+1 != ETH_ALEN)
+			printf(":");
+	}
+}
+
+static void print_record(const struct log_record *record)
+{
+	printf("Queue %u: received packet from ", record->queue);
+	print_mac(record->src_mac);
+	printf(" to ");
+	print_mac(record->dst_mac);
+	printf(", ethertype 0x%04x, %u bytes", record->proto, record->len);
+	if (record->rx_timestamp != 0)
+		printf(", arrived at %lu.%09lu (%s)", record->rx_timestamp/1000000000,
+		       record->rx_timestamp % 1000000000,
+		       (record->meta_flags & XSK_META_HW_TIMESTAMP) ? "NIC" : "TAI");
+	printf("\n");
+}
+
+// State of the rate limit: lines printed and records suppressed in the
+// current second, and records dropped by the producers so far.
+struct logger_state {
+	time_t second;
+	unsigned int printed;
+	uint64_t suppressed;
+	uint64_t dropped;
+};
+
+// Report records that were not printed in the last second.
+static void report_losses(struct logger *logger, struct logger_state *state)
+{
+	uint64_t dropped = 0;
+	for (int i = 0; i < logger->nrings; i++)
+		dropped += __atomic_load_n(&logger->rings[i]->dropped, __ATOMIC_RELAXED);
+
+	if (state->suppressed > 0 || dropped > state->dropped)
+		printf("Logger: %lu records suppressed (rate limit %u/s), %lu dropped (ring full)\n",
+		       state->suppressed, logger->rate, dropped - state->dropped);
+	state->suppressed = 0;
+	state->dropped = dropped;
+}
+
+// Drain up to LOGGER_BATCH_SIZE records of every ring. Returns the number of records.
+static unsigned int logger_drain(struct logger *logger, struct logger_state *state)
+{
+	unsigned int nrecords = 0;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec != state->second) {
+		report_losses(logger, state);
+		state->second = now.tv_sec;
+		state->printed = 0;
+	}
+
+	for (int i = 0; i < logger->nrings; i++) {
+		struct log_record record;
+		for (int n = 0; n < LOGGER_BATCH_SIZE && log_ring_pop(logger->rings[i], &record); n++) {
+			nrecords++;
+			if (state->printed >= logger->rate) {
+				state->suppressed++;
+				continue;
+			}
+			print_record(&record);
+			state->printed++;
+		}
+	}
+	if (nrecords > 0)
+		fflush(stdout);
+
+	return nrecords;
+}
+
+static void *logger_main(void *arg)
+{
+	struct logger *logger = arg;
+	struct logger_state state = { 0 };
+	struct sched_param param = { .sched_priority = 0 };
+
+	// Formatting is not time-critical; the socket threads have priority.
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	while (!__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)) {
+		if (logger_drain(logger, &state) == 0) {
+			struct timespec idle = { .tv_nsec = LOGGER_IDLE_NS };
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	// The producers are stopped, so the rings are drained completely.
+	while (logger_drain(logger, &state) > 0)
+		;
+	report_losses(logger, &state);
+	fflush(stdout);
+
+	return NULL;
+}
+
+int logger_start(struct logger *logger)
+{
+	logger->stop = false;
+	return pthread_create(&logger->thread, NULL, logger_main, logger);
+}
+
+void logger_stop(struct logger *logger)
+{
+	__atomic_store_n(&logger->stop, true, __ATOMIC_RELEASE);
+	pthread_join(logger->thread, NULL);
+}
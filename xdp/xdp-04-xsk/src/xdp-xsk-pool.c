@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xdp-xsk-user.h"
+
+// The pool is a bounded multi-producer multi-consumer queue of batches of
+// frames (cf. D. Vyukov's bounded MPMC queue): a producer or consumer claims a
+// cell by advancing enqueue_pos or dequeue_pos with a CAS, and then hands the
+// cell over by its sequence number. There are twice as many cells as batches
+// of frames in the UMEM, so a batch returned to the pool finds a free cell,
+// unless a consumer stalls while copying a batch out of its cell.
+
+#ifdef XSK_POOL_DEBUG
+enum frame_state {
+	FRAME_FREE, // in the pool or a cache
+	FRAME_USED, // handed out to a ring or the application
+};
+#endif
+
+// Take a batch from the pool. Returns false if the pool is empty.
+static bool pool_get(struct frame_pool *pool, uint64_t *frames)
+{
+	uint64_t pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+	struct pool_cell *cell;
+
+	for (;;) {
+		cell = &pool->cells[pos & pool->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) seq - (int64_t) (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&pool->dequeue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false; // no batch in the cell yet
+		} else {
+			// Another consumer took the cell.
+			pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(frames, cell->frames, sizeof(cell->frames));
+	// The cell is free for the producer of the next round.
+	__atomic_store_n(&cell->seq, pos + pool->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Return a batch to the pool.
+static void pool_put(struct frame_pool *pool, const uint64_t *frames)
+{
+	uint64_t pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+	struct pool_cell *cell;
+
+	for (;;) {
+		cell = &pool->cells[pos & pool->mask];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t) seq - (int64_t) pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&pool->enqueue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else {
+			// Another producer took the cell (diff > 0), or a consumer
+			// is still copying the batch of the previous round out of
+			// it (diff < 0). The pool itself is never full.
+			pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(cell->frames, frames, sizeof(cell->frames));
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Returns true if the frame at offset frame of the UMEM at buffer crosses a
+// boundary of pages of page_size bytes (0: frames may cross pages).
+static bool frame_crosses_page(const void *buffer, uint64_t frame, uint32_t frame_size,
+			       size_t page_size)
+{
+	if (page_size == 0)
+		return false;
+	uintptr_t start = (uintptr_t) buffer + frame;
+	return start/page_size != (start + frame_size - 1)/page_size;
+}
+
+struct frame_pool *frame_pool_create(uint64_t nframes, uint32_t frame_size, const void *buffer,
+				     uint64_t size, size_t page_size)
+{
+	if (nframes == 0 || nframes % POOL_BATCH_SIZE != 0)
+		return NULL;
+
+	// Count the frames up to the last one in the pool.
+	uint64_t nslots = 0;
+	for (uint64_t n = 0; n < nframes; nslots++) {
+		if ((nslots + 1)*frame_size > size)
+			return NULL; // the UMEM is too small
+		if (!frame_crosses_page(buffer, nslots*frame_size, frame_size, page_size))
+			n++;
+	}
+
+	struct frame_pool *pool;
+	if (posix_memalign((void **) &pool, CACHE_LINE_SIZE, sizeof(*pool)) != 0)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+
+	uint64_t ncells = 1;
+	while (ncells < 2*nframes/POOL_BATCH_SIZE)
+		ncells *= 2;
+	pool->mask = ncells - 1;
+	pool->nframes = nframes;
+	pool->nslots = nslots;
+	pool->frame_size = frame_size;
+	if (posix_memalign((void **) &pool->cells, CACHE_LINE_SIZE, ncells*sizeof(*pool->cells)) != 0) {
+		free(pool);
+		return NULL;
+	}
+#ifdef XSK_POOL_DEBUG
+	pool->frame_state = calloc(nslots, sizeof(*pool->frame_state));
+	if (pool->frame_state == NULL) {
+		free(pool->cells);
+		free(pool);
+		return NULL;
+	}
+#endif
+
+	for (uint64_t i = 0; i < ncells; i++)
+		pool->cells[i].seq = i;
+
+	// Initially, all frames are in the pool. In zero-copy mode, the kernel
+	// rejects chunks in the fill ring that cross into a page whose DMA address
+	// is not contiguous. It consumes them without ever returning them, so such
+	// frames are never handed out.
+	uint64_t batch[POOL_BATCH_SIZE];
+	int n = 0;
+	for (uint64_t i = 0; i < nslots; i++) {
+		if (frame_crosses_page(buffer, i*frame_size, frame_size, page_size))
+			continue;
+		batch[n++] = i*frame_size;
+		if (n == POOL_BATCH_SIZE) {
+			pool_put(pool, batch);
+			n = 0;
+		}
+	}
+
+	return pool;
+}
+
+void frame_pool_free(struct frame_pool *pool)
+{
+	if (pool == NULL)
+		return;
+#ifdef XSK_POOL_DEBUG
+	free(pool->frame_state);
+#endif
+	free(pool->cells);
+	free(pool);
+}
+
+bool frame_cache_refill(struct frame_cache *cache)
+{
+	if (!pool_get(cache->pool, &cache->frames[cache->nframes]))
+		return false;
+	cache->nframes += POOL_BATCH_SIZE;
+	return true;
+}
+
+void frame_cache_flush(struct frame_cache *cache)
+{
+	// Return the frames freed last; the others are more likely still cached by the CPU.
+	cache->nframes -= POOL_BATCH_SIZE;
+	pool_put(cache->pool, &cache->frames[cache->nframes]);
+}
+
+#ifdef XSK_POOL_DEBUG
+static uint64_t frame_index(struct frame_pool *pool, uint64_t frame)
+{
+	if (frame % pool->frame_size != 0 || frame/pool->frame_size >= pool->nslots) {
+		fprintf(stderr, "Frame pool: invalid frame address 0x%lx\n", frame);
+		abort();
+	}
+	return frame/pool->frame_size;
+}
+
+void frame_pool_debug_alloc(struct frame_pool *pool, uint64_t frame)
+{
+	uint8_t *state = &pool->frame_state[frame_index(pool, frame)];
+
+	if (__atomic_exchange_n(state, FRAME_USED, __ATOMIC_RELAXED) != FRAME_FREE) {
+		fprintf(stderr, "Frame pool: frame 0x%lx handed out twice\n", frame);
+		abort();
+	}
+}
+
+void frame_pool_debug_free(struct frame_pool *pool, uint64_t frame)
+{
+	uint8_t *state = &pool->frame_state[frame_index(pool, frame)];
+
+	if (__atomic_exchange_n(state, FRAME_FREE, __ATOMIC_RELAXED) != FRAME_USED) {
+		fprintf(stderr, "Frame pool: frame 0x%lx freed twice\n", frame);
+		abort();
+	}
+}
+#endif
+
+void frame_pool_check(struct frame_pool *pool, struct frame_cache **caches, int ncaches)
+{
+	uint64_t free_frames = (pool->enqueue_pos - pool->dequeue_pos)*POOL_BATCH_SIZE;
+	for (int i = 0; i < ncaches; i++) {
+		if (caches[i]->pool == pool)
+			free_frames += caches[i]->nframes;
+	}
+
+#ifdef XSK_POOL_DEBUG
+	uint64_t used = 0;
+	for (uint64_t i = 0; i < pool->nslots; i++)
+		used += pool->frame_state[i] == FRAME_USED;
+	if (free_frames + used != pool->nframes)
+		fprintf(stderr, "Frame pool: %lu frames free, %lu in use, %lu lost\n",
+			free_frames, used, pool->nframes - free_frames - used);
+#endif
+	if (free_frames > pool->nframes)
+		fprintf(stderr, "Frame pool: %lu frames free, but only %lu exist\n",
+			free_frames, pool->nframes);
+	else
+		printf("Frame pool: %lu of %lu frames free, the others in the rings or the driver\n",
+		       free_frames, pool->nframes);
+}
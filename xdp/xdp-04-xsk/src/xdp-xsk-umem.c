@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/mman.h>
+#include <linux/mempolicy.h>
+
+#include "xdp-xsk-user.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_PAGE_1G (1UL << 30)
+
+// Page sizes tried in this order. 1 GiB pages are only used for regions of at
+// least this size, since the whole page is allocated.
+static const struct {
+	size_t size;
+	int flags;
+} page_sizes[] = {
+	{ HUGE_PAGE_1G, MAP_HUGETLB | MAP_HUGE_1GB },
+	{ HUGE_PAGE_2M, MAP_HUGETLB | MAP_HUGE_2MB },
+	{ 0, 0 }, // base pages
+};
+
+// NUMA node of the device, or -1 if unknown (e.g., virtual devices and
+// single-node systems).
+static int device_numa_node(const char *ifname)
+{
+	char path[PATH_MAX];
+	int node = -1;
+
+	int n = snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifname);
+	if (n < 0 || (size_t) n >= sizeof(path))
+		return -1;
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+	if (fscanf(file, "%d", &node) != 1)
+		node = -1;
+	fclose(file);
+
+	return node;
+}
+
+// Prefer the pages of the region to be on the given node. A strict binding
+// (MPOL_BIND) would raise SIGBUS when touching a huge page if the node has
+// none left, so the kernel may fall back to other nodes.
+static int prefer_numa_node(void *addr, size_t size, int node)
+{
+	unsigned long nodemask[(node + 1 + 8*sizeof(unsigned long) - 1)/(8*sizeof(unsigned long))];
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node/(8*sizeof(unsigned long))] = 1UL << (node % (8*sizeof(unsigned long)));
+	return syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodemask, node + 2, 0);
+}
+
+// NUMA node of the page at addr, or -1 if unknown.
+static int page_numa_node(void *addr)
+{
+	int node;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+		return -1;
+	return node;
+}
+
+int umem_region_alloc(struct umem_region *region, size_t size, const char *ifname)
+{
+	memset(region, 0, sizeof(*region));
+	region->numa_node = -1;
+
+	for (size_t i = 0; i < sizeof(page_sizes)/sizeof(page_sizes[0]); i++) {
+		size_t page_size = page_sizes[i].size > 0 ? page_sizes[i].size : (size_t) getpagesize();
+		if (page_size == HUGE_PAGE_1G && size < HUGE_PAGE_1G)
+			continue;
+
+		size_t mapped = (size + page_size - 1)/page_size*page_size;
+		void *addr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | page_sizes[i].flags, -1, 0);
+		if (addr == MAP_FAILED)
+			continue; // e.g., no huge pages reserved (vm.nr_hugepages)
+
+		region->addr = addr;
+		region->size = mapped;
+		region->page_size = page_size;
+		break;
+	}
+	if (region->addr == NULL)
+		return -1;
+
+	// The policy applies to pages faulted in later, so it is set before prefaulting.
+	int node = device_numa_node(ifname);
+	if (node >= 0 && prefer_numa_node(region->addr, region->size, node) != 0)
+		fprintf(stderr, "Could not place UMEM on NUMA node %d of %s: %s\n", node, ifname,
+			strerror(errno));
+
+	// Fault in every page now instead of on the first packets.
+	for (size_t offset = 0; offset < region->size; offset += region->page_size)
+		((volatile uint8_t *) region->addr)[offset] = 0;
+	region->numa_node = page_numa_node(region->addr);
+
+	// Locking fails if the region exceeds RLIMIT_MEMLOCK. The kernel pins the
+	// UMEM anyway when it is registered, so this is not fatal.
+	region->locked = (mlock(region->addr, region->size) == 0);
+	if (!region->locked)
+		fprintf(stderr, "Could not lock UMEM in memory: %s\n", strerror(errno));
+
+	if (region->page_size < HUGE_PAGE_2M)
+		fprintf(stderr, "Could not allocate UMEM on huge pages, using %zu KiB pages\n",
+			region->page_size >> 10);
+	if (node >= 0 && region->numa_node != node)
+		fprintf(stderr, "UMEM is on NUMA node %d, %s is on node %d\n", region->numa_node,
+			ifname, node);
+
+	return 0;
+}
+
+void umem_region_free(struct umem_region *region)
+{
+	if (region->addr == NULL)
+		return;
+	if (region->locked)
+		munlock(region->addr, region->size);
+	munmap(region->addr, region->size);
+	region->addr = NULL;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // CPU affinity of threads
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -5,69 +6,137 @@
 #include <stdlib.h>
 #include <poll.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <bpf/xsk.h>
 
 #include <net/if.h>
+#include <arpa/inet.h>
 #include <linux/if_link.h>
 #include <linux/if_ether.h>
+#include <linux/if_xdp.h>
 
 #include <common_defines.h>
 #include <common_user_bpf_xdp.h>
 
-#define EXIT_OK 0
-#define EXIT_FAIL_BPFLOAD 1
-#define EXIT_FAIL_FINDMAP 2
-#define EXIT_FAIL_FINDELEM 3
-#define EXIT_FAIL_USAGE 4
-#define EXIT_FAIL_DEVICE 5
-#define EXIT_FAIL_SIGNAL 6
-#define EXIT_FAIL_MEMALLOC 7
-#define EXIT_FAIL_SOCKET 8
+#include "xdp-xsk-commons.h"
+#include "xdp-xsk-user.h"
 
-#define NUM_FRAMES 4096
-#define FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
-#define CACHE_LINE_SIZE 64
+// Names of the XDP programs in the BPF object file.
+#define XDP_PROG_NAME "xdp_prog_main"
+#define XDP_PROG_HW_TS_NAME "xdp_prog_hw_ts"
 
-#define INVALID_UMEM_FRAME UINT64_MAX
+// Maximum number of CPUs in the CPU list of the worker threads.
+#define MAX_CPUS 1024
 
 #define RX_BATCH_SIZE 16
 
-struct xsk_umem_info {
-        struct xsk_ring_prod fq;
-        struct xsk_ring_cons cq;
-        struct xsk_umem *umem;
-        void *buffer;
-};
+// Maximum number of frames added to the fill ring at once.
+#define FILL_BATCH_SIZE POOL_BATCH_SIZE
+
+// Default number of received packets logged per second.
+#define LOG_DEFAULT_RATE 100
+
+// Interval of the per-queue statistics output in milli-seconds.
+#define STATS_INTERVAL_MS 1000
 
-struct stats_record {
-        uint64_t timestamp;
-        uint64_t rx_packets;
-        uint64_t rx_bytes;
-        uint64_t tx_packets;
-        uint64_t tx_bytes;
+// Busy polling (Linux 5.11): the thread runs the NAPI poll of its queue in its
+// own system calls instead of waiting for interrupts and softirqs. The budget
+// is the maximum number of packets per busy poll.
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+#define BUSY_POLL_USECS 20
+#define BUSY_POLL_DEFAULT_BUDGET 64
+
+// Query whether a socket runs in zero-copy mode (Linux 5.3).
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef XDP_OPTIONS
+#define XDP_OPTIONS 8
+struct xdp_options {
+	__u32 flags;
 };
+#define XDP_OPTIONS_ZEROCOPY (1 << 0)
+#endif
+
+// Load a program bound to a device, which may call the kfuncs of its driver (Linux 6.3).
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
+// Load a program that accepts multi-buffer packets (Linux 5.18).
+#ifndef BPF_F_XDP_HAS_FRAGS
+#define BPF_F_XDP_HAS_FRAGS (1U << 5)
+#endif
 
-struct xsk_socket_info {
-        struct xsk_ring_cons rx;
-        struct xsk_ring_prod tx;
-        struct xsk_umem_info *umem;
-        struct xsk_socket *xsk;
+// Drop counters of a socket (cf. struct xdp_statistics). The counters of full
+// and empty rings exist since Linux 5.9; older kernels only fill the first three.
+#ifndef XDP_STATISTICS
+#define XDP_STATISTICS 7
+#endif
+struct xsk_xdp_statistics {
+	uint64_t rx_dropped; // dropped for other reasons, e.g., too long
+	uint64_t rx_invalid_descs;
+	uint64_t tx_invalid_descs;
+	uint64_t rx_ring_full; // dropped since the RX ring was full
+	uint64_t rx_fill_ring_empty_descs; // no frame in the fill ring
+	uint64_t tx_ring_empty_descs;
+};
 
-	uint64_t umem_frame_addr[NUM_FRAMES];
-        uint32_t umem_frame_free;
+// How a receiving thread waits for packets.
+enum wait_mode {
+	WAIT_POLL, // block in poll() until packets arrive (interrupt driven)
+	WAIT_BUSY_POLL, // non-blocking recvfrom() busy polling the queue
+	WAIT_SPIN, // spin on the RX ring without system calls
+};
 
-        uint32_t outstanding_tx;
+static const char *const wait_mode_names[] = {
+	[WAIT_POLL] = "poll",
+	[WAIT_BUSY_POLL] = "busy polling",
+	[WAIT_SPIN] = "spinning",
+};
 
-        struct stats_record stats;
-        struct stats_record prev_stats;
+// Thread receiving or sending the packets of one XSK.
+struct worker {
+	pthread_t thread;
+	struct xsk_socket_info *xsk;
+	int cpu; // CPU the thread is pinned to (-1: not pinned)
+	const struct gen_config *gen; // generator mode if not NULL
+	struct xsk_socket_info *out; // forwarding mode if not NULL (xsk: reflector)
+	enum wait_mode wait;
+	clockid_t cpu_clock; // CPU time of the thread
+	uint64_t prev_cpu_ns;
+	struct xsk_xdp_statistics prev_xdp_stats; // of xsk
+	struct xsk_xdp_statistics prev_out_xdp_stats; // of out if not xsk
 };
 
-const size_t frame_buffer_size = NUM_FRAMES*FRAME_SIZE;
+// State of the periodic per-RX-queue statistics output.
+struct queue_poller {
+	int queue_stats_map_fd;
+	int nqueues;
+	int ncpus;
+	bool per_queue; // print every queue, not only the imbalance
+	struct queue_stats *percpu; // ncpus values of one queue
+	struct queue_stats cur[MAX_RX_QUEUES]; // values summed up over all CPUs
+	struct queue_stats prev[MAX_RX_QUEUES]; // values of the previous poll
+	struct timespec prev_time;
+};
 
-static int do_exit = 0;
+// Set by the signal handler, read by all worker threads.
+volatile sig_atomic_t do_exit = 0;
 
 int get_map_fd(struct bpf_object *bpf_obj, const char *maps_name)
 {
@@ -86,63 +155,334 @@ static void usage(const char *prog)
 	fprintf(stderr, "%s "
 		"-f BPF_PROG_FILENAME "
 		"-d DEVICE "
-		"\n", prog);
+		"[-Q FIRST[-LAST]] "
+		"[-c CPU_LIST] "
+		"[-s] "
+		"[-q] "
+		"[-m rx|gen|fwd] "
+		"[-o OUT_DEVICE] "
+		"[-l LEN] "
+		"[-r RATE] "
+		"[-n COUNT] "
+		"[-S SRC_MAC] "
+		"[-D DST_MAC] "
+		"[-z|-k] "
+		"[-w] "
+		"[-p poll|busy|spin] "
+		"[-B BUDGET] "
+		"[-L RATE] "
+		"[-F NUM_FRAMES] "
+		"[-Z FRAME_SIZE] "
+		"[-U] "
+		"[-H HEADROOM] "
+		"[-M] "
+		"\n"
+		"  -Q: bind an XSK to each RX queue in this range (default: all queues)\n"
+		"  -c: pin the thread of the n-th XSK to the n-th CPU of the list, e.g., 2,4-7\n"
+		"      (the list is repeated if it has fewer CPUs than there are XSKs)\n"
+		"  -s: share one UMEM among all XSKs instead of one UMEM per XSK\n"
+		"  -q: report the rates of every RX queue, not only their imbalance\n"
+		"  -m: receive packets (rx, default), send UDP packets on every queue (gen), or\n"
+		"      forward received packets (fwd)\n"
+		"  -o: forward to the same queue of OUT_DEVICE (default: back to DEVICE with swapped\n"
+		"      MAC addresses)\n"
+		"  -z, -k: force zero-copy or copy mode (default: zero-copy if supported by the driver)\n"
+		"  -w: use need_wakeup, i.e., only make system calls if the kernel asks for them\n"
+		"  -p: wait for packets by blocking in poll (default), by busy polling the queue\n"
+		"      (requires /sys/class/net/DEVICE/napi_defer_hard_irqs and gro_flush_timeout\n"
+		"      to be set), or by spinning on the RX ring without system calls\n"
+		"  -B: maximum number of packets per busy poll (default %d)\n"
+		"  -L: log at most RATE received packets per second (default %d, 0: off)\n"
+		"  -F: number of UMEM frames per XSK, a multiple of %d (default %d)\n"
+		"  -Z: size of the UMEM frames, a power of two from %d to %d (default %d)\n"
+		"  -U: unaligned UMEM frames, which may have any size from %d to %d (sizes that\n"
+		"      are no power of two require huge pages, or copy mode)\n"
+		"  -H: headroom in front of received packets in addition to the %d bytes of XDP\n"
+		"      (default %d)\n"
+		"  -M: receive packets larger than a frame in several frames (multi-buffer;\n"
+		"      requires Linux 6.6, and is used with a larger MTU of DEVICE)\n"
+		"Generator options:\n"
+		"  -l: frame length without FCS (default %d)\n"
+		"  -r: packets per second per queue (default: as fast as possible)\n"
+		"  -n: packets per queue (default: until Ctrl-C)\n"
+		"  -S, -D: source and destination MAC address (default: device and broadcast)\n",
+		prog, BUSY_POLL_DEFAULT_BUDGET, LOG_DEFAULT_RATE, POOL_BATCH_SIZE, DEFAULT_NUM_FRAMES,
+		MIN_FRAME_SIZE, MAX_FRAME_SIZE, DEFAULT_FRAME_SIZE, MIN_FRAME_SIZE, MAX_FRAME_SIZE,
+		XDP_PACKET_HEADROOM, XSK_UMEM__DEFAULT_FRAME_HEADROOM, GEN_DEFAULT_FRAME_LEN);
 }
 
-static void sigint_handler(int signal)
+// Number of RX queues of the device, or -1 on error.
+static int num_rx_queues(const char *ifname)
 {
-	do_exit = 1;
+	char path[PATH_MAX];
+	int n = snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+	if (n < 0 || (size_t) n >= sizeof(path))
+		return -1;
+
+	// Every RX queue has a directory rx-<index>.
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return -1;
+	int nqueues = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "rx-", 3) == 0)
+			nqueues++;
+	}
+	closedir(dir);
+
+	return nqueues;
 }
 
-static struct xsk_umem_info *configure_xsk_umem(void *buffer, size_t size)
+// Parse a range of queues of the form FIRST[-LAST]. Returns 0 on success.
+static int parse_queue_range(const char *str, int *first, int *last)
 {
-        struct xsk_umem_info *umem;
-        int ret;
+	char *end;
 
-        umem = calloc(1, sizeof(struct xsk_umem_info));
-        if (!umem)
-                return NULL;
+	*first = strtol(str, &end, 10);
+	*last = *first;
+	if (*end == '-')
+		*last = strtol(end + 1, &end, 10);
+	if (end == str || *end != '\0' || *first < 0 || *last < *first || *last >= MAX_RX_QUEUES)
+		return -1;
 
-	// Call libbpf to create UMEM for fill ring (fq) and completion ring (cq)
-	// backed by the allocated buffer.
-        ret = xsk_umem__create(&umem->umem, buffer, size, &umem->fq, &umem->cq, NULL);
-        if (ret)
-                return NULL;
-        umem->buffer = buffer;
+	return 0;
+}
+
+// Parse a list of CPUs and CPU ranges such as 2,4-7 into cpus (in the given order).
+// Returns the number of CPUs or -1 on error.
+static int parse_cpu_list(const char *str, int *cpus, int max)
+{
+	int ncpus = 0;
+	const char *p = str;
+
+	while (*p != '\0') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p)
+			return -1;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (ncpus >= max)
+				return -1;
+			cpus[ncpus++] = cpu;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		p = end;
+	}
+
+	return ncpus;
+}
 
-        return umem;
+static double elapsed_sec(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec)/1e9;
+}
+
+// Read the per-CPU values of all queues and sum them up into poller->cur.
+static int read_queue_stats(struct queue_poller *poller)
+{
+	for (int queue = 0; queue < poller->nqueues; queue++) {
+		uint32_t key = queue;
+		if (bpf_map_lookup_elem(poller->queue_stats_map_fd, &key, poller->percpu) != 0)
+			return -1;
+
+		struct queue_stats *sum = &poller->cur[queue];
+		memset(sum, 0, sizeof(*sum));
+		for (int cpu = 0; cpu < poller->ncpus; cpu++) {
+			sum->rx_packets += poller->percpu[cpu].rx_packets;
+			sum->rx_bytes += poller->percpu[cpu].rx_bytes;
+			sum->redirected_packets += poller->percpu[cpu].redirected_packets;
+			sum->passed_packets += poller->percpu[cpu].passed_packets;
+			sum->dropped_packets += poller->percpu[cpu].dropped_packets;
+		}
+	}
+
+	return 0;
+}
+
+static int init_queue_poller(struct queue_poller *poller, int queue_stats_map_fd,
+			     const char *ifname, bool per_queue)
+{
+	// If the number of queues is unknown, all queues with an entry in the map are reported.
+	int nqueues = num_rx_queues(ifname);
+	if (nqueues < 1 || nqueues > MAX_RX_QUEUES)
+		nqueues = MAX_RX_QUEUES;
+
+	poller->queue_stats_map_fd = queue_stats_map_fd;
+	poller->nqueues = nqueues;
+	poller->per_queue = per_queue;
+	// Per-CPU maps store one value for each possible CPU.
+	poller->ncpus = libbpf_num_possible_cpus();
+	if (poller->ncpus < 1)
+		return -1;
+	poller->percpu = calloc(poller->ncpus, sizeof(*poller->percpu));
+	if (poller->percpu == NULL)
+		return -1;
+
+	if (read_queue_stats(poller) != 0)
+		return -1;
+	memcpy(poller->prev, poller->cur, sizeof(poller->prev));
+	clock_gettime(CLOCK_MONOTONIC, &poller->prev_time);
+
+	return 0;
+}
+
+// Print how evenly the packets of the last interval are spread over the RX
+// queues: the ratio of the busiest queue to the mean of all queues is 1.0 for a
+// perfect balance and nqueues if a single queue receives all packets.
+static void print_queue_stats(struct queue_poller *poller)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double interval = elapsed_sec(&poller->prev_time, &now);
+	if (interval*1000 < STATS_INTERVAL_MS)
+		return;
+	poller->prev_time = now;
+
+	if (read_queue_stats(poller) != 0) {
+		perror("Could not read per-queue statistics");
+		return;
+	}
+
+	uint64_t total = 0;
+	uint64_t max = 0;
+	int hottest = 0;
+	for (int queue = 0; queue < poller->nqueues; queue++) {
+		uint64_t packets = poller->cur[queue].rx_packets - poller->prev[queue].rx_packets;
+		total += packets;
+		if (packets > max) {
+			max = packets;
+			hottest = queue;
+		}
+	}
+
+	if (total == 0) {
+		printf("RX queues: %d, idle\n", poller->nqueues);
+	} else {
+		double mean = (double) total/poller->nqueues;
+		printf("RX queues: %d, mean rate=%.0f pps, max/mean=%.2f, hottest queue=%d (%.1f%% of packets)\n",
+		       poller->nqueues, mean/interval, max/mean, hottest, 100.0*max/total);
+	}
+
+	for (int queue = 0; poller->per_queue && queue < poller->nqueues; queue++) {
+		const struct queue_stats *cur = &poller->cur[queue];
+		const struct queue_stats *prev = &poller->prev[queue];
+		printf("  queue %2d -> rx rate=%.0f pps (%.0f B/s)    redirect rate=%.0f pps    "
+		       "pass rate=%.0f pps    drop rate=%.0f pps\n",
+		       queue, (cur->rx_packets - prev->rx_packets)/interval,
+		       (cur->rx_bytes - prev->rx_bytes)/interval,
+		       (cur->redirected_packets - prev->redirected_packets)/interval,
+		       (cur->passed_packets - prev->passed_packets)/interval,
+		       (cur->dropped_packets - prev->dropped_packets)/interval);
+	}
+	fflush(stdout);
+
+	memcpy(poller->prev, poller->cur, sizeof(poller->prev));
+}
+
+static void sigint_handler(int signal)
+{
+	do_exit = 1;
+}
+
+static int configure_xsk_umem(struct xsk_umem_info *umem, struct xsk_ring_prod *fq,
+			      struct xsk_ring_cons *cq)
+{
+	// Call libbpf to create UMEM for fill ring (fq) and completion ring (cq)
+	// backed by the allocated buffer. The rings are the ones of the first
+	// socket using the UMEM; libbpf creates new rings for further sockets.
+	struct xsk_umem_config umem_cfg = {
+		.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.frame_size = umem->frame_size,
+		.frame_headroom = umem->headroom,
+		.flags = umem->unaligned ? XDP_UMEM_UNALIGNED_CHUNK_FLAG : 0,
+	};
+	return xsk_umem__create(&umem->umem, umem->buffer, umem->size, fq, cq, &umem_cfg);
 }
 
-static uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk)
+unsigned int replenish_fill_ring(struct xsk_socket_info *xsk)
 {
-        uint64_t frame;
-        if (xsk->umem_frame_free == 0)
-                return INVALID_UMEM_FRAME;
+	uint64_t frames[FILL_BATCH_SIZE];
+	unsigned int nfilled = 0;
+	uint32_t idx_fq = 0;
 
-	// We keep a list of umem_frame_free free frames in umem_frame_addr.
-	// Frames are taken from the tail of the list and are returned at the
-	// tail of the list.
-        frame = xsk->umem_frame_addr[--xsk->umem_frame_free];
-        xsk->umem_frame_addr[xsk->umem_frame_free] = INVALID_UMEM_FRAME;
+	for (;;) {
+		// Take the frames first: with a shared UMEM, other sockets might
+		// hold the free frames.
+		uint32_t nfree = xsk_prod_nb_free(&xsk->fq, FILL_BATCH_SIZE);
+		if (nfree > FILL_BATCH_SIZE)
+			nfree = FILL_BATCH_SIZE;
+		uint32_t nframes = 0;
+		while (nframes < nfree &&
+		       (frames[nframes] = xsk_alloc_umem_frame(xsk)) != INVALID_UMEM_FRAME)
+			nframes++;
+		if (nframes == 0)
+			break;
+
+		// Populate fill ring with frame addresses in a three-step process:
+		// 1. Reserve slots in producer (fill) ring (nframes are free).
+		xsk_ring_prod__reserve(&xsk->fq, nframes, &idx_fq);
+		// 2. Store frame addresses in producer (fill) ring.
+		for (uint32_t i = 0; i < nframes; i++)
+			*xsk_ring_prod__fill_addr(&xsk->fq, idx_fq++) = frames[i];
+		// 3. Submit to kernel, so the driver can receive into these frames.
+		xsk_ring_prod__submit(&xsk->fq, nframes);
+
+		nfilled += nframes;
+		if (nframes < nfree)
+			break; // no free frame left
+	}
+
+	return nfilled;
+}
 
-        return frame;
+void xsk_kick_tx(struct xsk_socket_info *xsk)
+{
+	xsk_count_syscall(xsk);
+	// A busy or full ring is a transient condition.
+	if (sendto(xsk_socket__fd(xsk->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+	    errno != ENOBUFS && errno != EAGAIN && errno != EBUSY && errno != ENETDOWN) {
+		perror("Could not kick TX ring");
+		do_exit = 1;
+	}
 }
 
-static void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame)
+void xsk_complete_tx(struct xsk_socket_info *xsk, struct xsk_socket_info *owner)
 {
-        assert(xsk->umem_frame_free < NUM_FRAMES);
+	uint32_t idx_cq;
+
+	if (xsk->outstanding_tx == 0)
+		return;
 
-        xsk->umem_frame_addr[xsk->umem_frame_free++] = frame;
+	uint32_t ncompleted = xsk_ring_cons__peek(&xsk->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx_cq);
+	for (uint32_t i = 0; i < ncompleted; i++)
+		xsk_free_umem_frame(owner, *xsk_ring_cons__comp_addr(&xsk->cq, idx_cq++));
+	xsk_ring_cons__release(&xsk->cq, ncompleted);
+	xsk->outstanding_tx -= ncompleted;
 }
 
+// Create an XSK bound to RX queue queue of the device, taking its frames from
+// the pool of the UMEM, and register it in xsk_map.
 static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
-                                                    struct xsk_umem_info *umem)
+                                                    struct xsk_umem_info *umem,
+						    uint32_t queue, int xsk_map_fd)
 {
         struct xsk_socket_config xsk_cfg;
         struct xsk_socket_info *xsk_info;
-        uint32_t idx;
 	//uint32_t prog_id = 0;
-        int i;
         int ret;
 
         xsk_info = calloc(1, sizeof(*xsk_info));
@@ -152,17 +492,36 @@ static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
 	// Call libbpf to create XSK (socket of type AF_XDP).
 	// The socket uses the given UMEM to populate RX and TX rings. 
         xsk_info->umem = umem;
+	xsk_info->queue = queue;
+	if (umem->umem == NULL && configure_xsk_umem(umem, &xsk_info->fq, &xsk_info->cq) != 0) {
+		free(xsk_info);
+		return NULL;
+	}
+
         xsk_cfg.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
         xsk_cfg.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
-        xsk_cfg.libbpf_flags = 0;
+	// Our own BPF program is already attached. Without this flag, libbpf
+	// would load its default program and its own map xsks_map instead.
+        xsk_cfg.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD;
         xsk_cfg.xdp_flags = cfg->xdp_flags;
         xsk_cfg.bind_flags = cfg->xsk_bind_flags;
-        ret = xsk_socket__create(&xsk_info->xsk, cfg->ifname,
-                                 cfg->xsk_if_queue, umem->umem, &xsk_info->rx,
-                                 &xsk_info->tx, &xsk_cfg);
-
-        if (ret)
+        ret = xsk_socket__create_shared(&xsk_info->xsk, cfg->ifname, queue, umem->umem,
+					&xsk_info->rx, &xsk_info->tx, &xsk_info->fq,
+					&xsk_info->cq, &xsk_cfg);
+        if (ret) {
+		free(xsk_info);
+		errno = -ret;
                 return NULL;
+	}
+	xsk_info->need_wakeup = (cfg->xsk_bind_flags & XDP_USE_NEED_WAKEUP) != 0;
+
+	// Redirect the packets of the queue to this socket (key is the queue of the
+	// socket). Without map, the socket only sends.
+	if (xsk_map_fd >= 0 && xsk_socket__update_xskmap(xsk_info->xsk, xsk_map_fd) != 0) {
+		xsk_socket__delete(xsk_info->xsk);
+		free(xsk_info);
+		return NULL;
+	}
 
 	// Get ID of BPF program attached to link. 
 	/*
@@ -171,80 +530,116 @@ static struct xsk_socket_info *xsk_configure_socket(struct config *cfg,
                 return NULL;
 	*/
 	
-	// Partition the UMEM into array of frames.
-        for (i = 0; i < NUM_FRAMES; i++)
-                xsk_info->umem_frame_addr[i] = i * FRAME_SIZE;
-        xsk_info->umem_frame_free = NUM_FRAMES;
-
-	// Populate fill ring with frame addresses in a three-step process:
-	// 1. Reserve slots in producer (fill) ring.
-        unsigned int nreserved = xsk_ring_prod__reserve(&xsk_info->umem->fq,
-							XSK_RING_PROD__DEFAULT_NUM_DESCS,
-							&idx);
-	// We expect to reserve all XSK_RING_PROD__DEFAULT_NUM_DESCS frames.
-	// However, at least one is required to go on.
-        if (nreserved < 1)
+	// Take frames from the pool of the UMEM, and give as many as fit into the
+	// fill ring to the kernel. At least one is required to go on. A socket
+	// without map only sends, and keeps its frames for the TX ring.
+	xsk_info->frames.pool = umem->pool;
+	if (xsk_map_fd >= 0 && replenish_fill_ring(xsk_info) < 1) {
+		xsk_socket__delete(xsk_info->xsk);
+		free(xsk_info);
                 return NULL;
-	
-	// 2. Store frame addresses in producer (fill) ring.
-        for (i = 0; i < nreserved; i++)
-                *xsk_ring_prod__fill_addr(&xsk_info->umem->fq, idx++) =
-                        xsk_alloc_umem_frame(xsk_info);
-	// 3. Submit to kernel, so BPF program now has control over this frames now.
-        xsk_ring_prod__submit(&xsk_info->umem->fq, nreserved);
+	}
 
         return xsk_info;
 }
 
-void replenish_fill_ring(struct xsk_socket_info *xsk)
+// Let the thread of the socket busy poll its queue (cf. SO_PREFER_BUSY_POLL).
+// Returns 0 on success.
+static int configure_busy_poll(struct xsk_socket_info *xsk, int budget)
 {
-	unsigned int idx_fq = 0;
-	size_t nreserved;
-	
-        // Replenish fill ring with as many frames as fit into fill ring.
-        size_t nframes_free = xsk_prod_nb_free(&xsk->umem->fq,
-					       xsk->umem_frame_free);
-        if (nframes_free > 0) {
-		// Free space in fill ring available to store frame addresses.
-		// We should be able to reserve nframes_free frames.
-		// But we need at least one to continue.
-		do {
-                        nreserved = xsk_ring_prod__reserve(&xsk->umem->fq, nframes_free, &idx_fq);
-		} while (nreserved < 1);
-
-                for (size_t i = 0; i < nreserved; i++)
-                        *xsk_ring_prod__fill_addr(&xsk->umem->fq, idx_fq++) =
-                                xsk_alloc_umem_frame(xsk);
-
-                xsk_ring_prod__submit(&xsk->umem->fq, nreserved);
-        }
+	int fd = xsk_socket__fd(xsk->xsk);
+	int prefer = 1;
+	int usecs = BUSY_POLL_USECS;
+
+	// Setting the budget requires CAP_NET_ADMIN.
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) != 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) != 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) != 0)
+		return -1;
+
+	return 0;
+}
+
+// Returns true if the driver moves packets from and to the UMEM without copying them.
+static bool is_zerocopy(struct xsk_socket_info *xsk)
+{
+	struct xdp_options opts;
+	socklen_t len = sizeof(opts);
+
+	if (getsockopt(xsk_socket__fd(xsk->xsk), SOL_XDP, XDP_OPTIONS, &opts, &len) != 0)
+		return false;
+	return (opts.flags & XDP_OPTIONS_ZEROCOPY) != 0;
 }
 
-void print_mac(unsigned char *addr, size_t len)
+
+// Parse MAC address of the form xx:xx:xx:xx:xx:xx. Returns 0 on success.
+static int parse_mac(const char *str, unsigned char *addr)
 {
-	for (size_t i = 0; i < len; i++) {
-		printf("%02x", addr[i]);
-		if (i+1 != len)
-			printf(":");
+	unsigned int bytes[ETH_ALEN];
+	char end;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x%c", &bytes[0], &bytes[1], &bytes[2], &bytes[3],
+		   &bytes[4], &bytes[5], &end) != ETH_ALEN)
+		return -1;
+	for (int i = 0; i < ETH_ALEN; i++) {
+		if (bytes[i] > 0xff)
+			return -1;
+		addr[i] = bytes[i];
 	}
+
+	return 0;
 }
 
-void process_pkt(struct xsk_socket_info *xsk, uint64_t addr, uint32_t len)
+// Metadata the BPF program stored in front of the packet at addr, or NULL if
+// there is none. The packet always starts behind the headroom of the frame
+// (XDP_PACKET_HEADROOM), so the metadata never reaches into the previous frame.
+static const struct xsk_rx_meta *xsk_rx_meta(struct xsk_socket_info *xsk, uint64_t addr)
+{
+	const struct xsk_rx_meta *meta = xsk_pkt_data(xsk->umem, addr);
+
+	meta--;
+	return meta->magic == XSK_META_MAGIC ? meta : NULL;
+}
+
+void process_pkt(struct xsk_socket_info *xsk, uint64_t addr, uint32_t len,
+		 const struct xsk_rx_meta *meta)
 {
 	// "In the default aligned mode, you can get the addr variable straight
 	// from the RX descriptor. But in unaligned mode, you need to use the
 	// three last function below as the offset used is carried in the upper
 	// 16 bits of the addr. Therefore, you cannot use the addr straight from
 	// the descriptor in the unaligned case." [man libxdp]
-	void *pkt = xsk_umem__get_data(xsk->umem->buffer, addr);
+	void *pkt = xsk_pkt_data(xsk->umem, addr);
 	struct ethhdr *eth = (struct ethhdr *) pkt;
 
 	// Note: In contrast to packet processing within BPF program, no bounds
 	// checks are mandatory here to access the data since are are in user-space.
 
-	printf("Received packet from ");
-	print_mac(eth->h_source, 6);
-	printf("\n");
+	if (xsk->log == NULL)
+		return;
+
+	// Formatting and printing the packet would limit the packet rate to a
+	// fraction of what the socket can receive, so this is left to the
+	// logger thread.
+	struct log_record record = {
+		.queue = xsk->queue,
+		.len = len,
+		.proto = ntohs(eth->h_proto),
+	};
+	if (meta != NULL) {
+		record.rx_timestamp = meta->rx_timestamp;
+		record.meta_flags = meta->flags;
+	}
+	memcpy(record.src_mac, eth->h_source, ETH_ALEN);
+	memcpy(record.dst_mac, eth->h_dest, ETH_ALEN);
+	log_ring_push(xsk->log, &record);
+}
+
+static uint64_t clock_tai_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_TAI, &now);
+	return now.tv_sec*1000000000ULL + now.tv_nsec;
 }
 
 void process_pkts(struct xsk_socket_info *xsk)
@@ -257,29 +652,77 @@ void process_pkts(struct xsk_socket_info *xsk)
 	// However, if fewer packets are available, the returned batch can be smaller.
 	// Thus, rcvd will be less equal RX_BATCH_SIZE.
         size_t rcvd = xsk_ring_cons__peek(&xsk->rx, RX_BATCH_SIZE, &idx_rx);
+	xsk_record_batch(xsk->stats.rx_batches, rcvd);
         if (!rcvd)
 		return;
 
 	// Before we go on, replenish fill ring with new frames so kernel can go receiving.
 	replenish_fill_ring(xsk);
 	
+	// The latency of frames sent by the generator is measured from the
+	// arrival time stored by the BPF program, which excludes the time the
+	// packet waited in the RX ring. Without metadata, the time of the batch
+	// is taken instead.
+	uint64_t now = 0;
+	uint64_t bytes = 0;
+	uint32_t npkts = 0;
+	struct xsk_rx_pkt *pkt = &xsk->rx_pkt;
+
         // Retrieve packet addresses from RX ring and process them.
         for (size_t i = 0; i < rcvd; i++) {
-                uint64_t addr = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->addr;
-                uint32_t len = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx)->len;
-		idx_rx++;
-		
-                process_pkt(xsk, addr, len);
+		const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&xsk->rx, idx_rx++);
+		bytes += desc->len;
+
+		// A multi-buffer packet is processed once its last fragment has
+		// arrived. Only the first fragment is read, so the frames of the
+		// others are returned right away.
+		if (pkt->nfrags == 0) {
+			pkt->addr = desc->addr;
+			pkt->first_len = desc->len;
+			pkt->len = 0;
+		} else {
+			xsk_free_umem_frame(xsk, desc->addr);
+		}
+		pkt->nfrags++;
+		pkt->len += desc->len;
+		if (desc->options & XDP_PKT_CONTD)
+			continue;
+
+		// With metadata, only frames of the generator are read here.
+		const struct xsk_rx_meta *meta = xsk_rx_meta(xsk, pkt->addr);
+		struct gen_payload payload;
+		if ((meta == NULL || meta->class_id == XSK_CLASS_GEN) &&
+		    gen_parse_payload(xsk_pkt_data(xsk->umem, pkt->addr), pkt->first_len, &payload) == 0) {
+			uint64_t arrival;
+			if (meta != NULL) {
+				arrival = meta->rx_timestamp;
+			} else {
+				if (now == 0)
+					now = clock_tai_ns();
+				arrival = now;
+			}
+			// Sender and receiver clocks might not be synchronized.
+			if (payload.timestamp <= arrival)
+				xsk_record_latency(xsk, arrival - payload.timestamp);
+		}
+
+                process_pkt(xsk, pkt->addr, pkt->len, meta);
 
 		// Packet has been processed. Return frame to UMEM pool.
-		xsk_free_umem_frame(xsk, addr);
+		xsk_free_umem_frame(xsk, pkt->addr);
+		pkt->nfrags = 0;
+		npkts++;
         }
 
 	// Move RX pointer in RX ring after the processed packets.
         xsk_ring_cons__release(&xsk->rx, rcvd);
+
+	__atomic_store_n(&xsk->stats.rx_packets, xsk->stats.rx_packets + npkts, __ATOMIC_RELAXED);
+	__atomic_store_n(&xsk->stats.rx_bytes, xsk->stats.rx_bytes + bytes, __ATOMIC_RELAXED);
 }
 
-void receive_and_process_pkts(struct xsk_socket_info *xsk)
+void receive_and_process_pkts(struct xsk_socket_info *xsk, struct xsk_socket_info *out,
+			      enum wait_mode wait)
 {
 	struct pollfd fds[2];
         int ret, nfds = 1;
@@ -291,16 +734,367 @@ void receive_and_process_pkts(struct xsk_socket_info *xsk)
         fds[0].events = POLLIN;
 	
         while (!do_exit) {
-		// Poll system call blocks process until one of the fill descriptors
-		// in set fds can be read (POLLIN) w/o blocking.
-		ret = poll(fds, nfds, -1);
-		if (ret <= 0 || ret > 1)
-			continue;
-		// At least one packet is now in the RX ring of the XSK.
-		process_pkts(xsk);
+		switch (wait) {
+		case WAIT_POLL:
+			// Poll system call blocks process until one of the fill descriptors
+			// in set fds can be read (POLLIN) w/o blocking. The timeout lets
+			// the thread check for termination.
+			xsk_count_syscall(xsk);
+			ret = poll(fds, nfds, STATS_INTERVAL_MS);
+			// On a timeout, a forwarder still reclaims and kicks its TX ring.
+			if (ret < 0 || ret > 1)
+				continue;
+			break;
+		case WAIT_BUSY_POLL:
+			// Every system call on the socket runs the NAPI poll of the
+			// queue, which moves received packets to the RX ring and
+			// frames from the fill ring to the driver.
+			xsk_count_syscall(xsk);
+			recvfrom(fds[0].fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+			break;
+		case WAIT_SPIN:
+			// The driver fills the RX ring in softirq context. It only
+			// needs a system call if it ran out of frames in the fill ring.
+			if (xsk->need_wakeup && xsk_ring_prod__needs_wakeup(&xsk->fq)) {
+				xsk_count_syscall(xsk);
+				recvfrom(fds[0].fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+			}
+			break;
+		}
+		// Returns immediately if the RX ring of the XSK is empty.
+		if (out != NULL)
+			forward_pkts(xsk, out);
+		else
+			process_pkts(xsk);
 	}
 }
 
+static void *worker_main(void *arg)
+{
+	struct worker *worker = arg;
+
+	if (worker->gen != NULL)
+		generate_pkts(worker->xsk, worker->gen);
+	else
+		receive_and_process_pkts(worker->xsk, worker->out, worker->wait);
+
+	return NULL;
+}
+
+// Statistics of a socket in the last interval.
+struct xsk_sample {
+	struct stats_record delta;
+	uint64_t cpu_ns; // CPU time of the thread
+	// Entries in the rings when sampled, and their sizes.
+	uint32_t fill_entries, fill_size;
+	uint32_t rx_entries, rx_size;
+	uint32_t tx_entries, tx_size;
+	struct xsk_xdp_statistics xdp; // drops counted by the kernel
+};
+
+static const char *const batch_hist_labels[BATCH_HIST_BUCKETS] = {
+	"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+",
+};
+
+// Number of entries in a ring. The worker thread and the kernel move the
+// indices concurrently, so the value is a snapshot.
+static uint32_t ring_entries(const uint32_t *producer, const uint32_t *consumer)
+{
+	return __atomic_load_n(producer, __ATOMIC_RELAXED) - __atomic_load_n(consumer, __ATOMIC_RELAXED);
+}
+
+// Add the drop counters of the kernel for the socket since the last call to
+// stats. Older kernels do not count the drops due to full or empty rings.
+static void read_xdp_stats(struct xsk_socket_info *xsk, struct xsk_xdp_statistics *prev,
+			   struct xsk_xdp_statistics *stats)
+{
+	struct xsk_xdp_statistics cur = { 0 };
+	socklen_t len = sizeof(cur);
+
+	if (getsockopt(xsk_socket__fd(xsk->xsk), SOL_XDP, XDP_STATISTICS, &cur, &len) != 0)
+		return;
+	stats->rx_dropped += cur.rx_dropped - prev->rx_dropped;
+	stats->rx_invalid_descs += cur.rx_invalid_descs - prev->rx_invalid_descs;
+	stats->tx_invalid_descs += cur.tx_invalid_descs - prev->tx_invalid_descs;
+	stats->rx_ring_full += cur.rx_ring_full - prev->rx_ring_full;
+	stats->rx_fill_ring_empty_descs += cur.rx_fill_ring_empty_descs - prev->rx_fill_ring_empty_descs;
+	stats->tx_ring_empty_descs += cur.tx_ring_empty_descs - prev->tx_ring_empty_descs;
+	*prev = cur;
+}
+
+// Take the statistics of the socket of a worker since the last sample.
+static void sample_xsk(struct worker *worker, struct xsk_sample *sample)
+{
+	struct xsk_socket_info *xsk = worker->xsk;
+	struct stats_record *prev = &xsk->prev_stats;
+	struct stats_record cur = {
+		.rx_packets = __atomic_load_n(&xsk->stats.rx_packets, __ATOMIC_RELAXED),
+		.rx_bytes = __atomic_load_n(&xsk->stats.rx_bytes, __ATOMIC_RELAXED),
+		.tx_packets = __atomic_load_n(&xsk->stats.tx_packets, __ATOMIC_RELAXED),
+		.tx_bytes = __atomic_load_n(&xsk->stats.tx_bytes, __ATOMIC_RELAXED),
+		.syscalls = __atomic_load_n(&xsk->stats.syscalls, __ATOMIC_RELAXED),
+		.latency_sum = __atomic_load_n(&xsk->stats.latency_sum, __ATOMIC_RELAXED),
+		.latency_count = __atomic_load_n(&xsk->stats.latency_count, __ATOMIC_RELAXED),
+	};
+	for (int b = 0; b < BATCH_HIST_BUCKETS; b++) {
+		cur.rx_batches[b] = __atomic_load_n(&xsk->stats.rx_batches[b], __ATOMIC_RELAXED);
+		cur.tx_batches[b] = __atomic_load_n(&xsk->stats.tx_batches[b], __ATOMIC_RELAXED);
+	}
+	// The TX kicks of a forwarding worker are counted at its output socket.
+	struct xsk_socket_info *out = worker->out != NULL ? worker->out : xsk;
+	if (out != xsk)
+		cur.syscalls += __atomic_load_n(&out->stats.syscalls, __ATOMIC_RELAXED);
+
+	struct stats_record *delta = &sample->delta;
+	delta->rx_packets = cur.rx_packets - prev->rx_packets;
+	delta->rx_bytes = cur.rx_bytes - prev->rx_bytes;
+	delta->tx_packets = cur.tx_packets - prev->tx_packets;
+	delta->tx_bytes = cur.tx_bytes - prev->tx_bytes;
+	delta->syscalls = cur.syscalls - prev->syscalls;
+	delta->latency_sum = cur.latency_sum - prev->latency_sum;
+	delta->latency_count = cur.latency_count - prev->latency_count;
+	delta->latency_max = __atomic_exchange_n(&xsk->stats.latency_max, 0, __ATOMIC_RELAXED);
+	for (int b = 0; b < BATCH_HIST_BUCKETS; b++) {
+		delta->rx_batches[b] = cur.rx_batches[b] - prev->rx_batches[b];
+		delta->tx_batches[b] = cur.tx_batches[b] - prev->tx_batches[b];
+	}
+	*prev = cur;
+
+	// The clock of a terminated thread cannot be read anymore.
+	struct timespec cpu_time;
+	if (clock_gettime(worker->cpu_clock, &cpu_time) == 0) {
+		uint64_t ns = cpu_time.tv_sec*1000000000ULL + cpu_time.tv_nsec;
+		sample->cpu_ns = ns - worker->prev_cpu_ns;
+		worker->prev_cpu_ns = ns;
+	}
+
+	sample->fill_entries = ring_entries(xsk->fq.producer, xsk->fq.consumer);
+	sample->fill_size = xsk->fq.size;
+	sample->rx_entries = ring_entries(xsk->rx.producer, xsk->rx.consumer);
+	sample->rx_size = xsk->rx.size;
+	sample->tx_entries = ring_entries(out->tx.producer, out->tx.consumer);
+	sample->tx_size = out->tx.size;
+
+	read_xdp_stats(xsk, &worker->prev_xdp_stats, &sample->xdp);
+	if (out != xsk)
+		read_xdp_stats(out, &worker->prev_out_xdp_stats, &sample->xdp);
+}
+
+// Add the sample of a socket to the sample of all sockets.
+static void add_xsk_sample(struct xsk_sample *total, const struct xsk_sample *sample)
+{
+	const struct stats_record *delta = &sample->delta;
+
+	total->delta.rx_packets += delta->rx_packets;
+	total->delta.rx_bytes += delta->rx_bytes;
+	total->delta.tx_packets += delta->tx_packets;
+	total->delta.tx_bytes += delta->tx_bytes;
+	total->delta.syscalls += delta->syscalls;
+	total->delta.latency_sum += delta->latency_sum;
+	total->delta.latency_count += delta->latency_count;
+	if (delta->latency_max > total->delta.latency_max)
+		total->delta.latency_max = delta->latency_max;
+	for (int b = 0; b < BATCH_HIST_BUCKETS; b++) {
+		total->delta.rx_batches[b] += delta->rx_batches[b];
+		total->delta.tx_batches[b] += delta->tx_batches[b];
+	}
+	total->cpu_ns += sample->cpu_ns;
+
+	total->fill_entries += sample->fill_entries;
+	total->fill_size += sample->fill_size;
+	total->rx_entries += sample->rx_entries;
+	total->rx_size += sample->rx_size;
+	total->tx_entries += sample->tx_entries;
+	total->tx_size += sample->tx_size;
+
+	total->xdp.rx_dropped += sample->xdp.rx_dropped;
+	total->xdp.rx_invalid_descs += sample->xdp.rx_invalid_descs;
+	total->xdp.tx_invalid_descs += sample->xdp.tx_invalid_descs;
+	total->xdp.rx_ring_full += sample->xdp.rx_ring_full;
+	total->xdp.rx_fill_ring_empty_descs += sample->xdp.rx_fill_ring_empty_descs;
+	total->xdp.tx_ring_empty_descs += sample->xdp.tx_ring_empty_descs;
+}
+
+// Print the share of the batches in every bucket of a histogram.
+static void print_batch_hist(const char *name, const uint64_t *hist)
+{
+	uint64_t batches = 0;
+	for (int b = 0; b < BATCH_HIST_BUCKETS; b++)
+		batches += hist[b];
+	if (batches == 0)
+		return;
+
+	printf("    %s batches:", name);
+	for (int b = 0; b < BATCH_HIST_BUCKETS; b++)
+		printf(" %s=%.0f%%", batch_hist_labels[b], 100.0*hist[b]/batches);
+}
+
+// Print the statistics of a socket, or of all sockets, in an interval: the
+// packet rates, the CPU time of the threads (100% is one busy CPU), and the
+// one-way latency of the generator frames received on the first line; the
+// sizes of the batches, the ring occupancy, and the drops counted by the kernel
+// on the second one. A fill ring running empty (fill_ring_empty) or a full RX
+// ring (rx_ring_full) tell whether the driver or the socket drops packets.
+static void print_xsk_sample(const char *name, const struct xsk_sample *sample, double interval)
+{
+	const struct stats_record *delta = &sample->delta;
+	uint64_t packets = delta->rx_packets + delta->tx_packets;
+
+	printf("%s rx=%.0f pps tx=%.0f pps (%.3f Gbit/s)    cpu=%.1f%% (%.0f ns/pkt)    syscalls/pkt=%.2f",
+	       name, delta->rx_packets/interval, delta->tx_packets/interval,
+	       (delta->rx_bytes + delta->tx_bytes)*8/interval/1e9, 100.0*sample->cpu_ns/(interval*1e9),
+	       packets > 0 ? (double) sample->cpu_ns/packets : 0.0,
+	       packets > 0 ? (double) delta->syscalls/packets : 0.0);
+	if (delta->latency_count > 0)
+		printf("    latency avg=%.1f us max=%.1f us",
+		       (double) delta->latency_sum/delta->latency_count/1000, delta->latency_max/1000.0);
+	printf("\n");
+
+	const struct xsk_xdp_statistics *xdp = &sample->xdp;
+	printf("    rings fill=%u/%u rx=%u/%u tx=%u/%u    drops rx_dropped=%lu rx_ring_full=%lu "
+	       "fill_ring_empty=%lu invalid_descs=%lu",
+	       sample->fill_entries, sample->fill_size, sample->rx_entries, sample->rx_size,
+	       sample->tx_entries, sample->tx_size, xdp->rx_dropped, xdp->rx_ring_full,
+	       xdp->rx_fill_ring_empty_descs, xdp->rx_invalid_descs + xdp->tx_invalid_descs);
+	print_batch_hist("rx", delta->rx_batches);
+	print_batch_hist("tx", delta->tx_batches);
+	printf("\n");
+}
+
+// Print the statistics of the sockets in the last interval: the sum over all
+// sockets, and every socket if per_queue is set.
+static void print_xsk_stats(struct worker *workers, int nworkers, double interval, bool per_queue)
+{
+	struct xsk_sample total = { 0 };
+	struct xsk_sample *samples = calloc(nworkers, sizeof(*samples));
+	if (samples == NULL)
+		return;
+
+	for (int i = 0; i < nworkers; i++) {
+		sample_xsk(&workers[i], &samples[i]);
+		add_xsk_sample(&total, &samples[i]);
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "XSKs: %d,", nworkers);
+	print_xsk_sample(name, &total, interval);
+	for (int i = 0; per_queue && i < nworkers; i++) {
+		snprintf(name, sizeof(name), "  queue %2u ->", workers[i].xsk->queue);
+		print_xsk_sample(name, &samples[i], interval);
+	}
+	fflush(stdout);
+
+	free(samples);
+}
+
+// Check the frame accounting of the UMEMs after the workers have stopped.
+static void check_frame_pools(struct xsk_umem_info *umems, int numems, struct worker *workers,
+			      int nworkers)
+{
+	struct frame_cache **caches = calloc(nworkers, sizeof(*caches));
+	if (caches == NULL)
+		return;
+
+	for (int i = 0; i < nworkers; i++)
+		caches[i] = &workers[i].xsk->frames;
+	for (int i = 0; i < numems; i++)
+		frame_pool_check(umems[i].pool, caches, nworkers);
+
+	free(caches);
+}
+
+// Open the BPF object file, and load only the program name. A program bound to
+// the device may read the hardware metadata of the packets.
+static struct bpf_object *load_xsk_prog(const struct config *cfg, const char *name, bool dev_bound,
+					struct bpf_program **prog)
+{
+	struct bpf_object *obj = bpf_object__open_file(cfg->filename, NULL);
+	if (libbpf_get_error(obj))
+		return NULL;
+
+	// The section names of the programs (xdp-xsk/...) do not tell libbpf the type.
+	struct bpf_program *p;
+	bpf_object__for_each_program(p, obj) {
+		bpf_program__set_type(p, BPF_PROG_TYPE_XDP);
+		bpf_program__set_autoload(p, strcmp(bpf_program__name(p), name) == 0);
+	}
+	*prog = bpf_object__find_program_by_name(obj, name);
+	if (*prog == NULL)
+		goto err;
+	__u32 flags = bpf_program__flags(*prog);
+	if (dev_bound) {
+		bpf_program__set_ifindex(*prog, cfg->ifindex);
+		flags |= BPF_F_XDP_DEV_BOUND_ONLY;
+	}
+	// Without this flag, the kernel does not redirect multi-buffer packets
+	// to the program, and refuses MTUs larger than a page.
+	if (cfg->xsk_bind_flags & XDP_USE_SG)
+		flags |= BPF_F_XDP_HAS_FRAGS;
+	bpf_program__set_flags(*prog, flags);
+
+	if (bpf_object__load(obj) != 0)
+		goto err;
+	return obj;
+
+err:
+	bpf_object__close(obj);
+	return NULL;
+}
+
+// Load the BPF program and attach it to the device. The program with the RX
+// timestamps of the NIC is bound to the device, which requires Linux 6.3 and
+// native mode. Otherwise, the program with the time of the XDP hook is used.
+static struct bpf_object *load_bpf_and_xdp_attach_xsk(const struct config *cfg, bool *hw_ts)
+{
+	struct bpf_program *prog;
+	struct bpf_object *obj = NULL;
+
+	*hw_ts = false;
+	if (!(cfg->xdp_flags & XDP_FLAGS_SKB_MODE)) {
+		obj = load_xsk_prog(cfg, XDP_PROG_HW_TS_NAME, true, &prog);
+		if (obj != NULL && bpf_xdp_attach(cfg->ifindex, bpf_program__fd(prog), cfg->xdp_flags,
+						  NULL) != 0) {
+			bpf_object__close(obj);
+			obj = NULL;
+		}
+		*hw_ts = (obj != NULL);
+	}
+	if (obj != NULL)
+		return obj;
+
+	obj = load_xsk_prog(cfg, XDP_PROG_NAME, false, &prog);
+	if (obj == NULL) {
+		fprintf(stderr, "Could not load BPF object file %s\n", cfg->filename);
+		return NULL;
+	}
+	if (bpf_xdp_attach(cfg->ifindex, bpf_program__fd(prog), cfg->xdp_flags, NULL) != 0) {
+		perror("Could not attach BPF program");
+		bpf_object__close(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+// Start a worker thread, pinned to worker->cpu if it is not negative.
+static int start_worker(struct worker *worker)
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	if (worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	int err = pthread_create(&worker->thread, &attr, worker_main, worker);
+	pthread_attr_destroy(&attr);
+	if (err == 0)
+		err = pthread_getcpuclockid(worker->thread, &worker->cpu_clock);
+
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	struct config cfg = {
@@ -309,13 +1103,30 @@ int main(int argc, char *argv[])
 		XDP_FLAGS_DRV_MODE,           // Run BPF program in native driver rather than in generic mode 
 		.ifindex   = -1,              // Network device will be defined by program arguments and mapped to interface index
 		.do_unload = false,           // Don't try to unload program first.
-		.xsk_if_queue = 0,            // Redirect this RX queue to XSK.
 	};
 	cfg.ifname[0] = 0;
 	cfg.filename[0] = 0;
 	
 	int opt;
-	while ( (opt = getopt(argc, argv, "d:f:")) != -1 ) {
+	bool per_queue = false;
+	bool shared_umem = false;
+	int first_queue = -1, last_queue = -1; // all queues of the device
+	static int cpus[MAX_CPUS];
+	int ncpus = 0; // threads not pinned
+	bool generator = false;
+	bool forwarding = false;
+	struct config out_cfg = { .ifindex = -1 }; // forward to this device if ifname is set
+	struct gen_config gen;
+	// Options are applied to gen after the device is known.
+	const char *frame_len = NULL, *rate = NULL, *count = NULL, *src_mac = NULL, *dst_mac = NULL;
+	enum wait_mode wait = WAIT_POLL;
+	int busy_poll_budget = BUSY_POLL_DEFAULT_BUDGET;
+	struct logger logger = { .rate = LOG_DEFAULT_RATE };
+	uint64_t num_frames = DEFAULT_NUM_FRAMES;
+	uint32_t frame_size = DEFAULT_FRAME_SIZE;
+	uint32_t headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM;
+	bool unaligned = false;
+	while ( (opt = getopt(argc, argv, "d:f:qQ:c:sm:o:l:r:n:S:D:zkwp:B:L:F:Z:UH:M")) != -1 ) {
 		switch(opt) {
 		case 'd' :
 			strncpy(cfg.ifname, optarg, IF_NAMESIZE);
@@ -323,6 +1134,105 @@ int main(int argc, char *argv[])
 		case 'f' :
 			strncpy(cfg.filename, optarg, sizeof(cfg.filename));
 			break;
+		case 'q' :
+			per_queue = true;
+			break;
+		case 'Q' :
+			if (parse_queue_range(optarg, &first_queue, &last_queue) != 0) {
+				fprintf(stderr, "Invalid queue range %s\n", optarg);
+				return EXIT_FAIL_USAGE;
+			}
+			break;
+		case 'c' :
+			ncpus = parse_cpu_list(optarg, cpus, MAX_CPUS);
+			if (ncpus < 1) {
+				fprintf(stderr, "Invalid CPU list %s\n", optarg);
+				return EXIT_FAIL_USAGE;
+			}
+			break;
+		case 's' :
+			shared_umem = true;
+			break;
+		case 'm' :
+			if (strcmp(optarg, "gen") == 0) {
+				generator = true;
+			} else if (strcmp(optarg, "fwd") == 0) {
+				forwarding = true;
+			} else if (strcmp(optarg, "rx") != 0) {
+				usage(argv[0]);
+				return EXIT_FAIL_USAGE;
+			}
+			break;
+		case 'o' :
+			strncpy(out_cfg.ifname, optarg, IF_NAMESIZE);
+			break;
+		case 'l' :
+			frame_len = optarg;
+			break;
+		case 'r' :
+			rate = optarg;
+			break;
+		case 'n' :
+			count = optarg;
+			break;
+		case 'S' :
+			src_mac = optarg;
+			break;
+		case 'D' :
+			dst_mac = optarg;
+			break;
+		case 'z' :
+			cfg.xsk_bind_flags &= ~XDP_COPY;
+			cfg.xsk_bind_flags |= XDP_ZEROCOPY;
+			break;
+		case 'k' :
+			cfg.xsk_bind_flags &= ~XDP_ZEROCOPY;
+			cfg.xsk_bind_flags |= XDP_COPY;
+			break;
+		case 'w' :
+			cfg.xsk_bind_flags |= XDP_USE_NEED_WAKEUP;
+			break;
+		case 'p' :
+			if (strcmp(optarg, "poll") == 0) {
+				wait = WAIT_POLL;
+			} else if (strcmp(optarg, "busy") == 0) {
+				wait = WAIT_BUSY_POLL;
+			} else if (strcmp(optarg, "spin") == 0) {
+				wait = WAIT_SPIN;
+			} else {
+				usage(argv[0]);
+				return EXIT_FAIL_USAGE;
+			}
+			break;
+		case 'B' :
+			busy_poll_budget = atoi(optarg);
+			if (busy_poll_budget < 1) {
+				fprintf(stderr, "Invalid busy poll budget %s\n", optarg);
+				return EXIT_FAIL_USAGE;
+			}
+			break;
+		case 'L' :
+			logger.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'F' :
+			num_frames = strtoull(optarg, NULL, 0);
+			if (num_frames == 0 || num_frames % POOL_BATCH_SIZE != 0) {
+				fprintf(stderr, "Invalid number of frames %s\n", optarg);
+				return EXIT_FAIL_USAGE;
+			}
+			break;
+		case 'Z' :
+			frame_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'U' :
+			unaligned = true;
+			break;
+		case 'H' :
+			headroom = strtoul(optarg, NULL, 0);
+			break;
+		case 'M' :
+			cfg.xsk_bind_flags |= XDP_USE_SG;
+			break;
 		case ':' :
 		case '?' :
 		default :
@@ -341,6 +1251,19 @@ int main(int argc, char *argv[])
 		return EXIT_FAIL_USAGE;
 	}
 
+	if (frame_size < MIN_FRAME_SIZE || frame_size > MAX_FRAME_SIZE ||
+	    (!unaligned && (frame_size & (frame_size - 1)) != 0)) {
+		fprintf(stderr, "Invalid frame size %u\n", frame_size);
+		return EXIT_FAIL_USAGE;
+	}
+	// The kernel places received packets behind XDP_PACKET_HEADROOM and the
+	// headroom of the UMEM.
+	if (headroom >= frame_size - XDP_PACKET_HEADROOM) {
+		fprintf(stderr, "Headroom %u leaves no room for packets in %u-byte frames\n",
+			headroom, frame_size);
+		return EXIT_FAIL_USAGE;
+	}
+
 	// User has specified all required options.
 
 	// Catch SIGINT when user exits applications (Ctrl-C).
@@ -354,54 +1277,281 @@ int main(int argc, char *argv[])
 		return EXIT_FAIL_DEVICE;
 	}
 
+	if (strlen(out_cfg.ifname) > 0) {
+		if (!forwarding || (out_cfg.ifindex = if_nametoindex(out_cfg.ifname)) == 0) {
+			fprintf(stderr, "Invalid output device %s\n", out_cfg.ifname);
+			return EXIT_FAIL_DEVICE;
+		}
+		// The sockets of the output device share the UMEM and the bind flags
+		// with the ones of the input device.
+		out_cfg.xdp_flags = cfg.xdp_flags;
+	}
+
+	if (generator) {
+		if (gen_init_config(&gen, cfg.ifname) != 0) {
+			perror("Could not get MAC address of device");
+			return EXIT_FAIL_DEVICE;
+		}
+		if (frame_len != NULL)
+			gen.frame_len = strtoul(frame_len, NULL, 0);
+		if (rate != NULL)
+			gen.rate = strtoull(rate, NULL, 0);
+		if (count != NULL)
+			gen.count = strtoull(count, NULL, 0);
+		if ((src_mac != NULL && parse_mac(src_mac, gen.src_mac) != 0) ||
+		    (dst_mac != NULL && parse_mac(dst_mac, gen.dst_mac) != 0)) {
+			fprintf(stderr, "Invalid MAC address\n");
+			return EXIT_FAIL_USAGE;
+		}
+		if (gen.frame_len < GEN_MIN_FRAME_LEN || gen.frame_len > frame_size) {
+			fprintf(stderr, "Frame length must be between %zu and %u\n",
+				GEN_MIN_FRAME_LEN, frame_size);
+			return EXIT_FAIL_USAGE;
+		}
+	}
+
+	// By default, bind an XSK to every RX queue of the device.
+	if (first_queue < 0) {
+		int nqueues = num_rx_queues(cfg.ifname);
+		if (nqueues < 1)
+			nqueues = 1;
+		if (nqueues > MAX_RX_QUEUES) {
+			fprintf(stderr, "Using the first %d of %d RX queues only\n", MAX_RX_QUEUES, nqueues);
+			nqueues = MAX_RX_QUEUES;
+		}
+		first_queue = 0;
+		last_queue = nqueues - 1;
+	}
+	int nsockets = last_queue - first_queue + 1;
+	int numems = shared_umem ? 1 : nsockets;
+
 	// Load BPF program and attach it to network interface using libbpf.
-	struct bpf_object *bpf_obj = load_bpf_and_xdp_attach(&cfg);
+	bool hw_ts;
+	struct bpf_object *bpf_obj = load_bpf_and_xdp_attach_xsk(&cfg, &hw_ts);
 	if (!bpf_obj) {
 		fprintf(stderr, "Could not load and attach BPF program\n");
 		return EXIT_FAIL_BPFLOAD;
 	}
+	// Whether the driver provides timestamps shows per packet (XSK_META_HW_TIMESTAMP).
+	printf("RX timestamps: %sCLOCK_TAI at the XDP hook\n",
+	       hw_ts ? "NIC if supported by the driver, else " : "");
+
+	int exitcode = EXIT_OK;
+	struct umem_region frame_buffer = { 0 };
+	struct xsk_umem_info *umems = NULL;
+	struct worker *workers = NULL;
+	struct queue_poller queues = { 0 };
+	int nstarted = 0;
+	bool logging = !generator && !forwarding && logger.rate > 0;
+	bool logger_started = false;
 
 	int xsk_map_fd = get_map_fd(bpf_obj, "xsk_map");
 	if (xsk_map_fd < 0) {
-		xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
 		fprintf(stderr, "Could not find XSK map\n");
-		return EXIT_FAIL_FINDMAP;
+		exitcode = EXIT_FAIL_FINDMAP;
+		goto out;
 	}
 
+	if (init_queue_poller(&queues, get_map_fd(bpf_obj, "xdp_queue_stats_map"),
+			      cfg.ifname, per_queue) != 0) {
+		fprintf(stderr, "Could not read per-queue statistics\n");
+		exitcode = EXIT_FAIL_FINDMAP;
+		goto out;
+	}
 
-	// Allocate memory for frames.
-	void *frame_buffer;
-	if (posix_memalign(&frame_buffer,
-			   CACHE_LINE_SIZE, // memory aligned to CPU cache line size for faster access 
-                           frame_buffer_size)) {
+	// Allocate memory for the frames of all sockets. UMEMs must be page-aligned.
+	// num_frames*frame_size is a multiple of the page size, unless the size
+	// of unaligned frames is not a power of two. Then, the frames of every
+	// socket are followed by the unused rest of their last page, and room
+	// for the frames left out since they cross a huge page.
+	size_t page_size = getpagesize();
+	uint64_t umem_frames = num_frames + umem_spare_frames(num_frames, frame_size);
+	size_t frame_buffer_size = (umem_frames*frame_size + page_size - 1)/page_size*page_size;
+	size_t buffer_size = nsockets*frame_buffer_size;
+	umems = calloc(numems, sizeof(*umems));
+	workers = calloc(nsockets, sizeof(*workers));
+	logger.rings = calloc(nsockets, sizeof(*logger.rings));
+	if (umems == NULL || workers == NULL || logger.rings == NULL ||
+	    umem_region_alloc(&frame_buffer, buffer_size, cfg.ifname) != 0) {
 		perror("Could not allocate memory for frames");
-		xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
-                return EXIT_FAIL_MEMALLOC;
-        }
+		exitcode = EXIT_FAIL_MEMALLOC;
+		goto out;
+	}
+	printf("UMEM: %zu MiB of %u-byte%s frames on %zu KiB pages, NUMA node %d%s\n",
+	       buffer_size >> 20, frame_size, unaligned ? " unaligned" : "",
+	       frame_buffer.page_size >> 10, frame_buffer.numa_node,
+	       frame_buffer.locked ? ", locked" : "");
+
+	// In zero-copy mode, a frame must not cross into a page that is not
+	// contiguous in DMA address. The pages of a huge page are, so frames
+	// crossing a huge page are left out. Frames crossing base pages would be
+	// too many; they only work in copy mode.
+	size_t cross_page_size = 0;
+	if (umem_spare_frames(num_frames, frame_size) > 0) {
+		if (frame_buffer.page_size > page_size) {
+			cross_page_size = frame_buffer.page_size;
+		} else if (!(cfg.xsk_bind_flags & XDP_COPY)) {
+			fprintf(stderr, "Frames of %u bytes require huge pages (vm.nr_hugepages) "
+				"or copy mode (-k)\n", frame_size);
+			exitcode = EXIT_FAIL_MEMALLOC;
+			goto out;
+		}
+	}
 
         // Initialize UMEM (memory pool) shared between user space application and kernel
 	// and used to transfer packets between user space (this application) and the
-	// kernel (BPF program). 
-        struct xsk_umem_info *umem = configure_xsk_umem(frame_buffer, frame_buffer_size);
-        if (umem == NULL) {
-                fprintf(stderr, "Could not create umem\n");
-		xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
-                exit(EXIT_FAILURE);
-        }
+	// kernel (BPF program). A shared UMEM covers the frames of all sockets, whose
+	// threads take them from the common frame pool. The UMEM is created with its
+	// first socket.
+	for (int i = 0; i < numems; i++) {
+		umems[i].buffer = (uint8_t *) frame_buffer.addr + i*frame_buffer_size;
+		umems[i].size = shared_umem ? buffer_size : frame_buffer_size;
+		umems[i].frame_size = frame_size;
+		umems[i].headroom = headroom;
+		umems[i].unaligned = unaligned;
+		umems[i].pool = frame_pool_create((shared_umem ? nsockets : 1)*num_frames, frame_size,
+						  umems[i].buffer, umems[i].size, cross_page_size);
+		if (umems[i].pool == NULL) {
+			perror("Could not allocate frame pool");
+			exitcode = EXIT_FAIL_MEMALLOC;
+			goto out;
+		}
+	}
 
-        // Open and configure the AF_XDP (xsk) socket
-        struct xsk_socket_info *xsk = xsk_configure_socket(&cfg, umem);
-        if (xsk == NULL) {
-                fprintf(stderr, "Could not create XSK socket\n");
-		xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
-                exit(EXIT_FAIL_SOCKET);
-        }
-	
-	int exitcode = EXIT_OK;
+        // Open and configure one AF_XDP (xsk) socket per RX queue.
+	for (int i = 0; i < nsockets; i++) {
+		struct xsk_umem_info *umem = shared_umem ? &umems[0] : &umems[i];
+		// In generator mode, received packets are not redirected to the sockets.
+		workers[i].xsk = xsk_configure_socket(&cfg, umem, first_queue + i,
+						      generator ? -1 : xsk_map_fd);
+		if (workers[i].xsk == NULL) {
+			fprintf(stderr, "Could not create XSK socket for queue %d: %s\n", first_queue + i,
+				strerror(errno));
+			exitcode = EXIT_FAIL_SOCKET;
+			goto out;
+		}
+		if (wait == WAIT_BUSY_POLL && configure_busy_poll(workers[i].xsk, busy_poll_budget) != 0) {
+			perror("Could not enable busy polling");
+			exitcode = EXIT_FAIL_SOCKET;
+			goto out;
+		}
+		if (logging) {
+			workers[i].xsk->log = log_ring_create();
+			if (workers[i].xsk->log == NULL) {
+				perror("Could not allocate log ring");
+				exitcode = EXIT_FAIL_MEMALLOC;
+				goto out;
+			}
+			logger.rings[logger.nrings++] = workers[i].xsk->log;
+		}
+		if (strlen(out_cfg.ifname) > 0) {
+			// Frames are forwarded without copy, so the output socket
+			// sends from the UMEM of the input socket.
+			out_cfg.xsk_bind_flags = cfg.xsk_bind_flags;
+			workers[i].out = xsk_configure_socket(&out_cfg, umem, first_queue + i, -1);
+			if (workers[i].out == NULL) {
+				fprintf(stderr, "Could not create XSK socket for queue %d of %s: %s\n",
+					first_queue + i, out_cfg.ifname, strerror(errno));
+				exitcode = EXIT_FAIL_SOCKET;
+				goto out;
+			}
+			if (wait == WAIT_BUSY_POLL &&
+			    configure_busy_poll(workers[i].out, busy_poll_budget) != 0) {
+				perror("Could not enable busy polling");
+				exitcode = EXIT_FAIL_SOCKET;
+				goto out;
+			}
+		} else if (forwarding) {
+			workers[i].out = workers[i].xsk;
+		}
+		workers[i].cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+		workers[i].gen = generator ? &gen : NULL;
+		workers[i].wait = wait;
+	}
+	// Without XDP_ZEROCOPY or XDP_COPY, the kernel falls back to copy mode
+	// if the driver does not support zero-copy.
+	printf("XSKs on queues %d-%d: %s mode, need_wakeup %s, multi-buffer %s, waiting by %s\n",
+	       first_queue, last_queue, is_zerocopy(workers[0].xsk) ? "zero-copy" : "copy",
+	       (cfg.xsk_bind_flags & XDP_USE_NEED_WAKEUP) ? "on" : "off",
+	       (cfg.xsk_bind_flags & XDP_USE_SG) ? "on" : "off",
+	       generator ? "spinning (generator)" : wait_mode_names[wait]);
+
+	// The worker threads inherit the signal mask, so only the main thread handles SIGINT.
+	sigset_t sigint, oldmask;
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, &oldmask);
+	if (logging) {
+		if (logger_start(&logger) != 0) {
+			fprintf(stderr, "Could not start logger thread\n");
+			exitcode = EXIT_FAIL_SOCKET;
+			do_exit = 1;
+		} else {
+			logger_started = true;
+		}
+	}
+	for (nstarted = 0; !do_exit && nstarted < nsockets; nstarted++) {
+		if (start_worker(&workers[nstarted]) != 0) {
+			fprintf(stderr, "Could not start thread for queue %u\n",
+				workers[nstarted].xsk->queue);
+			exitcode = EXIT_FAIL_SOCKET;
+			do_exit = 1;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	// Receive and process packets redirected to the XSKs (or send packets)
+	// in the worker threads, and report the statistics in the main thread.
+	struct timespec prev_time, now;
+	clock_gettime(CLOCK_MONOTONIC, &prev_time);
+	while (!do_exit) {
+		poll(NULL, 0, STATS_INTERVAL_MS);
+		if (!generator)
+			print_queue_stats(&queues);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		print_xsk_stats(workers, nsockets, elapsed_sec(&prev_time, &now), per_queue);
+		prev_time = now;
+		// With a packet count, the generator ends when all workers are done.
+		bool done = generator && gen.count > 0;
+		for (int i = 0; done && i < nsockets; i++)
+			done = __atomic_load_n(&workers[i].xsk->stats.tx_packets, __ATOMIC_RELAXED) >= gen.count;
+		if (done)
+			break;
+	}
+
+out:
+	do_exit = 1;
+	for (int i = 0; i < nstarted; i++)
+		pthread_join(workers[i].thread, NULL);
+	// Print the packets the workers have logged before they stopped.
+	if (logger_started)
+		logger_stop(&logger);
+	if (nstarted > 0)
+		check_frame_pools(umems, numems, workers, nsockets);
+	for (int i = 0; workers != NULL && i < nsockets; i++) {
+		if (workers[i].out != NULL && workers[i].out != workers[i].xsk) {
+			xsk_socket__delete(workers[i].out->xsk);
+			free(workers[i].out);
+		}
+		if (workers[i].xsk != NULL) {
+			log_ring_free(workers[i].xsk->log);
+			xsk_socket__delete(workers[i].xsk->xsk);
+			free(workers[i].xsk);
+		}
+	}
+	for (int i = 0; umems != NULL && i < numems; i++) {
+		if (umems[i].umem != NULL)
+			xsk_umem__delete(umems[i].umem);
+		frame_pool_free(umems[i].pool);
+	}
+	free(workers);
+	free(logger.rings);
+	free(umems);
+	umem_region_free(&frame_buffer);
+	free(queues.percpu);
 
-	// Receive and process packets redirected to XSK.
-	receive_and_process_pkts(xsk);
-	
 	// Detach XDP program from interface using libbpf.
 	xdp_link_detach(cfg.ifindex, cfg.xdp_flags, 0);
 
@@ -0,0 +1,411 @@
+#ifndef XSK_USER_H
+#define XSK_USER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <linux/if_ether.h>
+
+#include <bpf/xsk.h>
+
+#define EXIT_OK 0
+#define EXIT_FAIL_BPFLOAD 1
+#define EXIT_FAIL_FINDMAP 2
+#define EXIT_FAIL_FINDELEM 3
+#define EXIT_FAIL_USAGE 4
+#define EXIT_FAIL_DEVICE 5
+#define EXIT_FAIL_SIGNAL 6
+#define EXIT_FAIL_MEMALLOC 7
+#define EXIT_FAIL_SOCKET 8
+
+// Frames per socket and size of the frames (cf. options -F and -Z). In the
+// aligned mode of the UMEM, frames are a power of two between 2 KiB and a page.
+// In the unaligned chunk mode (-U), they may have any size in this range.
+#define DEFAULT_NUM_FRAMES 4096
+#define DEFAULT_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+#define MIN_FRAME_SIZE 2048
+#define MAX_FRAME_SIZE 4096
+#define CACHE_LINE_SIZE 64
+
+// Smallest huge page size (cf. xdp-xsk-umem.c).
+#define HUGE_PAGE_2M (2UL << 20)
+
+// Frames at arbitrary addresses (Linux 5.4). RX addresses carry the offset of
+// the packet in the frame in their upper 16 bits.
+#ifndef XDP_UMEM_UNALIGNED_CHUNK_FLAG
+#define XDP_UMEM_UNALIGNED_CHUNK_FLAG (1 << 0)
+#endif
+
+// Multi-buffer packets (Linux 6.6): a packet larger than a frame spans
+// several descriptors, all but the last one with XDP_PKT_CONTD set.
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
+
+#define INVALID_UMEM_FRAME UINT64_MAX
+
+// Frames move between the global pool and the caches of the sockets in
+// batches of this size (cf. xdp-xsk-pool.c).
+#define POOL_BATCH_SIZE 64
+
+// A batch of frames in the global pool. The sequence number synchronizes
+// producers and consumers of the cell (bounded MPMC queue).
+struct pool_cell {
+	uint64_t seq;
+	uint64_t frames[POOL_BATCH_SIZE];
+};
+
+// Lock-free pool of the free frames of a UMEM, shared by all sockets (and
+// threads) using the UMEM.
+struct frame_pool {
+	uint64_t enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+	struct pool_cell *cells __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint64_t mask; // number of cells - 1
+	uint64_t nframes;
+	uint64_t nslots; // frames of the UMEM up to the last one in the pool, including left out ones
+	uint32_t frame_size;
+#ifdef XSK_POOL_DEBUG
+	// State of every frame (cf. frame_pool_debug_alloc()).
+	uint8_t *frame_state;
+#endif
+};
+
+// Free frames of one socket, only accessed by the thread of the socket. The
+// cache takes a batch from the pool if it is empty, and returns one if it is full.
+struct frame_cache {
+	struct frame_pool *pool;
+	uint32_t nframes;
+	uint64_t frames[2*POOL_BATCH_SIZE];
+};
+
+// Create a pool of nframes frames of frame_size bytes of the UMEM of size
+// bytes at buffer. If page_size is not 0, frames crossing a boundary of pages
+// of this size are left out, so the UMEM needs room for more frames (cf.
+// umem_spare_frames()). nframes must be a multiple of POOL_BATCH_SIZE.
+// Returns NULL on error.
+struct frame_pool *frame_pool_create(uint64_t nframes, uint32_t frame_size, const void *buffer,
+				     uint64_t size, size_t page_size);
+
+// Number of frames of frame_size bytes that may cross a boundary of huge pages
+// in a UMEM of nframes frames. Frames whose size is a power of two never do.
+static inline uint64_t umem_spare_frames(uint64_t nframes, uint32_t frame_size)
+{
+	if ((frame_size & (frame_size - 1)) == 0)
+		return 0;
+	return nframes*frame_size/HUGE_PAGE_2M + 2;
+}
+void frame_pool_free(struct frame_pool *pool);
+
+// Slow paths of the cache: take a batch from the pool (returns false if the
+// pool is empty), and return a batch to the pool.
+bool frame_cache_refill(struct frame_cache *cache);
+void frame_cache_flush(struct frame_cache *cache);
+
+#ifdef XSK_POOL_DEBUG
+// Abort if a frame is handed out twice, or freed twice or at an invalid address.
+void frame_pool_debug_alloc(struct frame_pool *pool, uint64_t frame);
+void frame_pool_debug_free(struct frame_pool *pool, uint64_t frame);
+#endif
+
+// Check that every frame is free or in use after the threads have stopped,
+// and report the frames still in use (in the rings of the sockets or the driver).
+void frame_pool_check(struct frame_pool *pool, struct frame_cache **caches, int ncaches);
+
+static inline uint64_t frame_cache_alloc(struct frame_cache *cache)
+{
+	if (cache->nframes == 0 && !frame_cache_refill(cache))
+		return INVALID_UMEM_FRAME;
+
+	uint64_t frame = cache->frames[--cache->nframes];
+#ifdef XSK_POOL_DEBUG
+	frame_pool_debug_alloc(cache->pool, frame);
+#endif
+	return frame;
+}
+
+static inline void frame_cache_free(struct frame_cache *cache, uint64_t frame)
+{
+#ifdef XSK_POOL_DEBUG
+	frame_pool_debug_free(cache->pool, frame);
+#endif
+	if (cache->nframes == 2*POOL_BATCH_SIZE)
+		frame_cache_flush(cache);
+	cache->frames[cache->nframes++] = frame;
+}
+
+struct xsk_umem_info {
+        struct xsk_umem *umem;
+        void *buffer;
+	uint64_t size;
+	uint32_t frame_size;
+	uint32_t headroom; // in front of received packets, after XDP_PACKET_HEADROOM
+	bool unaligned; // XDP_UMEM_UNALIGNED_CHUNK_FLAG
+	struct frame_pool *pool; // free frames of the UMEM
+};
+
+// Memory backing the UMEMs (cf. xdp-xsk-umem.c).
+struct umem_region {
+	void *addr;
+	size_t size; // multiple of the page size
+	size_t page_size;
+	int numa_node; // node of the memory (-1: unknown)
+	bool locked;
+};
+
+// Allocate at least size bytes for the UMEMs of the sockets of device ifname.
+// The region is on huge pages if possible, on the NUMA node of the device
+// if possible, faulted in, and locked if the limit allows. Returns 0 on success.
+int umem_region_alloc(struct umem_region *region, size_t size, const char *ifname);
+void umem_region_free(struct umem_region *region);
+
+// Written by the thread of the socket, read by the main thread (cf. print_xsk_stats()).
+// Histograms of batch sizes: bucket 0 counts polls of the RX ring that found
+// no packet (or TX batches that found the ring full), bucket b > 0 batches of
+// 2^(b-1) to 2^b - 1 packets, and the last bucket all larger batches.
+#define BATCH_HIST_BUCKETS 8
+
+struct stats_record {
+        uint64_t timestamp;
+        uint64_t rx_packets;
+        uint64_t rx_bytes;
+        uint64_t tx_packets;
+        uint64_t tx_bytes;
+	uint64_t syscalls; // system calls to wait for packets or wake up the kernel
+	// One-way latency of received generator frames in nano-seconds.
+	uint64_t latency_sum;
+	uint64_t latency_count;
+	uint64_t latency_max; // reset by the reader
+	uint64_t rx_batches[BATCH_HIST_BUCKETS]; // polls of the RX ring by packets received
+	uint64_t tx_batches[BATCH_HIST_BUCKETS]; // submissions to the TX ring by packets
+};
+
+struct log_ring;
+
+// Multi-buffer packet being received. Its first fragment, which holds the
+// headers and the metadata, is kept until the last one has arrived, possibly
+// in a later batch of the RX ring.
+struct xsk_rx_pkt {
+	uint64_t addr; // of the first fragment
+	uint32_t first_len; // of the first fragment
+	uint32_t len; // of all fragments so far
+	uint32_t nfrags; // 0: between packets
+};
+
+struct xsk_socket_info {
+        struct xsk_ring_cons rx;
+        struct xsk_ring_prod tx;
+	// Every socket has its own fill and completion ring, even if it shares
+	// the UMEM with other sockets.
+	struct xsk_ring_prod fq;
+	struct xsk_ring_cons cq;
+        struct xsk_umem_info *umem;
+        struct xsk_socket *xsk;
+	uint32_t queue; // RX queue the socket is bound to
+	// Bound with XDP_USE_NEED_WAKEUP: the kernel only needs a system call to
+	// process the rings if it sets the flag in a ring.
+	bool need_wakeup;
+	struct log_ring *log; // received packets are logged if not NULL
+
+	struct frame_cache frames; // free frames taken from the pool of the UMEM
+	struct xsk_rx_pkt rx_pkt;
+
+        uint32_t outstanding_tx;
+
+        struct stats_record stats;
+        struct stats_record prev_stats;
+};
+
+// Set by the signal handler, read by all worker threads.
+extern volatile sig_atomic_t do_exit;
+
+// Take a free frame of the UMEM. Returns INVALID_UMEM_FRAME if none is left.
+static inline uint64_t xsk_alloc_umem_frame(struct xsk_socket_info *xsk)
+{
+	return frame_cache_alloc(&xsk->frames);
+}
+
+// Start of the frame of a descriptor address. In the aligned mode, the address
+// points into the frame. In the unaligned mode, the lower 48 bits are the start
+// of the frame, and the upper 16 bits the offset of the packet.
+static inline uint64_t xsk_frame_addr(const struct xsk_umem_info *umem, uint64_t addr)
+{
+	if (umem->unaligned)
+		return xsk_umem__extract_addr(addr);
+	return addr & ~((uint64_t) umem->frame_size - 1);
+}
+
+// Packet of a descriptor address (the offset is 0 in the aligned mode).
+static inline void *xsk_pkt_data(const struct xsk_umem_info *umem, uint64_t addr)
+{
+	return xsk_umem__get_data(umem->buffer, xsk_umem__add_offset_to_addr(addr));
+}
+
+// Return a frame to the free frames of the UMEM. The address may point into
+// the frame, e.g., the address of a packet after the headroom.
+static inline void xsk_free_umem_frame(struct xsk_socket_info *xsk, uint64_t frame)
+{
+	frame_cache_free(&xsk->frames, xsk_frame_addr(xsk->umem, frame));
+}
+
+// Replenish the fill ring with as many free frames as fit into it. Returns
+// the number of frames added.
+unsigned int replenish_fill_ring(struct xsk_socket_info *xsk);
+
+// With XDP_USE_NEED_WAKEUP, the kernel only needs a system call if it has
+// stopped processing the TX ring. Otherwise, it needs one for every batch
+// (at least in copy mode, where the frames are sent by the system call).
+static inline bool xsk_tx_needs_kick(struct xsk_socket_info *xsk)
+{
+	return !xsk->need_wakeup || xsk_ring_prod__needs_wakeup(&xsk->tx);
+}
+
+// Wake up the kernel to send the frames in the TX ring.
+void xsk_kick_tx(struct xsk_socket_info *xsk);
+
+// Return the frames of sent packets from the completion ring of xsk to the
+// free frames of owner, i.e., the socket whose thread reuses them.
+void xsk_complete_tx(struct xsk_socket_info *xsk, struct xsk_socket_info *owner);
+
+// Forward the packets in the RX ring of xsk to the TX ring of out without
+// copying them. If out is xsk, the MAC addresses are swapped (reflector).
+// Both sockets share the UMEM (cf. xdp-xsk-fwd.c).
+void forward_pkts(struct xsk_socket_info *xsk, struct xsk_socket_info *out);
+
+// Packet generator: every socket sends UDP/IPv4 frames built from a template
+// (cf. xdp-xsk-gen.c).
+struct gen_config {
+	unsigned char src_mac[ETH_ALEN];
+	unsigned char dst_mac[ETH_ALEN];
+	uint32_t frame_len; // length of the frames without FCS
+	uint64_t rate; // packets per second per socket (0: as fast as possible)
+	uint64_t count; // packets per socket (0: until terminated)
+};
+
+// Payload of the generated frames after the UDP header (network byte order),
+// so receivers can detect losses and measure the one-way delay.
+struct gen_payload {
+	uint64_t seq; // sequence number per socket, starting at 0
+	uint64_t timestamp; // time of sending in nano-seconds (TAI clock)
+};
+
+// Ethernet, IPv4 (without options), and UDP header.
+#define GEN_HEADERS_LEN (14 + 20 + 8)
+
+#define GEN_MIN_FRAME_LEN (GEN_HEADERS_LEN + sizeof(struct gen_payload))
+#define GEN_MAX_FRAME_LEN MAX_FRAME_SIZE // further limited by the frame size of the UMEM
+#define GEN_DEFAULT_FRAME_LEN 60 // minimum Ethernet frame without FCS
+
+// Initialize the generator configuration for device ifname: the source MAC
+// address is the one of the device, the destination the broadcast address.
+// Returns 0 on success.
+int gen_init_config(struct gen_config *gen, const char *ifname);
+
+// Extract the payload of a frame sent by the generator (in host byte order).
+// Returns 0 if the frame is one, -1 otherwise.
+int gen_parse_payload(const void *frame, uint32_t len, struct gen_payload *payload);
+
+// Send frames on the socket until do_exit is set or gen->count frames are sent.
+void generate_pkts(struct xsk_socket_info *xsk, const struct gen_config *gen);
+
+// Record of a received packet, written by the thread of the socket and
+// formatted by the logger thread (cf. xdp-xsk-log.c).
+struct log_record {
+	uint32_t queue;
+	uint32_t len;
+	unsigned char src_mac[ETH_ALEN];
+	unsigned char dst_mac[ETH_ALEN];
+	uint16_t proto; // EtherType (host byte order)
+	uint16_t meta_flags; // XSK_META_* of rx_timestamp
+	uint64_t rx_timestamp; // arrival time in nano-seconds (0: unknown)
+};
+
+// Number of records of a log ring (power of two).
+#define LOG_RING_SIZE 4096
+
+// Single-producer single-consumer ring of log records. Head and tail only
+// increase; each side caches the index of the other side, so it only reads
+// the cache line of the other side if the ring seems full (or empty).
+struct log_ring {
+	// Written by the producer.
+	uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t cached_tail;
+	uint64_t dropped; // records lost since the ring was full
+	// Written by the consumer.
+	uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	uint32_t cached_head;
+	struct log_record records[LOG_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+// Append a record to the ring. If the ring is full, the record is dropped
+// (and counted), since the packet path must never wait for the logger.
+static inline void log_ring_push(struct log_ring *ring, const struct log_record *record)
+{
+	uint32_t head = ring->head;
+
+	if (head - ring->cached_tail == LOG_RING_SIZE) {
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head - ring->cached_tail == LOG_RING_SIZE) {
+			__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	ring->records[head & (LOG_RING_SIZE - 1)] = *record;
+	// Publish the record after it is written.
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+struct log_ring *log_ring_create(void);
+void log_ring_free(struct log_ring *ring);
+
+// Thread formatting the records of the log rings, at low priority and at
+// most rate lines per second. Records above the rate are counted only.
+struct logger {
+	pthread_t thread;
+	struct log_ring **rings;
+	int nrings;
+	unsigned int rate;
+	bool stop;
+};
+
+int logger_start(struct logger *logger);
+
+// Stop the logger thread after it has drained the rings.
+void logger_stop(struct logger *logger);
+
+// Add a latency sample of a received frame to the statistics of the socket.
+static inline void xsk_record_latency(struct xsk_socket_info *xsk, uint64_t latency)
+{
+	// Only the thread of the socket writes, so plain read-modify-write
+	// sequences suffice, except for the maximum, which the reader resets.
+	__atomic_store_n(&xsk->stats.latency_sum, xsk->stats.latency_sum + latency, __ATOMIC_RELAXED);
+	__atomic_store_n(&xsk->stats.latency_count, xsk->stats.latency_count + 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&xsk->stats.latency_max, __ATOMIC_RELAXED);
+	while (latency > max && !__atomic_compare_exchange_n(&xsk->stats.latency_max, &max, latency,
+							      true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+// Count a batch of n packets in the histogram hist of the socket's statistics.
+static inline void xsk_record_batch(uint64_t *hist, uint32_t n)
+{
+	int bucket = n == 0 ? 0 : 32 - __builtin_clz(n);
+
+	if (bucket >= BATCH_HIST_BUCKETS)
+		bucket = BATCH_HIST_BUCKETS - 1;
+	__atomic_store_n(&hist[bucket], hist[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+// Count a system call of the thread of the socket.
+static inline void xsk_count_syscall(struct xsk_socket_info *xsk)
+{
+	__atomic_store_n(&xsk->stats.syscalls, xsk->stats.syscalls + 1, __ATOMIC_RELAXED);
+}
+
+#endif
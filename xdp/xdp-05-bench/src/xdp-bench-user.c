@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "xdp-drop_and_count-commons.h"
+
+#define EXIT_OK 0
+#define EXIT_FAIL_BPFLOAD 1
+#define EXIT_FAIL_FINDMAP 2
+#define EXIT_FAIL_USAGE 4
+#define EXIT_FAIL_RUN 5
+
+// Default number of runs of a program per frame.
+#define DEFAULT_REPEAT 1000000
+
+// Maximum size of a test frame (Ethernet frame without FCS).
+#define MAX_FRAME_SIZE 1518
+
+// Object files built by copy_bpf_objects, used if no object files are given.
+static const char *const default_objects[] = {
+	"xdp-pass-bpf.c.o",
+	"xdp-drop_and_count-bpf.c.o",
+	"xdp-xsk-bpf.c.o",
+};
+
+// MAC addresses of the test frames. Frames to the blocked MAC address match the
+// blocklist of xdp-drop_and_count.
+static const unsigned char mac_blocked[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const unsigned char mac_dst[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+static const unsigned char mac_src[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x03 };
+
+// Synthetic frames of the corpus: IPv4/UDP with optional VLAN tags.
+struct bench_frame {
+	const char *name;
+	size_t len; // frame length in bytes
+	int vlan_tags; // number of VLAN tags (0, 1: 802.1Q, 2: 802.1ad + 802.1Q)
+	bool blocked; // destination MAC address is blocked
+};
+
+static const struct bench_frame corpus[] = {
+	{ "udp-64", 64, 0, false },
+	{ "udp-512", 512, 0, false },
+	{ "udp-1518", 1518, 0, false },
+	{ "vlan-64", 64, 1, false },
+	{ "qinq-64", 64, 2, false },
+	{ "vlan-1518", 1518, 1, false },
+	{ "blocked-64", 64, 0, true },
+	{ "blocked-vlan-64", 64, 1, true },
+};
+
+// Stage programs of xdp-drop_and_count (index is enum pipeline_stage).
+static const char *const stage_progs[PIPELINE_MAX_STAGES] = {
+	[PIPELINE_STAGE_BLOCKLIST] = "xdp_stage_blocklist",
+	[PIPELINE_STAGE_PARSE] = "xdp_stage_parse",
+	[PIPELINE_STAGE_SKETCH] = "xdp_stage_sketch",
+	[PIPELINE_STAGE_PSFP] = "xdp_stage_psfp",
+	[PIPELINE_STAGE_ACL] = "xdp_stage_acl",
+	[PIPELINE_STAGE_FILTER] = "xdp_stage_filter",
+	[PIPELINE_STAGE_CAPTURE] = "xdp_stage_capture",
+	[PIPELINE_STAGE_ACTION] = "xdp_stage_action",
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "%s [-r REPEAT] [-c] [OBJECT_FILE...]\n"
+		"  Run the XDP program of each object file on a corpus of synthetic frames\n"
+		"  through BPF_PROG_TEST_RUN and report the time per packet.\n"
+		"  -r: number of runs per frame (default %d)\n"
+		"  -c: print results as CSV\n"
+		"  Without object files, the objects built by this project are used.\n",
+		prog, DEFAULT_REPEAT);
+}
+
+// Write a frame of the corpus to buf. Returns the length of the frame.
+static size_t build_frame(const struct bench_frame *frame, unsigned char *buf)
+{
+	memset(buf, 0, frame->len);
+
+	struct ethhdr *eth = (struct ethhdr *) buf;
+	memcpy(eth->h_dest, frame->blocked ? mac_blocked : mac_dst, ETH_ALEN);
+	memcpy(eth->h_source, mac_src, ETH_ALEN);
+	unsigned char *pos = buf + sizeof(*eth);
+
+	// VLAN tags: outer S-tag for QinQ, inner C-tag with VID 100 and PCP 3.
+	// proto points to the EtherType field preceding the current header.
+	unsigned char *proto = (unsigned char *) &eth->h_proto;
+	for (int i = 0; i < frame->vlan_tags; i++) {
+		bool outer = (i == 0 && frame->vlan_tags > 1);
+		__be16 tpid = htons(outer ? ETH_P_8021AD : ETH_P_8021Q);
+		__be16 tci = htons(outer ? 200 : (3 << 13) | 100);
+		memcpy(proto, &tpid, sizeof(tpid));
+		memcpy(pos, &tci, sizeof(tci));
+		proto = pos + sizeof(tci);
+		pos += 2*sizeof(__be16);
+	}
+	__be16 ip_proto = htons(ETH_P_IP);
+	memcpy(proto, &ip_proto, sizeof(ip_proto));
+
+	size_t l3_len = frame->len - (pos - buf);
+	struct iphdr *ip = (struct iphdr *) pos;
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->tot_len = htons(l3_len);
+	ip->saddr = htonl(0x0a010001); // 10.1.0.1
+	ip->daddr = htonl(0x0a010002); // 10.1.0.2
+
+	struct udphdr *udp = (struct udphdr *) (pos + sizeof(*ip));
+	udp->source = htons(5000);
+	udp->dest = htons(6000);
+	udp->len = htons(l3_len - sizeof(*ip));
+
+	return frame->len;
+}
+
+// Prepare the maps of xdp-drop_and_count: fill the pipeline and block one MAC address.
+static int setup_drop_and_count(struct bpf_object *obj)
+{
+	int pipeline_fd = bpf_object__find_map_fd_by_name(obj, "xdp_pipeline_map");
+	int blocklist_fd = bpf_object__find_map_fd_by_name(obj, "xdp_blocklist_map");
+	int bloom_fd = bpf_object__find_map_fd_by_name(obj, "xdp_blocklist_bloom");
+	if (pipeline_fd < 0 || blocklist_fd < 0 || bloom_fd < 0)
+		return -1;
+
+	// With the default configuration (no ACL and PSFP rules), the blocklist and
+	// action stages are active, as in a freshly loaded instance.
+	for (__u32 stage = 0; stage < PIPELINE_MAX_STAGES; stage++) {
+		if (stage != PIPELINE_STAGE_BLOCKLIST && stage != PIPELINE_STAGE_ACTION)
+			continue;
+		struct bpf_program *prog = bpf_object__find_program_by_name(obj, stage_progs[stage]);
+		if (prog == NULL)
+			return -1;
+		int prog_fd = bpf_program__fd(prog);
+		if (bpf_map_update_elem(pipeline_fd, &stage, &prog_fd, BPF_ANY) != 0)
+			return -1;
+	}
+
+	struct hash_map_key key;
+	uint32_t flags = BLOCKLIST_DST;
+	memcpy(key.addr, mac_blocked, ETH_ALEN);
+	if (bpf_map_update_elem(bloom_fd, NULL, &key, BPF_ANY) != 0 ||
+	    bpf_map_update_elem(blocklist_fd, &key, &flags, BPF_ANY) != 0)
+		return -1;
+
+	return 0;
+}
+
+static const char *action_str(__u32 action)
+{
+	switch (action) {
+	case XDP_ABORTED: return "ABORTED";
+	case XDP_DROP: return "DROP";
+	case XDP_PASS: return "PASS";
+	case XDP_TX: return "TX";
+	case XDP_REDIRECT: return "REDIRECT";
+	default: return "UNKNOWN";
+	}
+}
+
+// Run prog on each frame of the corpus and print the results under label.
+static int bench_corpus(struct bpf_program *prog, const char *label, int repeat, bool csv)
+{
+	unsigned char buf[MAX_FRAME_SIZE];
+	for (size_t i = 0; i < sizeof(corpus)/sizeof(corpus[0]); i++) {
+		size_t len = build_frame(&corpus[i], buf);
+
+		LIBBPF_OPTS(bpf_test_run_opts, opts,
+			    .data_in = buf,
+			    .data_size_in = len,
+			    .repeat = repeat,
+		);
+		if (bpf_prog_test_run_opts(bpf_program__fd(prog), &opts) != 0) {
+			perror("Could not run BPF program");
+			return EXIT_FAIL_RUN;
+		}
+
+		// duration is the average time of a single run in nano-seconds.
+		double mpps = opts.duration > 0 ? 1000.0/opts.duration : 0.0;
+		if (csv)
+			printf("%s,%s,%zu,%s,%u,%.2f\n", label, corpus[i].name, len,
+			       action_str(opts.retval), opts.duration, mpps);
+		else
+			printf("%-28s %-16s %5zu  %-8s %6u ns/pkt %8.2f Mpps\n", label, corpus[i].name,
+			       len, action_str(opts.retval), opts.duration, mpps);
+	}
+
+	return EXIT_OK;
+}
+
+static int bench_object(const char *filename, int repeat, bool csv)
+{
+	struct bpf_object *obj = bpf_object__open_file(filename, NULL);
+	if (libbpf_get_error(obj)) {
+		fprintf(stderr, "Could not open BPF object file %s\n", filename);
+		return EXIT_FAIL_BPFLOAD;
+	}
+
+	int exitcode = EXIT_OK;
+	// The entry program is xdp_prog_main, or the only program of the object.
+	struct bpf_program *prog = bpf_object__find_program_by_name(obj, "xdp_prog_main");
+	if (prog == NULL)
+		prog = bpf_object__next_program(obj, NULL);
+	if (prog == NULL) {
+		fprintf(stderr, "No program in %s\n", filename);
+		exitcode = EXIT_FAIL_BPFLOAD;
+		goto out;
+	}
+
+	// Only the entry program is loaded, and the stages it tail-calls in
+	// xdp-drop_and_count. Other programs might not load without a device,
+	// e.g., xdp_prog_hw_ts of xdp-xsk, which must be bound to one.
+	// Section names like xdp-drop do not tell libbpf the program type.
+	bool pipeline = bpf_object__find_map_by_name(obj, "xdp_pipeline_map") != NULL;
+	// xdp-xsk has no XSK bound in a test run, so its entry program only
+	// measures the XDP_PASS path. xdp_prog_meta measures the work before
+	// the redirect instead.
+	struct bpf_program *meta_prog = bpf_object__find_program_by_name(obj, "xdp_prog_meta");
+	struct bpf_program *p;
+	bpf_object__for_each_program(p, obj) {
+		bpf_program__set_type(p, BPF_PROG_TYPE_XDP);
+		bpf_program__set_autoload(p, p == prog || p == meta_prog || pipeline);
+	}
+
+	if (bpf_object__load(obj) != 0) {
+		fprintf(stderr, "Could not load BPF object file %s\n", filename);
+		exitcode = EXIT_FAIL_BPFLOAD;
+		goto out;
+	}
+
+	if (pipeline && setup_drop_and_count(obj) != 0) {
+		fprintf(stderr, "Could not set up maps of %s\n", filename);
+		exitcode = EXIT_FAIL_FINDMAP;
+		goto out;
+	}
+
+	const char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+	exitcode = bench_corpus(prog, name, repeat, csv);
+	if (exitcode == EXIT_OK && meta_prog != NULL) {
+		char label[PATH_MAX];
+		snprintf(label, sizeof(label), "%s:%s", name, bpf_program__name(meta_prog));
+		exitcode = bench_corpus(meta_prog, label, repeat, csv);
+	}
+
+out:
+	bpf_object__close(obj);
+	return exitcode;
+}
+
+int main(int argc, char *argv[])
+{
+	int repeat = DEFAULT_REPEAT;
+	bool csv = false;
+
+	int opt;
+	while ( (opt = getopt(argc, argv, "r:c")) != -1 ) {
+		switch(opt) {
+		case 'r' :
+			repeat = atoi(optarg);
+			break;
+		case 'c' :
+			csv = true;
+			break;
+		default :
+			usage(argv[0]);
+			return EXIT_FAIL_USAGE;
+		}
+	}
+	if (repeat < 1) {
+		usage(argv[0]);
+		return EXIT_FAIL_USAGE;
+	}
+
+	if (csv)
+		printf("object,frame,bytes,verdict,ns_per_pkt,mpps\n");
+
+	int exitcode = EXIT_OK;
+	if (optind < argc) {
+		for (int i = optind; i < argc && exitcode == EXIT_OK; i++)
+			exitcode = bench_object(argv[i], repeat, csv);
+	} else {
+		for (size_t i = 0; i < sizeof(default_objects)/sizeof(default_objects[0]) &&
+		     exitcode == EXIT_OK; i++)
+			exitcode = bench_object(default_objects[i], repeat, csv);
+	}
+
+	return exitcode;
+}